@@ -0,0 +1,224 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "allocator.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_DEFAULT_CHUNK_SIZE (1024 * 64)
+/* No allocation yet */
+#define ARENA_NONE SIZE_MAX
+
+#define align_up(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+struct ArenaChunk {
+	ArenaChunk *next;
+	size_t cap;
+	size_t used;
+	size_t top; /* Offset of the newest block */
+};
+
+/* Precedes every allocation */
+typedef struct ArenaBlock {
+	ArenaChunk *chunk; /* NULL for large blocks */
+	size_t prev;       /* Offset of the block allocated before this one */
+	bool freed;
+
+	/* Large blocks are allocated one by one and kept in a list */
+	struct ArenaBlock *large_prev;
+	struct ArenaBlock *large_next;
+} ArenaBlock;
+
+#define CHUNK_HEADER_SIZE align_up(sizeof(ArenaChunk))
+#define BLOCK_HEADER_SIZE align_up(sizeof(ArenaBlock))
+
+static inline char *chunk_data(ArenaChunk *chunk)
+{
+	return (char *) chunk + CHUNK_HEADER_SIZE;
+}
+
+static inline ArenaBlock *block_at(ArenaChunk *chunk, size_t offset)
+{
+	return (ArenaBlock *) (chunk_data(chunk) + offset);
+}
+
+static inline ArenaBlock *block_of(void *ptr)
+{
+	return (ArenaBlock *) ((char *) ptr - BLOCK_HEADER_SIZE);
+}
+
+static inline void *block_data(ArenaBlock *block)
+{
+	return (char *) block + BLOCK_HEADER_SIZE;
+}
+
+static inline bool is_top(ArenaBlock *block)
+{
+	ArenaChunk *chunk = block->chunk;
+	return chunk->top != ARENA_NONE && block == block_at(chunk, chunk->top);
+}
+
+static void large_link(Arena *arena, ArenaBlock *block)
+{
+	block->chunk = NULL;
+	block->freed = false;
+	block->large_prev = NULL;
+	block->large_next = arena->large;
+	if (arena->large) arena->large->large_prev = block;
+	arena->large = block;
+}
+
+static void large_unlink(Arena *arena, ArenaBlock *block)
+{
+	if (block->large_prev) block->large_prev->large_next = block->large_next;
+	else arena->large = block->large_next;
+	if (block->large_next) block->large_next->large_prev = block->large_prev;
+}
+
+/*
+ * Allocations bigger than a chunk (frame arrays, the LZMA dictionary) go
+ * straight to the heap, so freeing them returns the memory right away
+ * instead of stranding a chunk.
+ */
+static void *large_alloc(Arena *arena, size_t size)
+{
+	ArenaBlock *block = malloc(BLOCK_HEADER_SIZE + size);
+	if (!block) return NULL;
+	large_link(arena, block);
+	return block_data(block);
+}
+
+static void *arena_alloc(void *ctx, size_t size)
+{
+	Arena *arena = ctx;
+	size_t needed = BLOCK_HEADER_SIZE + align_up(size);
+	if (needed < size) return NULL;
+	if (needed > arena->chunk_size) return large_alloc(arena, size);
+
+	/* Chunks past `current` are empty, left over from a reset */
+	ArenaChunk *chunk = arena->current;
+	while (chunk && chunk->cap - chunk->used < needed) chunk = chunk->next;
+	if (!chunk) {
+		chunk = malloc(CHUNK_HEADER_SIZE + arena->chunk_size);
+		if (!chunk) return NULL;
+		chunk->cap = arena->chunk_size;
+		chunk->used = 0;
+		chunk->top = ARENA_NONE;
+		if (arena->current) {
+			chunk->next = arena->current->next;
+			arena->current->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->head = chunk;
+		}
+	}
+	arena->current = chunk;
+
+	ArenaBlock *block = block_at(chunk, chunk->used);
+	block->chunk = chunk;
+	block->prev = chunk->top;
+	block->freed = false;
+	chunk->top = chunk->used;
+	chunk->used += needed;
+	return block_data(block);
+}
+
+static void arena_free(void *ctx, void *ptr)
+{
+	Arena *arena = ctx;
+	if (!ptr) return;
+	ArenaBlock *block = block_of(ptr);
+	if (!block->chunk) {
+		large_unlink(arena, block);
+		free(block);
+		return;
+	}
+
+	block->freed = true;
+	if (!is_top(block)) return;
+	/* Unwind through every block freed out of order beneath this one */
+	ArenaChunk *chunk = block->chunk;
+	while (chunk->top != ARENA_NONE && block_at(chunk, chunk->top)->freed) {
+		chunk->used = chunk->top;
+		chunk->top = block_at(chunk, chunk->top)->prev;
+	}
+}
+
+static void *arena_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+	Arena *arena = ctx;
+	if (!ptr) return arena_alloc(ctx, new_size);
+
+	ArenaBlock *block = block_of(ptr);
+	size_t needed = BLOCK_HEADER_SIZE + align_up(new_size);
+	if (needed < new_size) return NULL;
+
+	if (!block->chunk && needed > arena->chunk_size) {
+		large_unlink(arena, block);
+		ArenaBlock *moved = realloc(block, BLOCK_HEADER_SIZE + new_size);
+		if (!moved) {
+			large_link(arena, block);
+			return NULL;
+		}
+		large_link(arena, moved);
+		return block_data(moved);
+	}
+
+	if (block->chunk && is_top(block) && block->chunk->cap - block->chunk->top >= needed) {
+		block->chunk->used = block->chunk->top + needed;
+		return ptr;
+	}
+
+	void *moved = arena_alloc(ctx, new_size);
+	if (!moved) return NULL;
+	memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+	arena_free(ctx, ptr);
+	return moved;
+}
+
+void arena_init(Arena *arena, size_t chunk_size)
+{
+	arena->allocator = (Allocator) {
+		.ctx = arena,
+		.alloc = arena_alloc,
+		.realloc = arena_realloc,
+		.free = arena_free,
+	};
+	arena->head = NULL;
+	arena->current = NULL;
+	arena->large = NULL;
+	arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+}
+
+static void free_large(Arena *arena)
+{
+	ArenaBlock *block = arena->large;
+	while (block) {
+		ArenaBlock *next = block->large_next;
+		free(block);
+		block = next;
+	}
+	arena->large = NULL;
+}
+
+void arena_reset(Arena *arena)
+{
+	for (ArenaChunk *chunk = arena->head; chunk; chunk = chunk->next) {
+		chunk->used = 0;
+		chunk->top = ARENA_NONE;
+	}
+	arena->current = arena->head;
+	free_large(arena);
+}
+
+void arena_destroy(Arena *arena)
+{
+	ArenaChunk *chunk = arena->head;
+	while (chunk) {
+		ArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->head = NULL;
+	arena->current = NULL;
+	free_large(arena);
+}
@@ -0,0 +1,86 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "xutils.h"
+
+/*
+ * Allocation hook. Everywhere an `Allocator *` is accepted, NULL means the
+ * heap (`xmalloc`, `xrealloc` and `free`).
+ */
+typedef struct Allocator {
+	void *ctx;
+
+	/* Return NULL on failure
+	 *
+	 * void *alloc(void *ctx, size_t size);
+	 */
+	void *(*alloc)(void *, size_t);
+
+	/* `old_size` is the size `ptr` was last allocated or resized to.
+	 * `ptr` may be NULL. Return NULL on failure, leaving `ptr` intact.
+	 *
+	 * void *realloc(void *ctx, void *ptr, size_t old_size, size_t new_size);
+	 */
+	void *(*realloc)(void *, void *, size_t, size_t);
+
+	/* `ptr` may be NULL
+	 *
+	 * void free(void *ctx, void *ptr);
+	 */
+	void (*free)(void *, void *);
+} Allocator;
+
+static inline void *allocator_alloc(const Allocator *allocator, size_t size)
+{
+	if (!allocator) return xmalloc(size);
+	void *block = allocator->alloc(allocator->ctx, size);
+	if (!block) panic("failed to allocate block... %zu\n", size);
+	return block;
+}
+
+static inline void *allocator_realloc(const Allocator *allocator, void *ptr, size_t old_size, size_t new_size)
+{
+	if (!allocator) return xrealloc(ptr, new_size);
+	void *block = allocator->realloc(allocator->ctx, ptr, old_size, new_size);
+	if (!block) panic("failed to allocate block... %zu\n", new_size);
+	return block;
+}
+
+static inline void allocator_free(const Allocator *allocator, void *ptr)
+{
+	if (!allocator) free(ptr);
+	else allocator->free(allocator->ctx, ptr);
+}
+
+typedef struct ArenaChunk ArenaChunk;
+
+/*
+ * Bump allocator. Everything allocated through `arena.allocator` is
+ * released at once by `arena_reset` or `arena_destroy`.
+ *
+ * Freeing (or shrinking) the newest allocation gives its space back, so
+ * short lived scratch allocated and freed in order doesn't accumulate;
+ * other frees are only noted. Allocations larger than a chunk are made
+ * individually and freed for real.
+ */
+typedef struct Arena {
+	Allocator allocator;
+	ArenaChunk *head;
+	ArenaChunk *current;
+	struct ArenaBlock *large;
+	size_t chunk_size;
+} Arena;
+
+/* `chunk_size` of 0 picks a default */
+void arena_init(Arena *arena, size_t chunk_size);
+
+/* Releases every allocation, keeping the chunks for reuse */
+void arena_reset(Arena *arena);
+
+void arena_destroy(Arena *arena);
+
+#endif
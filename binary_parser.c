@@ -1,4 +1,3 @@
-#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -31,7 +30,7 @@ int binp_read_uleb128(StreamReader *reader, int32_t *output)
 	int shift = 0;
 	while (shift < MAX_SHIFT) {
 		unsigned char b;
-		if (reader->read_n(reader->ctx, 1, &b) != 0) {
+		if (stream_read(reader, 1, &b) != 0) {
 			xerror_sput("Read failed");
 			return -EBIN_PARSER_R_BAD_READ;
 		}
@@ -40,7 +39,7 @@ int binp_read_uleb128(StreamReader *reader, int32_t *output)
 		shift += 7;
 	}
 	unsigned char b;
-	if (reader->read_n(reader->ctx, 1, &b) != 0) {
+	if (stream_read(reader, 1, &b) != 0) {
 		xerror_sput("Read failed");
 		return -EBIN_PARSER_R_BAD_READ;
 	}
@@ -54,10 +53,10 @@ int binp_read_uleb128(StreamReader *reader, int32_t *output)
 	#undef MAX_SHIFT
 }
 
-int binp_read_str(StreamReader *reader, Str *output)
+int binp_read_str_alloc(StreamReader *reader, Str *output, const Allocator *allocator)
 {
 	unsigned char b;
-	if (reader->read_n(reader->ctx, 1, &b) != 0) {
+	if (stream_read(reader, 1, &b) != 0) {
 		xerror_sput("Read failed");
 		return -EBIN_PARSER_R_BAD_READ;
 	}
@@ -66,19 +65,18 @@ int binp_read_str(StreamReader *reader, Str *output)
 		return 1;
 	}
 	int32_t len;
-	if (binp_read_uleb128(reader, &len) < 0) {
+	if (binp_read_uleb128(reader, &len) < 0 || len < 0) {
 		xerror_scat(":Length read bad");
 		return -EBIN_PARSER_R_BAD_LEN;
 	}
-	assert(len >= 0);
 	output->len = (size_t) len;
 	/* XXX: Returns null terminated string for printf purposes
 	 * Should have function to transform Str into cstr w/o
 	 * leaking or copying
 	 */
-	char *s = xmalloc(output->len + 1);
-	if (reader->read_n(reader->ctx, output->len, s) != 0) {
-		free(s);
+	char *s = allocator_alloc(allocator, output->len + 1);
+	if (stream_read(reader, output->len, s) != 0) {
+		allocator_free(allocator, s);
 		xerror_fmt("Could not read %lu bytes into buffer", output->len);
 		return -EBIN_PARSER_R_BAD_READ;
 	}
@@ -87,10 +85,15 @@ int binp_read_str(StreamReader *reader, Str *output)
 	return 0;
 }
 
+int binp_read_str(StreamReader *reader, Str *output)
+{
+	return binp_read_str_alloc(reader, output, NULL);
+}
+
 
 int binp_read_i32(StreamReader *reader, int32_t *output)
 {
-	if (reader->read_n(reader->ctx, 4, output) != 0) {
+	if (stream_read(reader, 4, output) != 0) {
 		xerror_sput("Could not read into int32");
 		return -EBIN_PARSER_R_BAD_READ;
 	}
@@ -100,7 +103,7 @@ int binp_read_i32(StreamReader *reader, int32_t *output)
 
 int binp_read_i64(StreamReader *reader, int64_t *output)
 {
-	if (reader->read_n(reader->ctx, 8, output) != 0) {
+	if (stream_read(reader, 8, output) != 0) {
 		xerror_sput("Could not read into int64");
 		return -EBIN_PARSER_R_BAD_READ;
 	}
@@ -109,7 +112,7 @@ int binp_read_i64(StreamReader *reader, int64_t *output)
 
 int binp_read_u16(StreamReader *reader, uint16_t *output)
 {
-	if (reader->read_n(reader->ctx, 2, output) != 0) {
+	if (stream_read(reader, 2, output) != 0) {
 		xerror_sput("Could not read into uint16");
 		return -EBIN_PARSER_R_BAD_READ;
 	}
@@ -121,7 +124,7 @@ int binp_read_u16(StreamReader *reader, uint16_t *output)
  * 0 for success
  * 1 for null
  */
-int binp_read_byte_array(StreamReader *reader, ByteSlice *output)
+int binp_read_byte_array_alloc(StreamReader *reader, ByteSlice *output, const Allocator *allocator)
 {
 	int32_t len;
 	if (binp_read_i32(reader, &len) < 0) {
@@ -130,62 +133,164 @@ int binp_read_byte_array(StreamReader *reader, ByteSlice *output)
 	}
 	if (len <= 0) return 1;
 	output->len = (size_t) len;
-	output->items = xmalloc(output->len);
-	if (reader->read_n(reader->ctx, output->len, output->items) != 0) {
+	output->items = allocator_alloc(allocator, output->len);
+	if (stream_read(reader, output->len, output->items) != 0) {
 		xerror_fmt("Could not read %lu bytes into array", output->len);
-		free(output->items);
+		allocator_free(allocator, output->items);
 		return -EBIN_PARSER_R_BAD_READ;
 	}
 	return 0;
 }
 
+int binp_read_byte_array(StreamReader *reader, ByteSlice *output)
+{
+	return binp_read_byte_array_alloc(reader, output, NULL);
+}
+
 int binp_read_bool(StreamReader *reader, bool *output)
 {
-	if (reader->read_n(reader->ctx, 1, output) != 0) {
+	/* Any byte but 0 is true; loading one straight into a bool is UB */
+	unsigned char b;
+	if (stream_read(reader, 1, &b) != 0) {
 		xerror_sput("Could not read byte");
 		return -EBIN_PARSER_R_BAD_READ;
 	}
-	*output = *output != 0;
+	*output = b != 0;
 	return 0;
 }
 
-int binp_write_uleb128(StreamWriter *writer, const int32_t input)
+int binp_skip_str(StreamReader *reader)
+{
+	unsigned char b;
+	if (stream_read(reader, 1, &b) != 0) {
+		xerror_sput("Read failed");
+		return -EBIN_PARSER_R_BAD_READ;
+	}
+	if (b == 0) return 1;
+	int32_t len;
+	if (binp_read_uleb128(reader, &len) < 0 || len < 0) {
+		xerror_scat(":Length read bad");
+		return -EBIN_PARSER_R_BAD_LEN;
+	}
+	if (stream_skip(reader, (size_t) len) != 0) {
+		xerror_fmt("Could not skip %lu bytes", (size_t) len);
+		return -EBIN_PARSER_R_BAD_READ;
+	}
+	return 0;
+}
+
+int binp_borrow_str(StreamReader *reader, Str *output)
+{
+	if (!reader->stable) {
+		xerror_sput("Reader cannot lend bytes");
+		return -EBIN_PARSER_R_NOT_BORROWABLE;
+	}
+	unsigned char b;
+	if (stream_read(reader, 1, &b) != 0) {
+		xerror_sput("Read failed");
+		return -EBIN_PARSER_R_BAD_READ;
+	}
+	if (b == 0) {
+		output->items = NULL;
+		output->len = 0;
+		return 1;
+	}
+	int32_t len;
+	if (binp_read_uleb128(reader, &len) < 0 || len < 0) {
+		xerror_scat(":Length read bad");
+		return -EBIN_PARSER_R_BAD_LEN;
+	}
+	const char *s = stream_borrow(reader, (size_t) len);
+	if (!s) {
+		xerror_fmt("Could not borrow %lu bytes", (size_t) len);
+		return -EBIN_PARSER_R_BAD_READ;
+	}
+	output->len = (size_t) len;
+	output->items = (char *) s;
+	return 0;
+}
+
+int binp_borrow_byte_array(StreamReader *reader, ByteSlice *output)
+{
+	if (!reader->stable) {
+		xerror_sput("Reader cannot lend bytes");
+		return -EBIN_PARSER_R_NOT_BORROWABLE;
+	}
+	int32_t len;
+	if (binp_read_i32(reader, &len) < 0) {
+		xerror_scat(":Could not read byte array length");
+		return -EBIN_PARSER_R_BAD_LEN;
+	}
+	if (len <= 0) return 1;
+	const char *items = stream_borrow(reader, (size_t) len);
+	if (!items) {
+		xerror_fmt("Could not borrow %lu bytes", (size_t) len);
+		return -EBIN_PARSER_R_BAD_READ;
+	}
+	output->len = (size_t) len;
+	output->items = (char *) items;
+	return 0;
+}
+
+/* Longest ULEB128 encoding of a 32 bit value */
+#define ULEB128_MAX 5
+
+static size_t encode_uleb128(unsigned char *out, uint32_t n)
 {
-	int32_t n = input;
-	while (1) {
+	size_t len = 0;
+	do {
 		unsigned char b = n & (0xFF >> 1);
 		n >>= 7;
 		if (n != 0) b |= (1 << 7);
-		/* TODO: Think about buffering so it only
-		 * requires one write call
-		 */
-		if (writer->write_n(writer->ctx, 1, &b) < 0) {
-			xerror_sput("Could not write byte into writer");
-			return -EBIN_PARSER_W_WRITE_BYTE;
-		}
-		if (n == 0) break;
+		out[len++] = b;
+	} while (n != 0);
+	return len;
+}
+
+int binp_write_uleb128(StreamWriter *writer, const int32_t input)
+{
+	unsigned char bytes[ULEB128_MAX];
+	size_t len = encode_uleb128(bytes, (uint32_t) input);
+	if (stream_write(writer, len, bytes) < 0) {
+		xerror_sput("Could not write byte into writer");
+		return -EBIN_PARSER_W_WRITE_BYTE;
 	}
 
 	return 0;
 }
 
+/* Strings this short go out with their prefix in a single write */
+#define SHORT_STR_MAX 64
+
 int binp_write_str(StreamWriter *writer, const Str *input)
 {
-	{
-		unsigned char hint_byte = 0x0b;
-		if (!input) hint_byte = 0;
-		if (writer->write_n(writer->ctx, 1, &hint_byte) < 0) {
+	unsigned char bytes[1 + ULEB128_MAX + SHORT_STR_MAX];
+	if (!input) {
+		bytes[0] = 0;
+		if (stream_write(writer, 1, bytes) < 0) {
 			xerror_sput("Could not write byte into writer");
 			return -EBIN_PARSER_W_WRITE_BYTE;
 		}
+		return 0;
+	}
+
+	bytes[0] = 0x0b;
+	size_t len = 1 + encode_uleb128(&bytes[1], (uint32_t) input->len);
+	if (input->len <= SHORT_STR_MAX) {
+		if (input->len > 0) memcpy(&bytes[len], input->items, input->len);
+		if (stream_write(writer, len + input->len, bytes) < 0) {
+			xerror_sput("Could not write full string into writer");
+			return -EBIN_PARSER_W_BAD_WRITE;
+		}
+		return 0;
 	}
 
-	if (binp_write_uleb128(writer, input->len) < 0) {
-		xerror_scat(":Could not write ULEB128 length");
+	if (stream_write(writer, len, bytes) < 0) {
+		xerror_sput("Could not write string header into writer");
 		return -EBIN_PARSER_W_LEN_WRITE;
 	}
 
-	if (writer->write_n(writer->ctx, input->len, input->items) < 0) {
+	if (stream_write(writer, input->len, input->items) < 0) {
 		xerror_sput("Could not write full string into writer");
 		return -EBIN_PARSER_W_BAD_WRITE;
 	}
@@ -195,7 +300,7 @@ int binp_write_str(StreamWriter *writer, const Str *input)
 
 int binp_write_i32(StreamWriter *writer, const int32_t input)
 {
-	if (writer->write_n(writer->ctx, 4, &input) < 0) {
+	if (stream_write(writer, 4, &input) < 0) {
 		xerror_sput("Writer failed");
 		return -EBIN_PARSER_W_BAD_WRITE;
 	}
@@ -204,7 +309,7 @@ int binp_write_i32(StreamWriter *writer, const int32_t input)
 
 int binp_write_i64(StreamWriter *writer, const int64_t input)
 {
-	if (writer->write_n(writer->ctx, 8, &input) < 0) {
+	if (stream_write(writer, 8, &input) < 0) {
 		xerror_sput("Writer failed");
 		return -EBIN_PARSER_W_BAD_WRITE;
 	}
@@ -213,7 +318,7 @@ int binp_write_i64(StreamWriter *writer, const int64_t input)
 
 int binp_write_u16(StreamWriter *writer, const uint16_t input)
 {
-	if (writer->write_n(writer->ctx, 2, &input) < 0) {
+	if (stream_write(writer, 2, &input) < 0) {
 		xerror_sput("Write failed");
 		return -EBIN_PARSER_W_BAD_WRITE;
 	}
@@ -227,7 +332,7 @@ int binp_write_byte_array(StreamWriter *writer, const ByteSlice *input)
 		return -EBIN_PARSER_W_LEN_WRITE;
 	}
 	if (input->len <= 0) return 1;
-	if (writer->write_n(writer->ctx, input->len, input->items) < 0) {
+	if (stream_write(writer, input->len, input->items) < 0) {
 		xerror_sput("Could not write full byte array into writer");
 		return -EBIN_PARSER_W_BAD_WRITE;
 	}
@@ -237,7 +342,7 @@ int binp_write_byte_array(StreamWriter *writer, const ByteSlice *input)
 
 int binp_write_bool(StreamWriter *writer, const bool input)
 {
-	if (writer->write_n(writer->ctx, 1, &input) < 0) {
+	if (stream_write(writer, 1, &input) < 0) {
 		xerror_sput("Write failed");
 		return -EBIN_PARSER_W_BAD_WRITE;
 	}
@@ -11,12 +11,17 @@ enum {
 	EBIN_PARSER_R_BAD_LEN,
 	EBIN_PARSER_R_ULEB128_ENCODE_OVERFLOW,
 	EBIN_PARSER_R_BAD_READ,
+	EBIN_PARSER_R_NOT_BORROWABLE,
 
 	EBIN_PARSER_W_LEN_WRITE,
 	EBIN_PARSER_W_WRITE_BYTE,
 	EBIN_PARSER_W_BAD_WRITE,
 };
 
+/*
+ * Message for the last failed call made by the calling thread; the
+ * pointer is only valid on that thread.
+ */
 const char *binp_error_msg(void);
 
 size_t binp_error_msg_len(void);
@@ -35,6 +40,28 @@ int binp_read_byte_array(StreamReader *reader, ByteSlice *output);
 
 int binp_read_bool(StreamReader *reader, bool *output);
 
+/*
+ * Same as `binp_read_str` and `binp_read_byte_array`, with the bytes
+ * allocated from `allocator` (the heap when NULL).
+ */
+int binp_read_str_alloc(StreamReader *reader, Str *output, const Allocator *allocator);
+
+int binp_read_byte_array_alloc(StreamReader *reader, ByteSlice *output, const Allocator *allocator);
+
+/*
+ * Borrowing variants of `binp_read_str` and `binp_read_byte_array`.
+ *
+ * `output` points into the reader's memory and must not be freed. Only
+ * readers marked `stable` (ie: memory and mmap readers) can lend bytes,
+ * others fail with `EBIN_PARSER_R_NOT_BORROWABLE`.
+ */
+int binp_borrow_str(StreamReader *reader, Str *output);
+
+int binp_borrow_byte_array(StreamReader *reader, ByteSlice *output);
+
+/* Steps over a string without reading it; seeks when the reader can */
+int binp_skip_str(StreamReader *reader);
+
 int binp_write_uleb128(StreamWriter *writer, const int input);
 
 int binp_write_str(StreamWriter *writer, const Str *input);
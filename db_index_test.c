@@ -0,0 +1,346 @@
+/*
+ * Builds a DbIndex over a small synthetic osu!.db and scores.db, then
+ * changes them one at a time and checks that the index follows: slots of
+ * an unchanged database are carried over, a changed one is scanned again,
+ * a database given as NULL drops out, and a damaged index is rebuilt.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xutils.h"
+#include "db_parser.h"
+#include "binary_parser.h"
+#include "stream.h"
+#include "string_builder.h"
+
+#define DB_VERSION 20250108
+
+/* One scores.db beatmap: its hash and the total score of each score */
+typedef struct ScoreGroup {
+	int beatmap;
+	size_t len;
+	int32_t totals[4];
+} ScoreGroup;
+
+static char dir[] = "/tmp/db_index_test.XXXXXX";
+static char osu_db_path[64];
+static char scores_db_path[64];
+static char index_path[64];
+static int failures = 0;
+
+#define check(cond, ...)                       \
+	do {                                   \
+		if (!(cond)) {                 \
+			printf(__VA_ARGS__);   \
+			++failures;            \
+		}                              \
+	} while (0)
+
+static int write_string_builder(void *ctx, size_t size, const void *buf)
+{
+	string_builder_push_str(ctx, (Str) { .items = (char *) buf, .len = size });
+	return 0;
+}
+
+/* Hash of beatmap `n`, in hex */
+static void beatmap_hash(int n, char out[33])
+{
+	snprintf(out, 33, "%08x%08x%08x%08x", n, n * 7919, n * 104729, 0x5eed);
+}
+
+static void put_str(StreamWriter *writer, const char *s)
+{
+	if (!s) {
+		binp_write_str(writer, NULL);
+		return;
+	}
+	Str str = { .items = (char *) s, .len = strlen(s) };
+	binp_write_str(writer, &str);
+}
+
+static void put_byte(StreamWriter *writer, uint8_t b)
+{
+	stream_write(writer, 1, &b);
+}
+
+static void put_file(const char *path, const StringBuilder *sb)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) panic("Could not open %s\n", path);
+	if (fwrite(sb->items, 1, sb->len, f) != sb->len || fclose(f) != 0) panic("Could not write %s\n", path);
+}
+
+/* An osu!.db of the beatmaps in `beatmaps`, each titled by its number */
+static void write_osu_db(const int *beatmaps, size_t len)
+{
+	StringBuilder sb;
+	string_builder_init(&sb);
+	StreamWriter w = { .ctx = &sb, .write_n = write_string_builder };
+	binp_write_i32(&w, DB_VERSION);
+	binp_write_i32(&w, 1);
+	binp_write_bool(&w, true);
+	binp_write_i64(&w, 0);
+	put_str(&w, "player");
+	binp_write_i32(&w, (int32_t) len);
+	for (size_t i = 0; i < len; ++i) {
+		char hash[33];
+		char title[16];
+		beatmap_hash(beatmaps[i], hash);
+		snprintf(title, sizeof(title), "map %d", beatmaps[i]);
+
+		put_str(&w, "artist");
+		put_str(&w, NULL);
+		put_str(&w, title);
+		put_str(&w, NULL);
+		put_str(&w, "creator");
+		put_str(&w, "normal");
+		put_str(&w, "audio.mp3");
+		put_str(&w, hash);
+		put_str(&w, "map.osu");
+		put_byte(&w, 4);
+		for (int j = 0; j < 3; ++j) binp_write_u16(&w, 1);
+		binp_write_i64(&w, 0);
+		float settings[4] = { 9.0f, 4.0f, 5.0f, 8.0f };
+		stream_write(&w, sizeof(settings), settings);
+		double slider_velocity = 1.4;
+		stream_write(&w, sizeof(slider_velocity), &slider_velocity);
+		/* No star ratings */
+		for (int j = 0; j < 4; ++j) binp_write_i32(&w, 0);
+		for (int j = 0; j < 3; ++j) binp_write_i32(&w, 1000);
+		/* No timing points */
+		binp_write_i32(&w, 0);
+		binp_write_i32(&w, beatmaps[i]);
+		binp_write_i32(&w, beatmaps[i]);
+		binp_write_i32(&w, 0);
+		for (int j = 0; j < 4; ++j) put_byte(&w, 9);
+		binp_write_u16(&w, 0);
+		float stack_leniency = 0.7f;
+		stream_write(&w, sizeof(stack_leniency), &stack_leniency);
+		put_byte(&w, 0);
+		put_str(&w, NULL);
+		put_str(&w, NULL);
+		binp_write_u16(&w, 0);
+		put_str(&w, NULL);
+		binp_write_bool(&w, true);
+		binp_write_i64(&w, 0);
+		binp_write_bool(&w, false);
+		put_str(&w, "folder");
+		binp_write_i64(&w, 0);
+		for (int j = 0; j < 5; ++j) binp_write_bool(&w, false);
+		binp_write_i32(&w, 0);
+		put_byte(&w, 0);
+	}
+	binp_write_i32(&w, 0);
+	put_file(osu_db_path, &sb);
+	string_builder_free(&sb);
+}
+
+static void write_scores_db(const ScoreGroup *groups, size_t len)
+{
+	StringBuilder sb;
+	string_builder_init(&sb);
+	StreamWriter w = { .ctx = &sb, .write_n = write_string_builder };
+	binp_write_i32(&w, DB_VERSION);
+	binp_write_i32(&w, (int32_t) len);
+	for (size_t i = 0; i < len; ++i) {
+		char hash[33];
+		beatmap_hash(groups[i].beatmap, hash);
+		put_str(&w, hash);
+		binp_write_i32(&w, (int32_t) groups[i].len);
+		for (size_t j = 0; j < groups[i].len; ++j) {
+			put_byte(&w, 0);
+			binp_write_i32(&w, DB_VERSION);
+			put_str(&w, hash);
+			put_str(&w, "player");
+			put_str(&w, "ffffffffffffffffffffffffffffffff");
+			for (int k = 0; k < 6; ++k) binp_write_u16(&w, 1);
+			binp_write_i32(&w, groups[i].totals[j]);
+			binp_write_u16(&w, 100);
+			binp_write_bool(&w, false);
+			binp_write_i32(&w, 0);
+			put_str(&w, NULL);
+			binp_write_i64(&w, 0);
+			/* No replay */
+			binp_write_i32(&w, -1);
+			binp_write_i64(&w, 0);
+		}
+	}
+	put_file(scores_db_path, &sb);
+	string_builder_free(&sb);
+}
+
+/* Overwrites `path` with garbage of the same size and modification time */
+static void scribble_keeping_stamp(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0) panic("Could not stat %s\n", path);
+	StringBuilder sb;
+	string_builder_init(&sb);
+	for (off_t i = 0; i < st.st_size; ++i) string_builder_push(&sb, (char) 0xff);
+	put_file(path, &sb);
+	string_builder_free(&sb);
+
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	if (utimensat(AT_FDCWD, path, times, 0) < 0) panic("Could not restore times of %s\n", path);
+}
+
+static ino_t index_inode(void)
+{
+	struct stat st;
+	if (stat(index_path, &st) < 0) panic("Could not stat %s\n", index_path);
+	return st.st_ino;
+}
+
+static void open_index(const char *step, const char *osu_db, const char *scores_db, DbIndex *index)
+{
+	int ret = dbp_open_index(index_path, osu_db, scores_db, index);
+	if (ret < 0) panic("%s: dbp_open_index failed: %s\n", step, dbp_error_msg(ret));
+}
+
+/* Beatmap `n` is in osu!.db (when `osu_db` is open) under its own title */
+static void expect_beatmap(const char *step, const DbIndex *index, const OsuDb *osu_db, int n, bool present)
+{
+	char hash[33];
+	beatmap_hash(n, hash);
+	const DbIndexSlot *slot = dbp_index_find_hex(index, hash);
+	bool found = slot && slot->beatmap_offset != 0;
+	check(found == present, "%s: beatmap %d %s osu!.db\n", step, n, present ? "missing from" : "still in");
+	if (!found || !osu_db) return;
+
+	DbBeatmap beatmap;
+	char title[16];
+	snprintf(title, sizeof(title), "map %d", n);
+	if (dbp_osu_db_entry_at(osu_db, (size_t) slot->beatmap_offset, &beatmap) < 0) {
+		check(false, "%s: beatmap %d entry unreadable\n", step, n);
+		return;
+	}
+	check(beatmap.title.len == strlen(title) && memcmp(beatmap.title.items, title, beatmap.title.len) == 0,
+	      "%s: beatmap %d is titled %.*s\n", step, n, (int) beatmap.title.len, beatmap.title.items);
+	dbp_beatmap_destroy(&beatmap);
+}
+
+/* Scores of beatmap `n` in scores.db are `group`, or there are none */
+static void expect_scores(const char *step, const DbIndex *index, int n, const ScoreGroup *group)
+{
+	char hash[33];
+	beatmap_hash(n, hash);
+	const DbIndexSlot *slot = dbp_index_find_hex(index, hash);
+	size_t count = slot ? slot->score_count : 0;
+	size_t expected = group ? group->len : 0;
+	check(count == expected, "%s: beatmap %d has %zu scores, expected %zu\n", step, n, count, expected);
+	if (!group || count != expected) return;
+
+	ScoresDb db;
+	if (dbp_open_scores_db(scores_db_path, &db) < 0 || dbp_scores_seek(&db, slot) < 0) {
+		panic("%s: could not seek scores.db\n", step);
+	}
+	for (size_t i = 0; i < group->len; ++i) {
+		OsuReplay score;
+		if (dbp_scores_next(&db, NULL, &score, 0) != 0) {
+			check(false, "%s: beatmap %d score %zu unreadable\n", step, n, i);
+			break;
+		}
+		check(score.total_score == group->totals[i], "%s: beatmap %d score %zu is %d\n", step, n, i,
+		      score.total_score);
+	}
+	dbp_scores_db_close(&db);
+}
+
+int main(void)
+{
+	if (!mkdtemp(dir)) panic("Could not create %s\n", dir);
+	snprintf(osu_db_path, sizeof(osu_db_path), "%s/osu!.db", dir);
+	snprintf(scores_db_path, sizeof(scores_db_path), "%s/scores.db", dir);
+	snprintf(index_path, sizeof(index_path), "%s/index", dir);
+
+	int beatmaps[] = { 1, 2, 3 };
+	ScoreGroup scores[] = {
+		{ .beatmap = 2, .len = 2, .totals = { 1000, 2000 } },
+		{ .beatmap = 4, .len = 1, .totals = { 4000 } },
+	};
+	write_osu_db(beatmaps, 3);
+	write_scores_db(scores, 2);
+
+	DbIndex index;
+	OsuDb osu_db;
+	open_index("built", osu_db_path, scores_db_path, &index);
+	if (dbp_map_osu_db(osu_db_path, &osu_db) < 0) panic("Could not map osu!.db\n");
+	check(index.len == 4, "built: %zu hashes, expected 4\n", index.len);
+	for (int n = 1; n <= 3; ++n) expect_beatmap("built", &index, &osu_db, n, true);
+	expect_beatmap("built", &index, &osu_db, 4, false);
+	expect_scores("built", &index, 1, NULL);
+	expect_scores("built", &index, 2, &scores[0]);
+	expect_scores("built", &index, 4, &scores[1]);
+	check(dbp_index_find_hex(&index, "00000000000000000000000000000000") == NULL, "built: found a missing hash\n");
+	dbp_index_close(&index);
+
+	/* Nothing changed, the file is opened as is */
+	ino_t inode = index_inode();
+	open_index("unchanged", osu_db_path, scores_db_path, &index);
+	check(index_inode() == inode, "unchanged: index was rebuilt\n");
+	dbp_index_close(&index);
+
+	/* Only scores.db changes; osu!.db can't be read any more, so its
+	 * slots have to be carried over
+	 */
+	ScoreGroup new_scores[] = {
+		{ .beatmap = 2, .len = 3, .totals = { 1100, 2100, 3100 } },
+		{ .beatmap = 5, .len = 1, .totals = { 5000 } },
+	};
+	write_scores_db(new_scores, 2);
+	scribble_keeping_stamp(osu_db_path);
+	open_index("scores changed", osu_db_path, scores_db_path, &index);
+	check(index.len == 4, "scores changed: %zu hashes, expected 4\n", index.len);
+	for (int n = 1; n <= 3; ++n) expect_beatmap("scores changed", &index, NULL, n, true);
+	expect_scores("scores changed", &index, 2, &new_scores[0]);
+	expect_scores("scores changed", &index, 4, NULL);
+	expect_scores("scores changed", &index, 5, &new_scores[1]);
+	dbp_index_close(&index);
+	dbp_osu_db_close(&osu_db);
+
+	/* Only osu!.db changes */
+	int new_beatmaps[] = { 3, 6 };
+	write_osu_db(new_beatmaps, 2);
+	open_index("osu!.db changed", osu_db_path, scores_db_path, &index);
+	if (dbp_map_osu_db(osu_db_path, &osu_db) < 0) panic("Could not map osu!.db\n");
+	expect_beatmap("osu!.db changed", &index, &osu_db, 1, false);
+	expect_beatmap("osu!.db changed", &index, &osu_db, 3, true);
+	expect_beatmap("osu!.db changed", &index, &osu_db, 6, true);
+	expect_scores("osu!.db changed", &index, 2, &new_scores[0]);
+	expect_scores("osu!.db changed", &index, 5, &new_scores[1]);
+	dbp_index_close(&index);
+	dbp_osu_db_close(&osu_db);
+
+	/* osu!.db is no longer given */
+	open_index("osu!.db dropped", NULL, scores_db_path, &index);
+	check(index.len == 2, "osu!.db dropped: %zu hashes, expected 2\n", index.len);
+	expect_beatmap("osu!.db dropped", &index, NULL, 3, false);
+	expect_scores("osu!.db dropped", &index, 2, &new_scores[0]);
+	dbp_index_close(&index);
+
+	/* A damaged index is rebuilt rather than read */
+	StringBuilder junk;
+	string_builder_init(&junk);
+	string_builder_push_cstr(&junk, DBP_INDEX_MAGIC "not an index");
+	put_file(index_path, &junk);
+	string_builder_free(&junk);
+	open_index("damaged", osu_db_path, scores_db_path, &index);
+	check(index.len == 4, "damaged: %zu hashes, expected 4\n", index.len);
+	expect_beatmap("damaged", &index, NULL, 6, true);
+	expect_scores("damaged", &index, 5, &new_scores[1]);
+	dbp_index_close(&index);
+
+	remove(osu_db_path);
+	remove(scores_db_path);
+	remove(index_path);
+	rmdir(dir);
+	printf("db index: %d failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,998 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "db_parser.h"
+#include "binary_parser.h"
+#include "string_builder.h"
+#include "xutils.h"
+
+/* https://github.com/ppy/osu/wiki/Legacy-database-file-structure */
+
+/* Entries stopped being prefixed with their size */
+#define DB_VERSION_NO_ENTRY_SIZE 20191106
+/* Difficulty settings went from bytes to floats and star ratings were added */
+#define DB_VERSION_FLOAT_DIFFICULTY 20140609
+/* Star ratings went from doubles to floats */
+#define DB_VERSION_FLOAT_STARS 20250107
+
+/* Type tags .NET writes ahead of each half of a pair */
+#define TAG_INT 0x08
+#define TAG_FLOAT 0x0c
+#define TAG_DOUBLE 0x0d
+
+#define STRING_PRESENT 0x0b
+
+/* Double bpm, double offset, bool uninherited */
+#define TIMING_POINT_SIZE 17
+
+const char *dbp_error_msg(int error_code)
+{
+	switch (-error_code) {
+	case EDB_DAMAGED_FILE:
+		return "Potentially damaged or corrupt file";
+		break;
+	case EDB_UNKNOWN_FILE:
+		return "Unknown file";
+		break;
+	default:
+		return "Bad db error code";
+	}
+}
+
+static inline size_t star_rating_size(int32_t version)
+{
+	return version >= DB_VERSION_FLOAT_STARS ? 1 + 4 + 1 + 4 : 1 + 4 + 1 + 8;
+}
+
+static int skip(StreamReader *reader, size_t n)
+{
+	if (stream_skip(reader, n) != 0) return -EDB_DAMAGED_FILE;
+	return 0;
+}
+
+static int skip_str(StreamReader *reader)
+{
+	unsigned char b;
+	if (stream_read(reader, 1, &b) != 0) return -EDB_DAMAGED_FILE;
+	if (b == 0) return 0;
+	if (b != STRING_PRESENT) return -EDB_DAMAGED_FILE;
+
+	int32_t len;
+	if (binp_read_uleb128(reader, &len) < 0 || len < 0) return -EDB_DAMAGED_FILE;
+	return skip(reader, (size_t) len);
+}
+
+/* Skips a list of `count` elements of `size` bytes each */
+static int skip_list(StreamReader *reader, size_t size)
+{
+	int32_t count;
+	if (binp_read_i32(reader, &count) < 0 || count < 0) return -EDB_DAMAGED_FILE;
+	if ((size_t) count > reader->buf_len / size) return -EDB_DAMAGED_FILE;
+	return skip(reader, (size_t) count * size);
+}
+
+/*
+ * Steps over one entry, reading only the lengths along the way. Old
+ * databases give the size of each entry up front.
+ */
+static int skip_entry(StreamReader *reader, int32_t version)
+{
+	int ret;
+#define expect(expr)                       \
+	do {                               \
+		ret = expr;                \
+		if (ret < 0) return ret;   \
+	} while (0)
+	if (version < DB_VERSION_NO_ENTRY_SIZE) {
+		int32_t size;
+		if (binp_read_i32(reader, &size) < 0 || size < 0) return -EDB_DAMAGED_FILE;
+		return skip(reader, (size_t) size);
+	}
+
+	/* Artist through .osu file name */
+	for (int i = 0; i < 9; ++i) expect(skip_str(reader));
+	/* Ranked status, object counts and modification time */
+	expect(skip(reader, 1 + 2 * 3 + 8));
+	expect(skip(reader, version >= DB_VERSION_FLOAT_DIFFICULTY ? 4 * 4 : 4));
+	expect(skip(reader, 8));
+	if (version >= DB_VERSION_FLOAT_DIFFICULTY) {
+		for (int i = 0; i < 4; ++i) expect(skip_list(reader, star_rating_size(version)));
+	}
+	/* Drain, total and preview time */
+	expect(skip(reader, 4 * 3));
+	expect(skip_list(reader, TIMING_POINT_SIZE));
+	/* Ids, grades, local offset, stack leniency and mode */
+	expect(skip(reader, 4 * 3 + 4 + 2 + 4 + 1));
+	expect(skip_str(reader));
+	expect(skip_str(reader));
+	expect(skip(reader, 2));
+	expect(skip_str(reader));
+	/* Unplayed, last played and osz2 */
+	expect(skip(reader, 1 + 8 + 1));
+	expect(skip_str(reader));
+	/* Last checked and the five overrides */
+	expect(skip(reader, 8 + 5));
+	if (version < DB_VERSION_FLOAT_DIFFICULTY) expect(skip(reader, 2));
+	/* Last modification time and mania scroll speed */
+	expect(skip(reader, 4 + 1));
+#undef expect
+	return 0;
+}
+
+static int borrow_str(StreamReader *reader, Str *out)
+{
+	int ret = binp_borrow_str(reader, out);
+	if (ret < 0) return -EDB_DAMAGED_FILE;
+	return 0;
+}
+
+/* Reads everything ahead of the entries, leaving `reader` on the first one */
+static int parse_header(StreamReader *reader, const ByteSlice *data, OsuDb *out, int32_t *len)
+{
+	*out = (OsuDb) {0};
+	out->data = *data;
+	memory_reader_init(reader, data);
+
+	if (binp_read_i32(reader, &out->version) < 0 ||
+	    binp_read_i32(reader, &out->folder_count) < 0 ||
+	    binp_read_bool(reader, &out->account_unlocked) < 0 ||
+	    binp_read_i64(reader, &out->unlock_date) < 0 ||
+	    borrow_str(reader, &out->player_name) < 0 ||
+	    binp_read_i32(reader, len) < 0 || *len < 0) {
+		return -EDB_UNKNOWN_FILE;
+	}
+	return 0;
+}
+
+int dbp_parse_osu_db(const ByteSlice *data, OsuDb *out)
+{
+	StreamReader reader;
+	int32_t len;
+	int ret = parse_header(&reader, data, out, &len);
+	if (ret < 0) return ret;
+
+	/* Entries are at least a few dozen bytes, this only guards the allocation */
+	if ((size_t) len > reader.buf_len) return -EDB_DAMAGED_FILE;
+	out->offsets = xmalloc(sizeof(*out->offsets) * ((size_t) len + 1));
+	for (int32_t i = 0; i < len; ++i) {
+		out->offsets[i] = reader.pos;
+		ret = skip_entry(&reader, out->version);
+		if (ret < 0) goto error;
+	}
+	out->len = (size_t) len;
+
+	if (binp_read_i32(&reader, &out->permissions) < 0) {
+		ret = -EDB_DAMAGED_FILE;
+		goto error;
+	}
+	return 0;
+
+error:
+	free(out->offsets);
+	out->offsets = NULL;
+	return ret;
+}
+
+static int open_osu_db(const char *path, OsuDb *out, bool index)
+{
+	MappedFile mapped;
+	if (mapped_file_open(&mapped, path) < 0) return -EDB_UNKNOWN_FILE;
+
+	int ret;
+	if (index) {
+		ret = dbp_parse_osu_db(&mapped.data, out);
+	} else {
+		StreamReader reader;
+		int32_t len;
+		ret = parse_header(&reader, &mapped.data, out, &len);
+	}
+	if (ret < 0) {
+		mapped_file_close(&mapped);
+		return ret;
+	}
+	/* Past the header (or the one pass indexing it), entries are looked
+	 * up wherever they are
+	 */
+	mapped_file_advise_random(&mapped);
+	out->mapped = mapped;
+	return 0;
+}
+
+int dbp_open_osu_db(const char *path, OsuDb *out)
+{
+	return open_osu_db(path, out, true);
+}
+
+int dbp_map_osu_db(const char *path, OsuDb *out)
+{
+	return open_osu_db(path, out, false);
+}
+
+static int read_star_ratings(StreamReader *reader, int32_t version, DbStarRatings *out)
+{
+	int32_t count;
+	if (binp_read_i32(reader, &count) < 0 || count < 0) return -EDB_DAMAGED_FILE;
+	if ((size_t) count > reader->buf_len / star_rating_size(version)) return -EDB_DAMAGED_FILE;
+
+	out->len = 0;
+	out->items = xmalloc(sizeof(*out->items) * ((size_t) count + 1));
+	for (int32_t i = 0; i < count; ++i) {
+		unsigned char int_tag;
+		unsigned char value_tag;
+		DbStarRating *rating = &out->items[i];
+		if (stream_read(reader, 1, &int_tag) != 0 || int_tag != TAG_INT) goto error;
+		if (binp_read_i32(reader, &rating->mods) < 0) goto error;
+		if (stream_read(reader, 1, &value_tag) != 0) goto error;
+		if (version >= DB_VERSION_FLOAT_STARS) {
+			float stars;
+			if (value_tag != TAG_FLOAT || stream_read(reader, 4, &stars) != 0) goto error;
+			rating->stars = stars;
+		} else if (value_tag != TAG_DOUBLE || stream_read(reader, 8, &rating->stars) != 0) {
+			goto error;
+		}
+	}
+	out->len = (size_t) count;
+	return 0;
+
+error:
+	free(out->items);
+	out->items = NULL;
+	return -EDB_DAMAGED_FILE;
+}
+
+static int read_timing_points(StreamReader *reader, DbTimingPoints *out)
+{
+	int32_t count;
+	if (binp_read_i32(reader, &count) < 0 || count < 0) return -EDB_DAMAGED_FILE;
+	if ((size_t) count > reader->buf_len / TIMING_POINT_SIZE) return -EDB_DAMAGED_FILE;
+
+	out->len = (size_t) count;
+	out->items = xmalloc(sizeof(*out->items) * ((size_t) count + 1));
+	/* Size was checked above, so these reads can't fail */
+	for (int32_t i = 0; i < count; ++i) {
+		DbTimingPoint *point = &out->items[i];
+		stream_read(reader, 8, &point->bpm);
+		stream_read(reader, 8, &point->offset);
+		binp_read_bool(reader, &point->uninherited);
+	}
+	return 0;
+}
+
+/* Difficulty settings before `DB_VERSION_FLOAT_DIFFICULTY` were bytes */
+static int read_setting(StreamReader *reader, int32_t version, float *out)
+{
+	if (version >= DB_VERSION_FLOAT_DIFFICULTY) {
+		return stream_read(reader, 4, out) != 0 ? -EDB_DAMAGED_FILE : 0;
+	}
+	unsigned char b;
+	if (stream_read(reader, 1, &b) != 0) return -EDB_DAMAGED_FILE;
+	*out = (float) b;
+	return 0;
+}
+
+static int read_byte(StreamReader *reader, uint8_t *out)
+{
+	return stream_read(reader, 1, out) != 0 ? -EDB_DAMAGED_FILE : 0;
+}
+
+static int read_i16(StreamReader *reader, int16_t *out)
+{
+	return stream_read(reader, 2, out) != 0 ? -EDB_DAMAGED_FILE : 0;
+}
+
+static int read_f32(StreamReader *reader, float *out)
+{
+	return stream_read(reader, 4, out) != 0 ? -EDB_DAMAGED_FILE : 0;
+}
+
+static int read_f64(StreamReader *reader, double *out)
+{
+	return stream_read(reader, 8, out) != 0 ? -EDB_DAMAGED_FILE : 0;
+}
+
+int dbp_osu_db_entry(const OsuDb *db, size_t index, DbBeatmap *out)
+{
+	if (index >= db->len) return -EDB_DAMAGED_FILE;
+	return dbp_osu_db_entry_at(db, db->offsets[index], out);
+}
+
+int dbp_osu_db_entry_at(const OsuDb *db, size_t offset, DbBeatmap *out)
+{
+	int ret = 0;
+	int32_t version = db->version;
+	*out = (DbBeatmap) {0};
+	if (offset >= db->data.len) return -EDB_DAMAGED_FILE;
+
+	ByteSlice rest = {
+		.len = db->data.len - offset,
+		.items = db->data.items + offset,
+	};
+	StreamReader reader_;
+	StreamReader *reader = &reader_;
+	memory_reader_init(reader, &rest);
+
+#define expect(fn, output)                              \
+	do {                                            \
+		if (fn(reader, &output) < 0) {          \
+			ret = -EDB_DAMAGED_FILE;        \
+			goto error;                     \
+		}                                       \
+	} while (0)
+	/* The size was only needed for indexing */
+	if (version < DB_VERSION_NO_ENTRY_SIZE && skip(reader, 4) < 0) {
+		ret = -EDB_DAMAGED_FILE;
+		goto error;
+	}
+
+	expect(borrow_str, out->artist);
+	expect(borrow_str, out->artist_unicode);
+	expect(borrow_str, out->title);
+	expect(borrow_str, out->title_unicode);
+	expect(borrow_str, out->creator);
+	expect(borrow_str, out->difficulty);
+	expect(borrow_str, out->audio_file);
+	expect(borrow_str, out->md5hash);
+	expect(borrow_str, out->osu_file);
+
+	expect(read_byte, out->ranked_status);
+	expect(binp_read_u16, out->hitcircles);
+	expect(binp_read_u16, out->sliders);
+	expect(binp_read_u16, out->spinners);
+	expect(binp_read_i64, out->modified_time);
+
+	if (read_setting(reader, version, &out->approach_rate) < 0 ||
+	    read_setting(reader, version, &out->circle_size) < 0 ||
+	    read_setting(reader, version, &out->hp_drain_rate) < 0 ||
+	    read_setting(reader, version, &out->overall_difficulty) < 0) {
+		ret = -EDB_DAMAGED_FILE;
+		goto error;
+	}
+	expect(read_f64, out->slider_velocity);
+
+	if (version >= DB_VERSION_FLOAT_DIFFICULTY) {
+		for (int i = 0; i < 4; ++i) {
+			ret = read_star_ratings(reader, version, &out->star_ratings[i]);
+			if (ret < 0) goto error;
+		}
+	}
+
+	expect(binp_read_i32, out->drain_time);
+	expect(binp_read_i32, out->total_time);
+	expect(binp_read_i32, out->preview_time);
+	ret = read_timing_points(reader, &out->timing_points);
+	if (ret < 0) goto error;
+
+	expect(binp_read_i32, out->beatmap_id);
+	expect(binp_read_i32, out->beatmap_set_id);
+	expect(binp_read_i32, out->thread_id);
+	for (int i = 0; i < 4; ++i) expect(read_byte, out->grades[i]);
+	expect(read_i16, out->local_offset);
+	expect(read_f32, out->stack_leniency);
+	expect(read_byte, out->mode);
+
+	expect(borrow_str, out->source);
+	expect(borrow_str, out->tags);
+	expect(read_i16, out->online_offset);
+	expect(borrow_str, out->title_font);
+	expect(binp_read_bool, out->unplayed);
+	expect(binp_read_i64, out->last_played);
+	expect(binp_read_bool, out->is_osz2);
+	expect(borrow_str, out->folder);
+	expect(binp_read_i64, out->last_checked);
+
+	expect(binp_read_bool, out->ignore_sound);
+	expect(binp_read_bool, out->ignore_skin);
+	expect(binp_read_bool, out->disable_storyboard);
+	expect(binp_read_bool, out->disable_video);
+	expect(binp_read_bool, out->visual_override);
+	if (version < DB_VERSION_FLOAT_DIFFICULTY && skip(reader, 2) < 0) {
+		ret = -EDB_DAMAGED_FILE;
+		goto error;
+	}
+	expect(binp_read_i32, out->last_modified);
+	expect(read_byte, out->mania_scroll_speed);
+#undef expect
+	return 0;
+
+error:
+	dbp_beatmap_destroy(out);
+	return ret;
+}
+
+void dbp_beatmap_destroy(DbBeatmap *beatmap)
+{
+	for (int i = 0; i < 4; ++i) {
+		free(beatmap->star_ratings[i].items);
+		beatmap->star_ratings[i] = (DbStarRatings) {0};
+	}
+	free(beatmap->timing_points.items);
+	beatmap->timing_points = (DbTimingPoints) {0};
+}
+
+void dbp_osu_db_close(OsuDb *db)
+{
+	free(db->offsets);
+	mapped_file_close(&db->mapped);
+	*db = (OsuDb) {0};
+}
+
+/* Index file layout version */
+#define INDEX_FORMAT_VERSION 1
+
+/* Slots are kept at most half full */
+#define INDEX_MIN_SLOTS 16
+
+/* What a database looked like when the index was built */
+typedef struct IndexStamp {
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} IndexStamp;
+
+/*
+ * Written as is ahead of the slots, in host byte order; the index is a
+ * local cache, and one from a machine of the other order fails the
+ * format version check and is rebuilt
+ */
+typedef struct IndexHeader {
+	char magic[4];
+	uint32_t format_version;
+	uint64_t slot_count;
+	uint64_t len;
+	IndexStamp osu_db;
+	IndexStamp scores_db;
+} IndexHeader;
+
+static int stamp_file(const char *path, IndexStamp *out)
+{
+	*out = (IndexStamp) {0};
+	if (!path) return 0;
+	struct stat st;
+	if (stat(path, &st) < 0) return -EDB_UNKNOWN_FILE;
+	out->size = (uint64_t) st.st_size;
+#if defined(__APPLE__)
+	out->mtime_sec = (int64_t) st.st_mtimespec.tv_sec;
+	out->mtime_nsec = (int64_t) st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	/* Seconds only; the size still catches most rewrites within one */
+	out->mtime_sec = (int64_t) st.st_mtime;
+#else
+	out->mtime_sec = (int64_t) st.st_mtim.tv_sec;
+	out->mtime_nsec = (int64_t) st.st_mtim.tv_nsec;
+#endif
+	return 0;
+}
+
+static bool stamp_eq(const IndexStamp *a, const IndexStamp *b)
+{
+	return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+static inline bool slot_empty(const DbIndexSlot *slot)
+{
+	return slot->beatmap_offset == 0 && slot->scores_offset == 0;
+}
+
+/*
+ * Real MD5s are uniform already, but hand made or damaged ones often share
+ * leading bytes; mixing both halves keeps those from piling up in one run.
+ */
+static inline uint64_t md5_hash(const uint8_t md5[16])
+{
+	uint64_t lo;
+	uint64_t hi;
+	memcpy(&lo, md5, sizeof(lo));
+	memcpy(&hi, md5 + 8, sizeof(hi));
+	uint64_t h = lo ^ hi;
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Linear probing; returns the slot holding `md5` or the empty one it belongs
+ * in. NULL only when a (damaged) table has no empty slot.
+ */
+static inline const DbIndexSlot *probe(const DbIndexSlot *slots, size_t mask, const uint8_t md5[16])
+{
+	size_t i = (size_t) md5_hash(md5) & mask;
+	for (size_t n = 0; n <= mask; ++n) {
+		if (slot_empty(&slots[i]) || memcmp(slots[i].md5, md5, 16) == 0) return &slots[i];
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Tables being built are at most half full, so there is always room */
+static DbIndexSlot *claim(DbIndexSlot *slots, size_t mask, const uint8_t md5[16])
+{
+	DbIndexSlot *slot = (DbIndexSlot *) probe(slots, mask, md5);
+	memcpy(slot->md5, md5, 16);
+	return slot;
+}
+
+static inline int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+int dbp_md5_from_hex(const char *hex, size_t len, uint8_t out[16])
+{
+	if (len != 32) return -EDB_DAMAGED_FILE;
+	for (int i = 0; i < 16; ++i) {
+		int hi = hex_digit(hex[i * 2]);
+		int lo = hex_digit(hex[i * 2 + 1]);
+		if (hi < 0 || lo < 0) return -EDB_DAMAGED_FILE;
+		out[i] = (uint8_t) (hi << 4 | lo);
+	}
+	return 0;
+}
+
+/* MD5 of the entry at `offset`, the eighth string of it */
+static int entry_md5(const OsuDb *db, size_t offset, Str *out)
+{
+	ByteSlice rest = { .len = db->data.len - offset, .items = db->data.items + offset };
+	StreamReader reader;
+	memory_reader_init(&reader, &rest);
+	if (db->version < DB_VERSION_NO_ENTRY_SIZE && skip(&reader, 4) < 0) return -EDB_DAMAGED_FILE;
+	for (int i = 0; i < 7; ++i) {
+		if (skip_str(&reader) < 0) return -EDB_DAMAGED_FILE;
+	}
+	return borrow_str(&reader, out);
+}
+
+static int index_osu_db(DbIndexSlot *slots, size_t mask, const OsuDb *db)
+{
+	for (size_t i = 0; i < db->len; ++i) {
+		Str hash;
+		uint8_t md5[16];
+		if (entry_md5(db, db->offsets[i], &hash) < 0) return -EDB_DAMAGED_FILE;
+		/* Entries without a usable hash can't be looked up anyway */
+		if (dbp_md5_from_hex(hash.items, hash.len, md5) < 0) continue;
+
+		DbIndexSlot *slot = claim(slots, mask, md5);
+		if (slot->beatmap_offset != 0) continue;
+		slot->beatmap_index = (uint32_t) i;
+		slot->beatmap_offset = db->offsets[i];
+	}
+	return 0;
+}
+
+/* https://github.com/ppy/osu/wiki/Legacy-database-file-structure#scoresdb */
+static int scores_db_header(StreamReader *reader, const ByteSlice *data, int32_t *version, int32_t *len)
+{
+	memory_reader_init(reader, data);
+	if (binp_read_i32(reader, version) < 0 || binp_read_i32(reader, len) < 0 || *len < 0) {
+		return -EDB_UNKNOWN_FILE;
+	}
+	if ((size_t) *len > reader->buf_len) return -EDB_DAMAGED_FILE;
+	return 0;
+}
+
+static int index_scores_db(DbIndexSlot *slots, size_t mask, const ByteSlice *data)
+{
+	OsrpContext ctx = {0};
+	StreamReader reader;
+	int32_t version;
+	int32_t len;
+	int ret = scores_db_header(&reader, data, &version, &len);
+	if (ret < 0) goto error;
+
+	for (int32_t i = 0; i < len; ++i) {
+		Str hash;
+		int32_t count;
+		if (borrow_str(&reader, &hash) < 0 || binp_read_i32(&reader, &count) < 0 || count < 0) {
+			ret = -EDB_DAMAGED_FILE;
+			goto error;
+		}
+
+		size_t offset = reader.pos;
+		for (int32_t j = 0; j < count; ++j) {
+			OsuReplay score;
+			if (osrp_parse_score_ctx(&ctx, &reader, &score, 0) < 0) {
+				ret = -EDB_DAMAGED_FILE;
+				goto error;
+			}
+		}
+
+		uint8_t md5[16];
+		if (count == 0 || dbp_md5_from_hex(hash.items, hash.len, md5) < 0) continue;
+		DbIndexSlot *slot = claim(slots, mask, md5);
+		if (slot->scores_offset != 0) continue;
+		slot->score_count = (uint32_t) count;
+		slot->scores_offset = offset;
+	}
+
+error:
+	osrp_context_destroy(&ctx);
+	return ret;
+}
+
+static int write_index(const char *path, const IndexHeader *header, const DbIndexSlot *slots)
+{
+	StringBuilder tmp_path = {0};
+	string_builder_push_cstr(&tmp_path, (char *) path);
+	string_builder_push_cstr(&tmp_path, ".tmp");
+	char *tmp = string_builder_build_cstr(&tmp_path);
+
+	/* Readers either see the old index or the whole new one */
+	int ret = 0;
+	FILE *f = fopen(tmp, "wb");
+	if (!f) {
+		ret = -EDB_UNKNOWN_FILE;
+		goto error;
+	}
+	bool written = fwrite(header, sizeof(*header), 1, f) == 1 &&
+		fwrite(slots, sizeof(*slots), header->slot_count, f) == header->slot_count;
+	if (fclose(f) != 0 || !written || rename(tmp, path) != 0) {
+		remove(tmp);
+		ret = -EDB_UNKNOWN_FILE;
+	}
+
+error:
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Builds the index for the databases stamped `osu_stamp` and `scores_stamp`,
+ * taking the slots of any database that hasn't changed from `old`.
+ */
+static int build_index(const char *path, const DbIndex *old, const char *osu_db_path, const IndexStamp *osu_stamp,
+		       const char *scores_db_path, const IndexStamp *scores_stamp)
+{
+	const IndexHeader *old_header = old ? (const IndexHeader *) old->mapped.data.items : NULL;
+	bool reuse_osu = old_header && stamp_eq(&old_header->osu_db, osu_stamp);
+	bool reuse_scores = old_header && stamp_eq(&old_header->scores_db, scores_stamp);
+
+	int ret = 0;
+	OsuDb db = {0};
+	MappedFile scores = {0};
+	size_t len = 0;
+	if (reuse_osu || reuse_scores) len += old->len;
+	if (osu_db_path && !reuse_osu) {
+		ret = dbp_open_osu_db(osu_db_path, &db);
+		if (ret < 0) return ret;
+		len += db.len;
+	}
+	if (scores_db_path && !reuse_scores) {
+		if (mapped_file_open(&scores, scores_db_path) < 0) {
+			ret = -EDB_UNKNOWN_FILE;
+			goto error;
+		}
+		StreamReader reader;
+		int32_t version;
+		int32_t scores_len;
+		ret = scores_db_header(&reader, &scores.data, &version, &scores_len);
+		if (ret < 0) goto error;
+		len += (size_t) scores_len;
+	}
+
+	size_t slot_count = INDEX_MIN_SLOTS;
+	while (slot_count < len * 2) slot_count *= 2;
+	size_t mask = slot_count - 1;
+	DbIndexSlot *slots = xmalloc(sizeof(*slots) * slot_count);
+	memset(slots, 0, sizeof(*slots) * slot_count);
+
+	if (reuse_osu || reuse_scores) {
+		for (size_t i = 0; i <= old->slot_mask; ++i) {
+			const DbIndexSlot *from = &old->slots[i];
+			if (reuse_osu && from->beatmap_offset != 0) {
+				DbIndexSlot *slot = claim(slots, mask, from->md5);
+				slot->beatmap_index = from->beatmap_index;
+				slot->beatmap_offset = from->beatmap_offset;
+			}
+			if (reuse_scores && from->scores_offset != 0) {
+				DbIndexSlot *slot = claim(slots, mask, from->md5);
+				slot->score_count = from->score_count;
+				slot->scores_offset = from->scores_offset;
+			}
+		}
+	}
+	if (db.offsets) {
+		ret = index_osu_db(slots, mask, &db);
+		if (ret < 0) goto error_slots;
+	}
+	if (scores.data.items) {
+		ret = index_scores_db(slots, mask, &scores.data);
+		if (ret < 0) goto error_slots;
+	}
+
+	IndexHeader header = {
+		.magic = DBP_INDEX_MAGIC,
+		.format_version = INDEX_FORMAT_VERSION,
+		.slot_count = slot_count,
+		.osu_db = *osu_stamp,
+		.scores_db = *scores_stamp,
+	};
+	for (size_t i = 0; i < slot_count; ++i) header.len += !slot_empty(&slots[i]);
+	ret = write_index(path, &header, slots);
+
+error_slots:
+	free(slots);
+error:
+	mapped_file_close(&scores);
+	dbp_osu_db_close(&db);
+	return ret;
+}
+
+/* Maps the index at `path`, failing unless it is complete */
+static int map_index(const char *path, DbIndex *out)
+{
+	*out = (DbIndex) {0};
+	if (mapped_file_open(&out->mapped, path) < 0) return -EDB_UNKNOWN_FILE;
+	/* Probes land anywhere in the slots */
+	mapped_file_advise_random(&out->mapped);
+
+	const IndexHeader *header = (const IndexHeader *) out->mapped.data.items;
+	size_t size = out->mapped.data.len;
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, DBP_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->format_version != INDEX_FORMAT_VERSION ||
+	    header->slot_count < INDEX_MIN_SLOTS ||
+	    (header->slot_count & (header->slot_count - 1)) != 0 ||
+	    (size - sizeof(*header)) / sizeof(DbIndexSlot) != header->slot_count ||
+	    (size - sizeof(*header)) % sizeof(DbIndexSlot) != 0 ||
+	    header->len >= header->slot_count) {
+		dbp_index_close(out);
+		return -EDB_DAMAGED_FILE;
+	}
+	out->len = (size_t) header->len;
+	out->slot_mask = (size_t) header->slot_count - 1;
+	out->slots = (const DbIndexSlot *) (out->mapped.data.items + sizeof(*header));
+	return 0;
+}
+
+int dbp_open_index(const char *path, const char *osu_db_path, const char *scores_db_path, DbIndex *out)
+{
+	IndexStamp osu_stamp;
+	IndexStamp scores_stamp;
+	if (stamp_file(osu_db_path, &osu_stamp) < 0) return -EDB_UNKNOWN_FILE;
+	if (stamp_file(scores_db_path, &scores_stamp) < 0) return -EDB_UNKNOWN_FILE;
+
+	DbIndex old;
+	bool have_old = map_index(path, &old) == 0;
+	if (have_old) {
+		const IndexHeader *header = (const IndexHeader *) old.mapped.data.items;
+		if (stamp_eq(&header->osu_db, &osu_stamp) && stamp_eq(&header->scores_db, &scores_stamp)) {
+			*out = old;
+			return 0;
+		}
+	}
+
+	int ret = build_index(path, have_old ? &old : NULL, osu_db_path, &osu_stamp, scores_db_path, &scores_stamp);
+	if (have_old) dbp_index_close(&old);
+	if (ret < 0) return ret;
+	return map_index(path, out);
+}
+
+const DbIndexSlot *dbp_index_find(const DbIndex *index, const uint8_t md5[16])
+{
+	if (!index->slots) return NULL;
+	const DbIndexSlot *slot = probe(index->slots, index->slot_mask, md5);
+	return slot && !slot_empty(slot) ? slot : NULL;
+}
+
+const DbIndexSlot *dbp_index_find_hex(const DbIndex *index, const char hash[32])
+{
+	uint8_t md5[16];
+	if (dbp_md5_from_hex(hash, 32, md5) < 0) return NULL;
+	return dbp_index_find(index, md5);
+}
+
+void dbp_index_close(DbIndex *index)
+{
+	mapped_file_close(&index->mapped);
+	*index = (DbIndex) {0};
+}
+
+/*
+ * Smallest a score can be: two 32 character hashes, an empty player name
+ * and HP graph, and the fixed fields
+ */
+#define SCORE_SIZE_MIN (1 + 4 + 34 + 1 + 34 + 2 * 6 + 4 + 2 + 1 + 4 + 1 + 8 + 4 + 8)
+
+static int open_scores(ScoresDb *out)
+{
+	int32_t len;
+	int ret = scores_db_header(&out->reader, &out->data, &out->version, &len);
+	if (ret < 0) return ret;
+	out->len = (size_t) len;
+	out->beatmaps_left = (size_t) len;
+	out->scores_left = 0;
+	return 0;
+}
+
+int dbp_parse_scores_db(const ByteSlice *data, ScoresDb *out)
+{
+	*out = (ScoresDb) {0};
+	out->data = *data;
+	return open_scores(out);
+}
+
+int dbp_open_scores_db(const char *path, ScoresDb *out)
+{
+	*out = (ScoresDb) {0};
+	if (mapped_file_open(&out->mapped, path) < 0) return -EDB_UNKNOWN_FILE;
+	out->data = out->mapped.data;
+	int ret = open_scores(out);
+	if (ret < 0) dbp_scores_db_close(out);
+	return ret;
+}
+
+int dbp_scores_next_beatmap(ScoresDb *db, Str *md5, size_t *count)
+{
+	OsrpContext ctx = {0};
+	int ret = 0;
+	while (db->scores_left > 0) {
+		OsuReplay score;
+		if ((ret = osrp_parse_score_ctx(&ctx, &db->reader, &score, 0)) < 0) break;
+		--db->scores_left;
+	}
+	osrp_context_destroy(&ctx);
+	if (ret < 0) return -EDB_DAMAGED_FILE;
+	if (db->beatmaps_left == 0) return 1;
+
+	int32_t n;
+	if (borrow_str(&db->reader, md5) < 0) return -EDB_DAMAGED_FILE;
+	if (binp_read_i32(&db->reader, &n) < 0 || n < 0) return -EDB_DAMAGED_FILE;
+	if ((size_t) n > db->reader.buf_len / SCORE_SIZE_MIN) return -EDB_DAMAGED_FILE;
+	--db->beatmaps_left;
+	db->scores_left = (size_t) n;
+	*count = (size_t) n;
+	return 0;
+}
+
+int dbp_scores_seek(ScoresDb *db, const DbIndexSlot *slot)
+{
+	if (slot->scores_offset == 0 || slot->scores_offset >= db->data.len) return -EDB_DAMAGED_FILE;
+	ByteSlice rest = {
+		.len = db->data.len - (size_t) slot->scores_offset,
+		.items = db->data.items + slot->scores_offset,
+	};
+	memory_reader_init(&db->reader, &rest);
+	db->beatmaps_left = 0;
+	db->scores_left = slot->score_count;
+	return 0;
+}
+
+int dbp_scores_next(ScoresDb *db, OsrpContext *ctx, OsuReplay *out, unsigned keep)
+{
+	if (db->scores_left == 0) return 1;
+	OsrpContext heap = {0};
+	int ret = osrp_parse_score_ctx(ctx ? ctx : &heap, &db->reader, out, keep);
+	osrp_context_destroy(&heap);
+	if (ret < 0) return -EDB_DAMAGED_FILE;
+	--db->scores_left;
+	return 0;
+}
+
+void dbp_scores_db_close(ScoresDb *db)
+{
+	mapped_file_close(&db->mapped);
+	*db = (ScoresDb) {0};
+}
+
+/* Grows every selected column to hold at least `cap` scores */
+static void score_columns_reserve(ScoreColumns *out, size_t cap)
+{
+	if (cap <= out->cap) return;
+	if (cap < out->cap * 2) cap = out->cap * 2;
+	if (cap < 256) cap = 256;
+#define grow(column) \
+	if (out->column) out->column = xrealloc(out->column, sizeof(*out->column) * cap)
+	grow(beatmap);
+	grow(mode);
+	grow(total_score);
+	grow(max_combo);
+	grow(mods);
+	grow(count300);
+	grow(count100);
+	grow(count50);
+	grow(count_geki);
+	grow(count_katu);
+	grow(count_miss);
+	grow(is_perfect);
+	grow(date_time);
+	grow(online_id);
+#undef grow
+	out->cap = cap;
+}
+
+int dbp_scores_db_columns(const ScoresDb *db, unsigned columns, ScoreColumns *out)
+{
+	*out = (ScoreColumns) {0};
+	/* Non-NULL marks a selected column; the first reserve allocates it */
+#define pick(flag, column) \
+	if (columns & (flag)) out->column = xmalloc(sizeof(*out->column))
+	pick(DBP_SCORE_BEATMAP, beatmap);
+	pick(DBP_SCORE_MODE, mode);
+	pick(DBP_SCORE_TOTAL, total_score);
+	pick(DBP_SCORE_COMBO, max_combo);
+	pick(DBP_SCORE_MODS, mods);
+	pick(DBP_SCORE_COUNTS, count300);
+	pick(DBP_SCORE_COUNTS, count100);
+	pick(DBP_SCORE_COUNTS, count50);
+	pick(DBP_SCORE_COUNTS, count_geki);
+	pick(DBP_SCORE_COUNTS, count_katu);
+	pick(DBP_SCORE_COUNTS, count_miss);
+	pick(DBP_SCORE_PERFECT, is_perfect);
+	pick(DBP_SCORE_DATE, date_time);
+	pick(DBP_SCORE_ONLINE_ID, online_id);
+#undef pick
+	out->cap = 1;
+
+	OsrpContext ctx = {0};
+	ScoresDb scan;
+	int ret = dbp_parse_scores_db(&db->data, &scan);
+	if (ret < 0) goto error;
+
+	Str md5;
+	size_t count;
+	for (uint32_t beatmap = 0; (ret = dbp_scores_next_beatmap(&scan, &md5, &count)) == 0; ++beatmap) {
+		for (size_t i = 0; i < count; ++i) {
+			OsuReplay score;
+			if (osrp_parse_score_ctx(&ctx, &scan.reader, &score, 0) < 0) {
+				ret = -EDB_DAMAGED_FILE;
+				goto error;
+			}
+			--scan.scores_left;
+
+			/* Grown per score, a damaged count can't reserve much */
+			size_t j = out->len++;
+			if (j >= out->cap) score_columns_reserve(out, j + 1);
+			if (out->beatmap) out->beatmap[j] = beatmap;
+			if (out->mode) out->mode[j] = score.mode;
+			if (out->total_score) out->total_score[j] = score.total_score;
+			if (out->max_combo) out->max_combo[j] = score.max_combo;
+			if (out->mods) out->mods[j] = score.mod_bitfield;
+			if (out->count300) {
+				out->count300[j] = score.count300;
+				out->count100[j] = score.count100;
+				out->count50[j] = score.count50;
+				out->count_geki[j] = score.count_geki;
+				out->count_katu[j] = score.count_katu;
+				out->count_miss[j] = score.count_miss;
+			}
+			if (out->is_perfect) out->is_perfect[j] = score.is_perfect;
+			if (out->date_time) out->date_time[j] = score.date_time;
+			if (out->online_id) out->online_id[j] = score.online_id;
+		}
+	}
+	if (ret < 0) goto error;
+	osrp_context_destroy(&ctx);
+	return 0;
+
+error:
+	osrp_context_destroy(&ctx);
+	dbp_score_columns_destroy(out);
+	return ret;
+}
+
+void dbp_score_columns_destroy(ScoreColumns *columns)
+{
+	free(columns->beatmap);
+	free(columns->mode);
+	free(columns->total_score);
+	free(columns->max_combo);
+	free(columns->mods);
+	free(columns->count300);
+	free(columns->count100);
+	free(columns->count50);
+	free(columns->count_geki);
+	free(columns->count_katu);
+	free(columns->count_miss);
+	free(columns->is_perfect);
+	free(columns->date_time);
+	free(columns->online_id);
+	*columns = (ScoreColumns) {0};
+}
@@ -0,0 +1,281 @@
+#ifndef DB_PARSER_H
+#define DB_PARSER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "string_builder.h"
+#include "stream.h"
+#include "osr_parser.h"
+
+enum {
+	EDB_DAMAGED_FILE = 1, /* Headers valid; bad data */
+	EDB_UNKNOWN_FILE,     /* Headers invalid */
+};
+
+/* Star ratings of a beatmap with a given mod combination */
+typedef struct DbStarRating {
+	int32_t mods;
+	double stars; /* NOTE: Stored as a float since 20250107 */
+} DbStarRating;
+
+typedef struct DbStarRatings {
+	size_t len;
+	DbStarRating *items;
+} DbStarRatings;
+
+typedef struct DbTimingPoint {
+	double bpm;
+	double offset;
+	bool uninherited;
+} DbTimingPoint;
+
+typedef struct DbTimingPoints {
+	size_t len;
+	DbTimingPoint *items;
+} DbTimingPoints;
+
+/*
+ * One osu!.db entry. Strings point into the database and stay valid until
+ * it is closed; the lists are allocated, release with `dbp_beatmap_destroy`.
+ *
+ * Fields the format didn't have yet in `version` are left 0.
+ */
+typedef struct DbBeatmap {
+	Str artist;
+	Str artist_unicode;
+	Str title;
+	Str title_unicode;
+	Str creator;
+	Str difficulty;
+	Str audio_file;
+	Str md5hash;
+	Str osu_file;
+
+	uint8_t ranked_status;
+	uint16_t hitcircles;
+	uint16_t sliders;
+	uint16_t spinners;
+	int64_t modified_time; /* Windows ticks */
+
+	float approach_rate;
+	float circle_size;
+	float hp_drain_rate;
+	float overall_difficulty;
+	double slider_velocity;
+
+	DbStarRatings star_ratings[4]; /* Indexed by `MODE_*` */
+
+	int32_t drain_time;   /* Seconds */
+	int32_t total_time;   /* Milliseconds */
+	int32_t preview_time; /* Milliseconds */
+	DbTimingPoints timing_points;
+
+	int32_t beatmap_id;
+	int32_t beatmap_set_id;
+	int32_t thread_id;
+	uint8_t grades[4]; /* Indexed by `MODE_*` */
+	int16_t local_offset;
+	float stack_leniency;
+	uint8_t mode;
+
+	Str source;
+	Str tags;
+	int16_t online_offset;
+	Str title_font;
+	bool unplayed;
+	int64_t last_played; /* Windows ticks */
+	bool is_osz2;
+	Str folder;
+	int64_t last_checked; /* Windows ticks */
+
+	bool ignore_sound;
+	bool ignore_skin;
+	bool disable_storyboard;
+	bool disable_video;
+	bool visual_override;
+	int32_t last_modified;
+	uint8_t mania_scroll_speed;
+} DbBeatmap;
+
+/*
+ * An osu!.db with the offset of every entry. Entries are only decoded by
+ * `dbp_osu_db_entry`, so looking one up costs the same whatever the size
+ * of the database.
+ *
+ * Release with `dbp_osu_db_close`.
+ */
+typedef struct OsuDb {
+	int32_t version;
+	int32_t folder_count;
+	bool account_unlocked;
+	int64_t unlock_date; /* Windows ticks */
+	Str player_name;
+	int32_t permissions;
+
+	size_t len;
+	size_t *offsets; /* Of each entry in `data` */
+
+	ByteSlice data;
+	MappedFile mapped; /* Set by `dbp_open_osu_db` and `dbp_map_osu_db` */
+} OsuDb;
+
+const char *dbp_error_msg(int error_code);
+
+/* Memory maps `path` and indexes it */
+int dbp_open_osu_db(const char *path, OsuDb *out);
+
+/* Indexes `data` in place; `data` must outlive `out` */
+int dbp_parse_osu_db(const ByteSlice *data, OsuDb *out);
+
+/*
+ * Maps `path` and reads only its header; `len` and `permissions` are
+ * left 0. Entries are
+ * reached through `dbp_osu_db_entry_at` with offsets from a `DbIndex`.
+ */
+int dbp_map_osu_db(const char *path, OsuDb *out);
+
+int dbp_osu_db_entry(const OsuDb *db, size_t index, DbBeatmap *out);
+
+/* Decodes the entry starting `offset` bytes into `db->data` */
+int dbp_osu_db_entry_at(const OsuDb *db, size_t offset, DbBeatmap *out);
+
+void dbp_beatmap_destroy(DbBeatmap *beatmap);
+
+void dbp_osu_db_close(OsuDb *db);
+
+#define DBP_INDEX_MAGIC "OSDI"
+
+/*
+ * Where a beatmap hash appears in osu!.db and scores.db. Offsets are 0
+ * when the beatmap isn't in that database (no entry starts at 0).
+ */
+typedef struct DbIndexSlot {
+	uint8_t md5[16];
+	uint32_t beatmap_index;
+	uint32_t score_count;
+	uint64_t beatmap_offset; /* For `dbp_osu_db_entry_at` */
+	uint64_t scores_offset;  /* Of the first score of the beatmap */
+} DbIndexSlot;
+
+/*
+ * Open addressing table from beatmap MD5s to `DbIndexSlot`s, read straight
+ * out of a memory mapped index file.
+ *
+ * Release with `dbp_index_close`.
+ */
+typedef struct DbIndex {
+	size_t len; /* Distinct hashes */
+	size_t slot_mask;
+	const DbIndexSlot *slots;
+	MappedFile mapped;
+} DbIndex;
+
+/*
+ * Opens the index at `path` for the given databases, either of which can be
+ * NULL. The index remembers the size and modification time of each; when
+ * one has changed only that database is scanned again, the other's slots
+ * are carried over. A missing or invalid index is built from scratch.
+ */
+int dbp_open_index(const char *path, const char *osu_db_path, const char *scores_db_path, DbIndex *out);
+
+/* NULL when `md5` is in neither database */
+const DbIndexSlot *dbp_index_find(const DbIndex *index, const uint8_t md5[16]);
+
+/* Same as `dbp_index_find` for a hash in hex (ie: `OsuReplay.beatmap_hash`) */
+const DbIndexSlot *dbp_index_find_hex(const DbIndex *index, const char hash[32]);
+
+/* Returns < 0 unless `hex` is 32 hex digits */
+int dbp_md5_from_hex(const char *hex, size_t len, uint8_t out[16]);
+
+void dbp_index_close(DbIndex *index);
+
+/*
+ * A scores.db, read a beatmap at a time: `dbp_scores_next_beatmap` moves
+ * to the next beatmap's scores (skipping any left unread) and
+ * `dbp_scores_next` reads them one by one, through the same decoder as
+ * `osrp_parse_score`.
+ *
+ * Release with `dbp_scores_db_close`.
+ */
+typedef struct ScoresDb {
+	int32_t version;
+	size_t len; /* Beatmaps */
+	ByteSlice data;
+	MappedFile mapped; /* Set by `dbp_open_scores_db` */
+
+	StreamReader reader;
+	size_t beatmaps_left;
+	size_t scores_left; /* Of the current beatmap */
+} ScoresDb;
+
+/* Columns for `dbp_scores_db_columns` */
+enum {
+	DBP_SCORE_BEATMAP = 1 << 0, /* Which beatmap, in file order */
+	DBP_SCORE_MODE = 1 << 1,
+	DBP_SCORE_TOTAL = 1 << 2,
+	DBP_SCORE_COMBO = 1 << 3,
+	DBP_SCORE_MODS = 1 << 4,
+	DBP_SCORE_COUNTS = 1 << 5, /* All six hit counts */
+	DBP_SCORE_PERFECT = 1 << 6,
+	DBP_SCORE_DATE = 1 << 7,
+	DBP_SCORE_ONLINE_ID = 1 << 8,
+};
+
+/*
+ * Every score of a scores.db as columns, one element per score. Columns
+ * that weren't asked for are NULL. Release with `dbp_score_columns_destroy`.
+ */
+typedef struct ScoreColumns {
+	size_t len;
+	size_t cap;
+	uint32_t *beatmap;
+	uint8_t *mode;
+	int32_t *total_score;
+	uint16_t *max_combo;
+	int32_t *mods;
+	uint16_t *count300;
+	uint16_t *count100;
+	uint16_t *count50;
+	uint16_t *count_geki;
+	uint16_t *count_katu;
+	uint16_t *count_miss;
+	bool *is_perfect;
+	int64_t *date_time;
+	int64_t *online_id;
+} ScoreColumns;
+
+int dbp_open_scores_db(const char *path, ScoresDb *out);
+
+/* `data` must outlive `out` */
+int dbp_parse_scores_db(const ByteSlice *data, ScoresDb *out);
+
+/* Returns 1 after the last beatmap. `md5` points into the database. */
+int dbp_scores_next_beatmap(ScoresDb *db, Str *md5, size_t *count);
+
+/*
+ * Moves to the scores of the beatmap in `slot` (from a `DbIndex` over the
+ * same file). `dbp_scores_next_beatmap` returns 1 afterwards; parse the
+ * database again to start over.
+ */
+int dbp_scores_seek(ScoresDb *db, const DbIndexSlot *slot);
+
+/*
+ * Returns 1 after the current beatmap's last score. `keep` and `ctx` (NULL
+ * for the heap) are as in `osrp_parse_score_ctx`.
+ */
+int dbp_scores_next(ScoresDb *db, OsrpContext *ctx, OsuReplay *out, unsigned keep);
+
+void dbp_scores_db_close(ScoresDb *db);
+
+/*
+ * Keeps only the fields in `columns` (`DBP_SCORE_*`). Every score still
+ * goes through the `osrp_parse_score` decoder, with its strings stepped
+ * over rather than copied; reading the fixed width fields costs the
+ * same as skipping them.
+ */
+int dbp_scores_db_columns(const ScoresDb *db, unsigned columns, ScoreColumns *out);
+
+void dbp_score_columns_destroy(ScoreColumns *columns);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * Decodes osu!.db files written in the layouts the format has gone
+ * through: byte difficulty settings and no star ratings, size prefixed
+ * entries with double star ratings, and float star ratings. Also checks
+ * that strings with damaged lengths are rejected rather than trusted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xutils.h"
+#include "db_parser.h"
+#include "binary_parser.h"
+#include "stream.h"
+#include "string_builder.h"
+
+/* Last version of each layout */
+#define VERSION_BYTE_DIFFICULTY 20140608
+#define VERSION_ENTRY_SIZE 20191105
+#define VERSION_FLOAT_STARS 20250108
+
+#define ENTRIES 2
+
+static int failures = 0;
+
+#define check(cond, ...)                       \
+	do {                                   \
+		if (!(cond)) {                 \
+			printf(__VA_ARGS__);   \
+			++failures;            \
+		}                              \
+	} while (0)
+
+static int write_string_builder(void *ctx, size_t size, const void *buf)
+{
+	string_builder_push_str(ctx, (Str) { .items = (char *) buf, .len = size });
+	return 0;
+}
+
+static void put_str(StreamWriter *writer, const char *s)
+{
+	if (!s) {
+		binp_write_str(writer, NULL);
+		return;
+	}
+	Str str = { .items = (char *) s, .len = strlen(s) };
+	binp_write_str(writer, &str);
+}
+
+static void put_byte(StreamWriter *writer, uint8_t b)
+{
+	stream_write(writer, 1, &b);
+}
+
+static void put_f32(StreamWriter *writer, float f)
+{
+	stream_write(writer, sizeof(f), &f);
+}
+
+static void put_f64(StreamWriter *writer, double d)
+{
+	stream_write(writer, sizeof(d), &d);
+}
+
+static bool str_eq(Str s, const char *cstr)
+{
+	return s.len == strlen(cstr) && memcmp(s.items, cstr, s.len) == 0;
+}
+
+static bool has_star_ratings(int32_t version)
+{
+	return version > VERSION_BYTE_DIFFICULTY;
+}
+
+/* Entry `n`; every value is derived from `n` so `check_entry` can expect it */
+static void write_entry(StreamWriter *w, int32_t version, int n)
+{
+	char title[16];
+	snprintf(title, sizeof(title), "map %d", n);
+
+	put_str(w, "artist");
+	put_str(w, NULL);
+	put_str(w, title);
+	put_str(w, NULL);
+	put_str(w, "creator");
+	put_str(w, "hard");
+	put_str(w, "audio.mp3");
+	put_str(w, "0123456789abcdef0123456789abcdef");
+	put_str(w, "map.osu");
+	put_byte(w, 4);
+	binp_write_u16(w, (uint16_t) (100 + n));
+	binp_write_u16(w, 20);
+	binp_write_u16(w, 1);
+	binp_write_i64(w, 637000000000000000);
+	if (has_star_ratings(version)) {
+		put_f32(w, 9.5f);
+		put_f32(w, 4.25f);
+		put_f32(w, 6.0f);
+		put_f32(w, 8.75f);
+	} else {
+		put_byte(w, 9);
+		put_byte(w, 4);
+		put_byte(w, 6);
+		put_byte(w, 8);
+	}
+	put_f64(w, 1.5);
+
+	if (has_star_ratings(version)) {
+		/* Two ratings for std, none for the other modes */
+		for (int mode = 0; mode < 4; ++mode) {
+			binp_write_i32(w, mode == 0 ? 2 : 0);
+			for (int i = 0; i < (mode == 0 ? 2 : 0); ++i) {
+				put_byte(w, 0x08);
+				binp_write_i32(w, i * 64);
+				if (version > VERSION_ENTRY_SIZE) {
+					put_byte(w, 0x0c);
+					put_f32(w, 5.5f + (float) (n + i));
+				} else {
+					put_byte(w, 0x0d);
+					put_f64(w, 5.5 + n + i);
+				}
+			}
+		}
+	}
+
+	binp_write_i32(w, 90);
+	binp_write_i32(w, 95000);
+	binp_write_i32(w, 30000);
+	binp_write_i32(w, 2);
+	for (int i = 0; i < 2; ++i) {
+		put_f64(w, i == 0 ? 300.0 : -100.0);
+		put_f64(w, 1000.0 * (i + n));
+		binp_write_bool(w, i == 0);
+	}
+
+	binp_write_i32(w, 1000 + n);
+	binp_write_i32(w, 500);
+	binp_write_i32(w, 0);
+	for (int i = 0; i < 4; ++i) put_byte(w, (uint8_t) i);
+	binp_write_u16(w, (uint16_t) -5);
+	put_f32(w, 0.7f);
+	put_byte(w, 0);
+	put_str(w, "source");
+	put_str(w, "tags");
+	binp_write_u16(w, 0);
+	put_str(w, NULL);
+	binp_write_bool(w, false);
+	binp_write_i64(w, 0);
+	binp_write_bool(w, false);
+	put_str(w, "folder");
+	binp_write_i64(w, 0);
+	for (int i = 0; i < 5; ++i) binp_write_bool(w, i == 1);
+	/* Gone once settings became floats */
+	if (!has_star_ratings(version)) binp_write_u16(w, 0);
+	binp_write_i32(w, 1234);
+	put_byte(w, 20);
+}
+
+static ByteSlice write_osu_db(int32_t version)
+{
+	StringBuilder sb;
+	string_builder_init(&sb);
+	StreamWriter w = { .ctx = &sb, .write_n = write_string_builder };
+	binp_write_i32(&w, version);
+	binp_write_i32(&w, 3);
+	binp_write_bool(&w, true);
+	binp_write_i64(&w, 0);
+	put_str(&w, "player");
+	binp_write_i32(&w, ENTRIES);
+	for (int n = 0; n < ENTRIES; ++n) {
+		if (version > VERSION_ENTRY_SIZE) {
+			write_entry(&w, version, n);
+			continue;
+		}
+		StringBuilder entry;
+		string_builder_init(&entry);
+		StreamWriter entry_w = { .ctx = &entry, .write_n = write_string_builder };
+		write_entry(&entry_w, version, n);
+		binp_write_i32(&w, (int32_t) entry.len);
+		stream_write(&w, entry.len, entry.items);
+		string_builder_free(&entry);
+	}
+	binp_write_i32(&w, 7);
+	return (ByteSlice) { .items = sb.items, .len = sb.len };
+}
+
+static void check_entry(int32_t version, const OsuDb *db, int n)
+{
+	DbBeatmap b;
+	int ret = dbp_osu_db_entry(db, (size_t) n, &b);
+	if (ret < 0) {
+		check(false, "%d: entry %d: %s\n", version, n, dbp_error_msg(ret));
+		return;
+	}
+
+	char title[16];
+	snprintf(title, sizeof(title), "map %d", n);
+	check(str_eq(b.title, title) && b.artist_unicode.len == 0 && str_eq(b.osu_file, "map.osu"),
+	      "%d: entry %d strings wrong\n", version, n);
+	check(b.ranked_status == 4 && b.hitcircles == 100 + n && b.sliders == 20 && b.spinners == 1,
+	      "%d: entry %d counts wrong\n", version, n);
+
+	if (has_star_ratings(version)) {
+		check(b.approach_rate == 9.5f && b.circle_size == 4.25f && b.hp_drain_rate == 6.0f
+		      && b.overall_difficulty == 8.75f, "%d: entry %d settings wrong\n", version, n);
+		const DbStarRatings *std = &b.star_ratings[0];
+		check(std->len == 2 && b.star_ratings[1].len == 0 && b.star_ratings[3].len == 0,
+		      "%d: entry %d has %zu std ratings\n", version, n, std->len);
+		for (size_t i = 0; i < std->len && i < 2; ++i) {
+			check(std->items[i].mods == (int32_t) i * 64 && std->items[i].stars == 5.5 + n + (double) i,
+			      "%d: entry %d rating %zu is %d %g\n", version, n, i, std->items[i].mods, std->items[i].stars);
+		}
+	} else {
+		check(b.approach_rate == 9.0f && b.circle_size == 4.0f && b.hp_drain_rate == 6.0f
+		      && b.overall_difficulty == 8.0f, "%d: entry %d byte settings wrong\n", version, n);
+		for (int mode = 0; mode < 4; ++mode) {
+			check(b.star_ratings[mode].len == 0, "%d: entry %d has star ratings\n", version, n);
+		}
+	}
+	check(b.slider_velocity == 1.5, "%d: entry %d slider velocity %g\n", version, n, b.slider_velocity);
+
+	check(b.drain_time == 90 && b.total_time == 95000 && b.preview_time == 30000,
+	      "%d: entry %d times wrong\n", version, n);
+	const DbTimingPoints *points = &b.timing_points;
+	check(points->len == 2 && points->items[0].bpm == 300.0 && points->items[0].offset == 1000.0 * n
+	      && points->items[0].uninherited && points->items[1].bpm == -100.0
+	      && points->items[1].offset == 1000.0 * (n + 1) && !points->items[1].uninherited,
+	      "%d: entry %d timing points wrong\n", version, n);
+
+	check(b.beatmap_id == 1000 + n && b.beatmap_set_id == 500 && b.grades[3] == 3 && b.local_offset == -5
+	      && b.stack_leniency == 0.7f && b.mode == 0, "%d: entry %d ids wrong\n", version, n);
+	check(str_eq(b.source, "source") && str_eq(b.tags, "tags") && b.title_font.len == 0
+	      && str_eq(b.folder, "folder"), "%d: entry %d trailing strings wrong\n", version, n);
+	check(!b.ignore_sound && b.ignore_skin && !b.visual_override && b.last_modified == 1234
+	      && b.mania_scroll_speed == 20, "%d: entry %d trailing fields wrong\n", version, n);
+	dbp_beatmap_destroy(&b);
+}
+
+static void check_osu_db(int32_t version)
+{
+	ByteSlice data = write_osu_db(version);
+	OsuDb db;
+	int ret = dbp_parse_osu_db(&data, &db);
+	if (ret < 0) {
+		check(false, "%d: could not parse: %s\n", version, dbp_error_msg(ret));
+		free(data.items);
+		return;
+	}
+	check(db.version == version && db.folder_count == 3 && str_eq(db.player_name, "player")
+	      && db.len == ENTRIES && db.permissions == 7, "%d: header wrong\n", version);
+	for (int n = 0; n < ENTRIES; ++n) check_entry(version, &db, n);
+
+	DbBeatmap b;
+	check(dbp_osu_db_entry(&db, ENTRIES, &b) < 0, "%d: entry past the end decoded\n", version);
+	dbp_osu_db_close(&db);
+	free(data.items);
+}
+
+/* 0x0b then a 5 byte ULEB128 length that sets bit 31 */
+static const char negative_str[] = "\x0b\xff\xff\xff\xff\x0f";
+/* 0x0b then a length running past the end */
+static const char truncated_str[] = "\x0b\xff\x7f" "ab";
+
+static void put_raw(StreamWriter *writer, const char *s, size_t len)
+{
+	stream_write(writer, len, s);
+}
+
+/* An osu!.db header whose player name is `name` */
+static void check_damaged_player(const char *label, const char *name, size_t name_len)
+{
+	StringBuilder sb;
+	string_builder_init(&sb);
+	StreamWriter w = { .ctx = &sb, .write_n = write_string_builder };
+	binp_write_i32(&w, VERSION_FLOAT_STARS);
+	binp_write_i32(&w, 0);
+	binp_write_bool(&w, true);
+	binp_write_i64(&w, 0);
+	put_raw(&w, name, name_len);
+	binp_write_i32(&w, 0);
+	binp_write_i32(&w, 0);
+
+	ByteSlice data = { .items = sb.items, .len = sb.len };
+	OsuDb db;
+	int ret = dbp_parse_osu_db(&data, &db);
+	check(ret == -EDB_UNKNOWN_FILE, "%s player name: returned %d\n", label, ret);
+	if (ret == 0) dbp_osu_db_close(&db);
+	string_builder_free(&sb);
+}
+
+/* A scores.db with one score whose username is `name` */
+static void check_damaged_username(const char *label, const char *name, size_t name_len)
+{
+	const char *hash = "0123456789abcdef0123456789abcdef";
+	StringBuilder sb;
+	string_builder_init(&sb);
+	StreamWriter w = { .ctx = &sb, .write_n = write_string_builder };
+	binp_write_i32(&w, VERSION_FLOAT_STARS);
+	binp_write_i32(&w, 1);
+	put_str(&w, hash);
+	binp_write_i32(&w, 1);
+	put_byte(&w, 0);
+	binp_write_i32(&w, VERSION_FLOAT_STARS);
+	put_str(&w, hash);
+	put_raw(&w, name, name_len);
+	/* Room for the rest of a score, so only the name is wrong */
+	for (int i = 0; i < 256; ++i) put_byte(&w, 0);
+
+	ByteSlice data = { .items = sb.items, .len = sb.len };
+	ScoresDb db;
+	Str md5;
+	size_t count;
+	OsuReplay score;
+	if (dbp_parse_scores_db(&data, &db) < 0 || dbp_scores_next_beatmap(&db, &md5, &count) != 0) {
+		check(false, "%s username: could not reach the score\n", label);
+	} else {
+		int ret = dbp_scores_next(&db, NULL, &score, OSRP_SCORE_USERNAME);
+		check(ret < 0, "%s username: returned %d\n", label, ret);
+	}
+	string_builder_free(&sb);
+}
+
+int main(void)
+{
+	check_osu_db(VERSION_BYTE_DIFFICULTY);
+	check_osu_db(VERSION_ENTRY_SIZE);
+	check_osu_db(VERSION_FLOAT_STARS);
+
+	/* Damaged lengths are errors, not aborts */
+	check_damaged_player("negative", negative_str, sizeof(negative_str) - 1);
+	check_damaged_player("truncated", truncated_str, sizeof(truncated_str) - 1);
+	check_damaged_username("negative", negative_str, sizeof(negative_str) - 1);
+	check_damaged_username("truncated", truncated_str, sizeof(truncated_str) - 1);
+
+	printf("db parser: %d failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,272 @@
+/*
+ * Bounded decimal parsing and formatting (dec)
+ *
+ * Replacements for `strtod`/`strtoimax` that never read past `end` and do
+ * not depend on the current locale. Short decimals (at most 19 significant
+ * digits, small exponent) are converted with a single exact multiplication
+ * or division, which rounds the same way `strtod` does. Anything else is
+ * copied into a NUL terminated buffer and handed to libc.
+ *
+ *
+ * Usage:
+ * #include "decimal.h"
+ *
+ * const char *s = "12.5|3";
+ * double d;
+ * size_t n = dec_parse_f64(s, s + 6, &d);
+ * assert(n == 4 && d == 12.5);
+ *
+ * int64_t i;
+ * assert(dec_parse_i64(s + 5, s + 6, &i) == 1 && i == 3);
+ *
+ * Formatting goes the other way for the fixed precisions replays use:
+ *
+ * char buf[DEC_FORMAT_MAX];
+ * assert(dec_format_fixed(buf, 0.0625f, 3) == 5 && memcmp(buf, "0.063", 5) == 0);
+ * assert(dec_format_i64(buf, -12) == 3 && memcmp(buf, "-12", 3) == 0);
+ */
+
+#ifndef DECIMAL_H
+#define DECIMAL_H
+
+#include <float.h>
+#include <inttypes.h>
+#include <locale.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Longest input handed to libc; longer numbers are truncated */
+#define DEC_FALLBACK_MAX 128
+
+/* Room needed for the output of `dec_format_fixed` and `dec_format_i64` */
+#define DEC_FORMAT_MAX 24
+
+/* Largest precision `dec_format_fixed` takes */
+#define DEC_FORMAT_PRECISION_MAX 4
+
+static inline bool dec_is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool dec_is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline size_t dec_fallback_f64(const char *begin, const char *end, double *out)
+{
+	char buf[DEC_FALLBACK_MAX];
+	size_t len = (size_t) (end - begin);
+	if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+	memcpy(buf, begin, len);
+	buf[len] = '\0';
+
+	/* `strtod` expects the locale's radix character */
+	const char *radix = localeconv()->decimal_point;
+	if (radix[0] != '.' && radix[0] != '\0' && radix[1] == '\0') {
+		for (size_t i = 0; i < len; ++i) {
+			if (buf[i] == '.') buf[i] = radix[0];
+		}
+	}
+
+	char *endptr;
+	*out = strtod(buf, &endptr);
+	return (size_t) (endptr - buf);
+}
+
+/*
+ * Parses the number at the start of [begin, end) into `out`.
+ *
+ * Returns the number of bytes consumed, 0 (with `out` set to 0.0) when no
+ * number could be parsed.
+ */
+static inline size_t dec_parse_f64(const char *begin, const char *end, double *out)
+{
+	static const double pow10[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+		1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+		1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	const char *p = begin;
+	while (p < end && dec_is_space(*p)) ++p;
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool any_digits = false;
+
+	while (p < end && dec_is_digit(*p)) {
+		if (mantissa || *p != '0') {
+			mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+			++digits;
+		}
+		any_digits = true;
+		++p;
+		if (digits > 19) goto fallback;
+	}
+	if (p < end && *p == '.') {
+		++p;
+		while (p < end && dec_is_digit(*p)) {
+			if (mantissa || *p != '0') {
+				mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+				++digits;
+			}
+			any_digits = true;
+			--exponent;
+			++p;
+			if (digits > 19) goto fallback;
+		}
+	}
+	/* inf, nan, hex floats or not a number at all */
+	if (!any_digits) goto fallback;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *e = p + 1;
+		bool exp_negative = false;
+		if (e < end && (*e == '-' || *e == '+')) {
+			exp_negative = *e == '-';
+			++e;
+		}
+		if (e < end && dec_is_digit(*e)) {
+			int exp = 0;
+			while (e < end && dec_is_digit(*e)) {
+				if (exp > 10000) goto fallback;
+				exp = exp * 10 + (*e - '0');
+				++e;
+			}
+			exponent += exp_negative ? -exp : exp;
+			p = e;
+		}
+	}
+
+#if FLT_EVAL_METHOD == 0
+	if (mantissa <= (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22) {
+		/* Both operands are exact, so a single rounding happens */
+		double d = (double) mantissa;
+		if (exponent < 0) d /= pow10[-exponent];
+		else d *= pow10[exponent];
+		*out = negative ? -d : d;
+		return (size_t) (p - begin);
+	}
+#else
+	(void) pow10;
+#endif
+
+fallback:
+	return dec_fallback_f64(begin, end, out);
+}
+
+/*
+ * Parses the base 10 integer at the start of [begin, end) into `out`.
+ *
+ * Returns the number of bytes consumed, 0 (with `out` set to 0) when no
+ * number could be parsed. Out of range values saturate like `strtoimax`.
+ */
+static inline size_t dec_parse_i64(const char *begin, const char *end, int64_t *out)
+{
+	const char *p = begin;
+	while (p < end && dec_is_space(*p)) ++p;
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+
+	const char *digits = p;
+	uint64_t n = 0;
+	while (p < end && dec_is_digit(*p)) {
+		if (p - digits >= 18) {
+			char buf[DEC_FALLBACK_MAX];
+			size_t len = (size_t) (end - begin);
+			if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+			memcpy(buf, begin, len);
+			buf[len] = '\0';
+			char *endptr;
+			*out = (int64_t) strtoimax(buf, &endptr, 10);
+			return (size_t) (endptr - buf);
+		}
+		n = n * 10 + (uint64_t) (*p - '0');
+		++p;
+	}
+	if (p == digits) {
+		*out = 0;
+		return 0;
+	}
+
+	*out = negative ? -(int64_t) n : (int64_t) n;
+	return (size_t) (p - begin);
+}
+
+/* Writes the digits of `n` to `out`, returns how many */
+static inline size_t dec_format_u64(char *out, uint64_t n)
+{
+	char digits[20];
+	size_t len = 0;
+	do {
+		digits[sizeof(digits) - ++len] = (char) ('0' + n % 10);
+		n /= 10;
+	} while (n);
+	memcpy(out, &digits[sizeof(digits) - len], len);
+	return len;
+}
+
+/* `out` needs `DEC_FORMAT_MAX` bytes; returns the length written */
+static inline size_t dec_format_i64(char *out, int64_t i)
+{
+	if (i >= 0) return dec_format_u64(out, (uint64_t) i);
+	out[0] = '-';
+	return 1 + dec_format_u64(&out[1], -(uint64_t) i);
+}
+
+/*
+ * Writes `value` with `precision` digits after the point, the same bytes
+ * stb_sprintf gives for `%.*f`: halfway cases round away from zero and
+ * negative values keep their sign when they round to zero.
+ *
+ * A float scaled by at most 10^4 is exact as a double, so rounding is done
+ * once on the exact value. Magnitudes of 1e9 and up, inf and nan are left
+ * to the caller; 0 is returned for those. Otherwise returns the length
+ * written; `out` needs `DEC_FORMAT_MAX` bytes.
+ */
+static inline size_t dec_format_fixed(char *out, float value, int precision)
+{
+	static const uint32_t pow10[] = { 1, 10, 100, 1000, 10000 };
+	if (precision < 0 || precision > DEC_FORMAT_PRECISION_MAX) return 0;
+
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	bool negative = bits >> 31;
+	double magnitude = negative ? -(double) value : (double) value;
+	/* Also false for nan */
+	if (!(magnitude < 1e9)) return 0;
+
+	double scaled = magnitude * pow10[precision];
+	uint64_t n = (uint64_t) scaled;
+	if (scaled - (double) n >= 0.5) ++n;
+
+	size_t len = 0;
+	if (negative) out[len++] = '-';
+	len += dec_format_u64(&out[len], n / pow10[precision]);
+	if (precision > 0) {
+		uint32_t frac = (uint32_t) (n % pow10[precision]);
+		out[len++] = '.';
+		for (int i = precision - 1; i >= 0; --i) {
+			out[len + (size_t) i] = (char) ('0' + frac % 10);
+			frac /= 10;
+		}
+		len += (size_t) precision;
+	}
+	return len;
+}
+
+#endif
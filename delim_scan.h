@@ -0,0 +1,200 @@
+/*
+ * Delimiter scanner (ds)
+ *
+ * Walks a buffer once and yields the position of every field and record
+ * delimiter, in order. The buffer is reduced 64 bytes at a time into a
+ * pair of bitmasks (SSE2 or AVX2 when the compiler targets them, scalar
+ * otherwise), so consumers only touch the bytes between delimiters.
+ *
+ *
+ * Usage:
+ * #include "delim_scan.h"
+ *
+ * const char *s = "1|2|3,4|5";
+ * DelimScanner scanner;
+ * ds_init(&scanner, s, strlen(s), '|', ',');
+ *
+ * size_t pos;
+ * assert(ds_next(&scanner, &pos) == DS_FIELD && pos == 1);
+ * assert(ds_next(&scanner, &pos) == DS_FIELD && pos == 3);
+ * assert(ds_next(&scanner, &pos) == DS_RECORD && pos == 5);
+ * assert(ds_next(&scanner, &pos) == DS_FIELD && pos == 7);
+ * assert(ds_next(&scanner, &pos) == DS_END && pos == 9);
+ *
+ * assert(ds_count(s, strlen(s), '|') == 3);
+ */
+
+#ifndef DELIM_SCAN_H
+#define DELIM_SCAN_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DS_BLOCK_SIZE 64
+
+enum {
+	DS_END = 0,
+	DS_FIELD,
+	DS_RECORD,
+};
+
+typedef struct DelimScanner {
+	const char *items;
+	size_t len;
+
+	size_t block; /* Offset of the block `field` and `record` describe */
+	uint64_t field;
+	uint64_t record;
+
+	char field_delim;
+	char record_delim;
+} DelimScanner;
+
+static inline unsigned ds_ctz(uint64_t x)
+{
+#if defined(__GNUC__)
+	return (unsigned) __builtin_ctzll(x);
+#else
+	unsigned n = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+static inline unsigned ds_popcount(uint64_t x)
+{
+#if defined(__GNUC__)
+	return (unsigned) __builtin_popcountll(x);
+#else
+	unsigned n = 0;
+	while (x) {
+		x &= x - 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+/* `p` must have `DS_BLOCK_SIZE` readable bytes */
+static inline void ds_block_masks(const char *p, char a, char b, uint64_t *mask_a, uint64_t *mask_b)
+{
+#if defined(__AVX2__)
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	__m256i lo = _mm256_loadu_si256((const __m256i *) p);
+	__m256i hi = _mm256_loadu_si256((const __m256i *) (p + 32));
+	*mask_a = (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, va))
+		| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, va)) << 32;
+	*mask_b = (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vb))
+		| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vb)) << 32;
+#elif defined(__SSE2__)
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	uint64_t ma = 0;
+	uint64_t mb = 0;
+	for (int i = 0; i < DS_BLOCK_SIZE; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+		ma |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, va)) << i;
+		mb |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vb)) << i;
+	}
+	*mask_a = ma;
+	*mask_b = mb;
+#else
+	uint64_t ma = 0;
+	uint64_t mb = 0;
+	for (int i = 0; i < DS_BLOCK_SIZE; ++i) {
+		ma |= (uint64_t) (p[i] == a) << i;
+		mb |= (uint64_t) (p[i] == b) << i;
+	}
+	*mask_a = ma;
+	*mask_b = mb;
+#endif
+}
+
+static inline void ds_load_block(DelimScanner *s)
+{
+	size_t remaining = s->len - s->block;
+	if (remaining >= DS_BLOCK_SIZE) {
+		ds_block_masks(&s->items[s->block], s->field_delim, s->record_delim, &s->field, &s->record);
+		return;
+	}
+
+	/* Pad the tail with the NUL byte; callers never use it as a delimiter */
+	char tail[DS_BLOCK_SIZE] = {0};
+	memcpy(tail, &s->items[s->block], remaining);
+	ds_block_masks(tail, s->field_delim, s->record_delim, &s->field, &s->record);
+	uint64_t valid = (UINT64_C(1) << remaining) - 1;
+	s->field &= valid;
+	s->record &= valid;
+}
+
+static inline void ds_init(DelimScanner *s, const char *items, size_t len, char field_delim, char record_delim)
+{
+	s->items = items;
+	s->len = len;
+	s->block = 0;
+	s->field = 0;
+	s->record = 0;
+	s->field_delim = field_delim;
+	s->record_delim = record_delim;
+	if (len > 0) ds_load_block(s);
+}
+
+/* Number of `delim` bytes in `items`; `delim` must not be NUL */
+static inline size_t ds_count(const char *items, size_t len, char delim)
+{
+	size_t n = 0;
+	size_t i = 0;
+	uint64_t mask;
+	uint64_t unused;
+	for (; i + DS_BLOCK_SIZE <= len; i += DS_BLOCK_SIZE) {
+		ds_block_masks(&items[i], delim, delim, &mask, &unused);
+		n += ds_popcount(mask);
+	}
+	if (i < len) {
+		char tail[DS_BLOCK_SIZE] = {0};
+		memcpy(tail, &items[i], len - i);
+		ds_block_masks(tail, delim, delim, &mask, &unused);
+		n += ds_popcount(mask);
+	}
+	return n;
+}
+
+/*
+ * Sets `pos` to the index of the next delimiter and returns its kind.
+ * Once the buffer is exhausted `DS_END` is returned with `pos` set to `len`.
+ */
+static inline int ds_next(DelimScanner *s, size_t *pos)
+{
+	while (!(s->field | s->record)) {
+		s->block += DS_BLOCK_SIZE;
+		if (s->block >= s->len) {
+			s->block = s->len;
+			*pos = s->len;
+			return DS_END;
+		}
+		ds_load_block(s);
+	}
+
+	unsigned field_bit = s->field ? ds_ctz(s->field) : DS_BLOCK_SIZE;
+	unsigned record_bit = s->record ? ds_ctz(s->record) : DS_BLOCK_SIZE;
+	if (field_bit < record_bit) {
+		s->field &= s->field - 1;
+		*pos = s->block + field_bit;
+		return DS_FIELD;
+	}
+	s->record &= s->record - 1;
+	*pos = s->block + record_bit;
+	return DS_RECORD;
+}
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * Benchmarks for the osr parser over a synthetic, deterministic corpus.
+ *
+ * Every run with the same options generates byte-identical replays, so
+ * numbers are comparable between commits.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "xutils.h"
+#include "osr_parser.h"
+#include "binary_parser.h"
+#include "mods.h"
+#include "stream.h"
+#include "string_builder.h"
+
+typedef struct BenchOptions {
+	size_t replays;
+	size_t frames;
+	size_t hp_points;
+	int32_t version;
+	uint64_t seed;
+	double min_time; /* Seconds each benchmark runs for at least */
+} BenchOptions;
+
+/* xorshift64*, good enough for test data and identical everywhere */
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * UINT64_C(2685821657736338717);
+}
+
+static float rng_float(uint64_t *state, float max)
+{
+	return (float) ((double) (rng_next(state) >> 11) / (double) (UINT64_C(1) << 53)) * max;
+}
+
+static void gen_replay(uint64_t *rng, const BenchOptions *opts, OsuReplay *out)
+{
+	static char username[] = "bench_player";
+	*out = (OsuReplay) {0};
+	out->mode = MODE_OSU;
+	out->version = opts->version;
+	for (size_t i = 0; i < sizeof(out->beatmap_hash); ++i) {
+		out->beatmap_hash[i] = "0123456789abcdef"[rng_next(rng) & 0xf];
+		out->md5hash[i] = "0123456789abcdef"[rng_next(rng) & 0xf];
+	}
+	out->username = (Str) { .items = username, .len = sizeof(username) - 1 };
+	out->count300 = (uint16_t) (rng_next(rng) % 2000);
+	out->count100 = (uint16_t) (rng_next(rng) % 100);
+	out->count50 = (uint16_t) (rng_next(rng) % 20);
+	out->count_miss = (uint16_t) (rng_next(rng) % 10);
+	out->total_score = (int32_t) (rng_next(rng) % 100000000);
+	out->max_combo = (uint16_t) (rng_next(rng) % 3000);
+	out->mod_bitfield = MOD_HIDDEN | MOD_HARDROCK;
+	out->date_time = INT64_C(638000000000000000);
+	out->online_id = (int64_t) (rng_next(rng) >> 1);
+
+	out->hp_graph.len = opts->hp_points;
+	out->hp_graph.items = xmalloc(sizeof(*out->hp_graph.items) * (opts->hp_points ? opts->hp_points : 1));
+	for (size_t i = 0; i < opts->hp_points; ++i) {
+		out->hp_graph.items[i].time = (int32_t) (i * 2000);
+		out->hp_graph.items[i].value = rng_float(rng, 1.0f);
+	}
+
+	out->frames.len = opts->frames;
+	out->frames.items = xmalloc(sizeof(*out->frames.items) * (opts->frames ? opts->frames : 1));
+	float time = 0.0;
+	for (size_t i = 0; i < opts->frames; ++i) {
+		/* Mostly ~60Hz input with the odd gap */
+		time += (float) (rng_next(rng) % 8 == 0 ? rng_next(rng) % 200 : 16 + rng_next(rng) % 2);
+		ReplayFrame *frame = &out->frames.items[i];
+		frame->time = time;
+		frame->mouse_x = rng_float(rng, 512.0f);
+		frame->mouse_y = rng_float(rng, 384.0f);
+		frame->button_state = (int) (rng_next(rng) % 16);
+	}
+}
+
+static int write_string_builder(void *ctx, size_t size, const void *buf)
+{
+	string_builder_push_str(ctx, (Str) { .items = (char *) buf, .len = size });
+	return 0;
+}
+
+static int write_discard(void *ctx, size_t size, const void *buf)
+{
+	(void) buf;
+	*(size_t *) ctx += size;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+typedef struct Corpus {
+	size_t len;
+	OsuReplay *replays;
+	ByteSlice *files;       /* Serialized .osr */
+	ByteSlice *compressed;  /* Compressed frames within `files` */
+	ByteSlice *text;        /* Decompressed frames */
+	ByteSlice *caches;      /* Written with `osrp_write_cache` */
+	size_t total_frames;
+} Corpus;
+
+static void corpus_build(Corpus *corpus, const BenchOptions *opts)
+{
+	uint64_t rng = opts->seed ? opts->seed : 1;
+	corpus->len = opts->replays;
+	corpus->replays = xmalloc(sizeof(*corpus->replays) * opts->replays);
+	corpus->files = xmalloc(sizeof(*corpus->files) * opts->replays);
+	corpus->compressed = xmalloc(sizeof(*corpus->compressed) * opts->replays);
+	corpus->text = xmalloc(sizeof(*corpus->text) * opts->replays);
+	corpus->caches = xmalloc(sizeof(*corpus->caches) * opts->replays);
+	corpus->total_frames = 0;
+
+	for (size_t i = 0; i < opts->replays; ++i) {
+		gen_replay(&rng, opts, &corpus->replays[i]);
+
+		StringBuilder sb;
+		string_builder_init(&sb);
+		StreamWriter writer = { .ctx = &sb, .write_n = write_string_builder };
+		if (osrp_write_osr(&writer, &corpus->replays[i]) < 0) {
+			panic("Could not write generated replay\n");
+		}
+		corpus->files[i] = string_builder_build(&sb);
+
+		StreamReader reader;
+		memory_reader_init(&reader, &corpus->files[i]);
+		OsuReplay parsed = {0};
+		if (osrp_parse_osr(&reader, &parsed) < 0) {
+			panic("Could not parse generated replay\n");
+		}
+		corpus->compressed[i] = (ByteSlice) {
+			.items = (char *) parsed.replay_data.items,
+			.len = parsed.replay_data.len,
+		};
+		corpus->total_frames += parsed.frames.len;
+		osrp_replay_destroy(&parsed);
+
+		ByteArray text = {0};
+		if (osrp_decompress_replay(&corpus->compressed[i], &text) < 0) {
+			panic("Could not decompress generated replay\n");
+		}
+		corpus->text[i] = string_builder_build(&text);
+
+		StringBuilder cache;
+		string_builder_init(&cache);
+		StreamWriter cache_writer = { .ctx = &cache, .write_n = write_string_builder };
+		if (osrp_write_cache(&cache_writer, &corpus->replays[i]) < 0) {
+			panic("Could not write cache\n");
+		}
+		corpus->caches[i] = string_builder_build(&cache);
+	}
+}
+
+static void corpus_free(Corpus *corpus)
+{
+	for (size_t i = 0; i < corpus->len; ++i) {
+		corpus->replays[i].username.items = NULL;
+		osrp_replay_destroy(&corpus->replays[i]);
+		free(corpus->files[i].items);
+		free(corpus->text[i].items);
+		free(corpus->caches[i].items);
+	}
+	free(corpus->replays);
+	free(corpus->files);
+	free(corpus->compressed);
+	free(corpus->text);
+	free(corpus->caches);
+}
+
+static size_t sum_len(const ByteSlice *slices, size_t len)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < len; ++i) total += slices[i].len;
+	return total;
+}
+
+/* One pass over the corpus; returns the number of frames seen */
+typedef size_t (*BenchFn)(const Corpus *corpus);
+
+static size_t bench_header(const Corpus *corpus)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < corpus->len; ++i) {
+		StreamReader reader;
+		memory_reader_init(&reader, &corpus->files[i]);
+		OsuReplay replay = {0};
+		if (osrp_parse_osr_header(&reader, &replay) < 0) panic("header parse failed\n");
+		n += replay.hp_graph.len;
+		osrp_replay_destroy(&replay);
+	}
+	return n;
+}
+
+/* Shared by the decoding benchmarks, like a batch worker would */
+static OsrpContext bench_ctx;
+
+static size_t bench_lzma(const Corpus *corpus)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < corpus->len; ++i) {
+		ByteArray text = {0};
+		if (osrp_decompress_replay_ctx(&bench_ctx, &corpus->compressed[i], &text) < 0) panic("decompress failed\n");
+		n += text.len;
+		string_builder_free(&text);
+	}
+	return n;
+}
+
+static size_t bench_frames(const Corpus *corpus)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < corpus->len; ++i) {
+		struct ReplayFrames frames;
+		if (osrp_parse_replay_frames(&corpus->text[i], &frames) < 0) panic("frame parse failed\n");
+		n += frames.len;
+		free(frames.items);
+	}
+	return n;
+}
+
+static size_t bench_full(const Corpus *corpus)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < corpus->len; ++i) {
+		StreamReader reader;
+		memory_reader_init(&reader, &corpus->files[i]);
+		OsuReplay replay = {0};
+		if (osrp_parse_osr_ctx(&bench_ctx, &reader, &replay) < 0) panic("parse failed\n");
+		n += replay.frames.len;
+		osrp_replay_destroy(&replay);
+	}
+	return n;
+}
+
+static size_t bench_cache(const Corpus *corpus)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < corpus->len; ++i) {
+		StreamReader reader;
+		memory_reader_init(&reader, &corpus->caches[i]);
+		OsuReplay replay;
+		if (osrp_read_cache(&reader, &replay) < 0) panic("cache read failed\n");
+		n += replay.frames.len;
+		osrp_replay_destroy(&replay);
+	}
+	return n;
+}
+
+static size_t csv_bytes;
+
+static size_t bench_csv(const Corpus *corpus)
+{
+	size_t n = 0;
+	csv_bytes = 0;
+	StreamWriter writer = { .ctx = &csv_bytes, .write_n = write_discard };
+	for (size_t i = 0; i < corpus->len; ++i) {
+		if (osrp_replay_frame_csv(&writer, &corpus->replays[i], true) < 0) panic("csv failed\n");
+		n += corpus->replays[i].frames.len;
+	}
+	return n;
+}
+
+static size_t bench_write(const Corpus *corpus)
+{
+	size_t n = 0;
+	size_t bytes = 0;
+	StreamWriter writer = { .ctx = &bytes, .write_n = write_discard };
+	for (size_t i = 0; i < corpus->len; ++i) {
+		if (osrp_write_osr(&writer, &corpus->replays[i]) < 0) panic("write failed\n");
+		n += corpus->replays[i].frames.len;
+	}
+	return n;
+}
+
+/*
+ * Runs `fn` until `min_time` passes and reports throughput; `bytes` is the
+ * amount of data one pass processes
+ */
+static void run(const char *name, BenchFn fn, const Corpus *corpus, const BenchOptions *opts, size_t bytes, bool count_frames)
+{
+	/* Warm up */
+	fn(corpus);
+
+	size_t iterations = 0;
+	size_t frames = 0;
+	double start = now();
+	double elapsed;
+	do {
+		frames += fn(corpus);
+		++iterations;
+		elapsed = now() - start;
+	} while (elapsed < opts->min_time);
+
+	double mb_s = (double) bytes * (double) iterations / elapsed / (1024.0 * 1024.0);
+	double replays_s = (double) (corpus->len * iterations) / elapsed;
+	printf("%-8s %10.2f MB/s %12.0f frames/s %10.1f replays/s\n",
+		name, mb_s, count_frames ? (double) frames / elapsed : 0.0, replays_s);
+}
+
+static const char *help =
+	"Usage: osr_bench [OPTION]\n"
+	"\n"
+	"Options:\n"
+	"  --replays <N>           Replays in the corpus (default: 16)\n"
+	"  --frames <N>            Frames per replay (default: 20000)\n"
+	"  --hp-points <N>         HP graph points per replay (default: 200)\n"
+	"  --version <N>           Replay version (default: 20230621)\n"
+	"  --seed <N>              Generator seed (default: 1)\n"
+	"  --min-time <SECONDS>    Minimum time per benchmark (default: 1.0)\n";
+
+int main(int argc, char **argv)
+{
+	BenchOptions opts = {
+		.replays = 16,
+		.frames = 20000,
+		.hp_points = 200,
+		.version = 20230621,
+		.seed = 1,
+		.min_time = 1.0,
+	};
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+		if (!val) {
+			eprintf("ERROR:Missing value or unknown flag:%s\n", arg);
+			eprintf(help);
+			exit(1);
+		}
+		if (strcmp(arg, "--replays") == 0) opts.replays = strtoull(val, NULL, 10);
+		else if (strcmp(arg, "--frames") == 0) opts.frames = strtoull(val, NULL, 10);
+		else if (strcmp(arg, "--hp-points") == 0) opts.hp_points = strtoull(val, NULL, 10);
+		else if (strcmp(arg, "--version") == 0) opts.version = (int32_t) strtol(val, NULL, 10);
+		else if (strcmp(arg, "--seed") == 0) opts.seed = strtoull(val, NULL, 10);
+		else if (strcmp(arg, "--min-time") == 0) opts.min_time = strtod(val, NULL);
+		else {
+			eprintf("ERROR:Unknown flag:%s\n", arg);
+			eprintf(help);
+			exit(1);
+		}
+		++i;
+	}
+	if (opts.replays == 0) opts.replays = 1;
+
+	Corpus corpus;
+	corpus_build(&corpus, &opts);
+
+	size_t file_bytes = sum_len(corpus.files, corpus.len);
+	size_t compressed_bytes = sum_len(corpus.compressed, corpus.len);
+	size_t text_bytes = sum_len(corpus.text, corpus.len);
+	printf("corpus: %zu replays, %zu frames, %zu bytes osr, %zu bytes compressed, %zu bytes text\n",
+		corpus.len, corpus.total_frames, file_bytes, compressed_bytes, text_bytes);
+
+	/* Header throughput is over the bytes before the compressed frames */
+	run("header", bench_header, &corpus, &opts, file_bytes - compressed_bytes, false);
+	run("lzma", bench_lzma, &corpus, &opts, text_bytes, false);
+	run("frames", bench_frames, &corpus, &opts, text_bytes, true);
+	run("parse", bench_full, &corpus, &opts, file_bytes, true);
+	run("cache", bench_cache, &corpus, &opts, sum_len(corpus.caches, corpus.len), true);
+	bench_csv(&corpus);
+	run("csv", bench_csv, &corpus, &opts, csv_bytes, true);
+	run("write", bench_write, &corpus, &opts, file_bytes, true);
+
+	corpus_free(&corpus);
+	osrp_context_destroy(&bench_ctx);
+	return 0;
+
+}
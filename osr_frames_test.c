@@ -0,0 +1,164 @@
+/*
+ * Checks that every way of decoding frames agrees, with both a sizeless
+ * (streamed) and a sized LZMA header, on replays that compress like real
+ * ones and on replays that compress far beyond LZMA_MAX_RATIO.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xutils.h"
+#include "osr_parser.h"
+#include "stream.h"
+#include "string_builder.h"
+
+#define FRAMES 300000
+#define LZMA_SIZE_OFFSET 5
+
+static int write_string_builder(void *ctx, size_t size, const void *buf)
+{
+	string_builder_push_str(ctx, (Str) { .items = (char *) buf, .len = size });
+	return 0;
+}
+
+/* xorshift64*, identical everywhere */
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * UINT64_C(2685821657736338717);
+}
+
+/* Frames either all alike or with random positions and gaps */
+static ByteSlice gen_replay(bool varied)
+{
+	uint64_t rng = 1;
+	OsuReplay replay = {0};
+	replay.version = 20240101;
+	memset(replay.beatmap_hash, '0', sizeof(replay.beatmap_hash));
+	memset(replay.md5hash, 'f', sizeof(replay.md5hash));
+
+	replay.frames.len = FRAMES;
+	replay.frames.items = xmalloc(sizeof(*replay.frames.items) * FRAMES);
+	float time = 0.0f;
+	for (size_t i = 0; i < FRAMES; ++i) {
+		ReplayFrame *frame = &replay.frames.items[i];
+		time += varied ? (float) (1 + rng_next(&rng) % 40) : 16.0f;
+		frame->time = time;
+		frame->mouse_x = varied ? (float) (rng_next(&rng) % 51200) / 100.0f : 256.0f;
+		frame->mouse_y = varied ? (float) (rng_next(&rng) % 38400) / 100.0f : 192.0f;
+		frame->button_state = varied ? (int) (rng_next(&rng) % 4) : 0;
+	}
+
+	StringBuilder sb;
+	string_builder_init(&sb);
+	StreamWriter writer = { .ctx = &sb, .write_n = write_string_builder };
+	if (osrp_write_osr(&writer, &replay) < 0) panic("Could not write replay\n");
+	free(replay.frames.items);
+	return string_builder_build(&sb);
+}
+
+/* Points `compressed` at the frames of `file` */
+static void find_frames(const ByteSlice *file, ByteSlice *compressed)
+{
+	StreamReader reader;
+	memory_reader_init(&reader, file);
+	OsuReplay replay = {0};
+	if (osrp_parse_osr_header(&reader, &replay) < 0) panic("Could not parse header\n");
+	compressed->items = (char *) replay.replay_data.items;
+	compressed->len = replay.replay_data.len;
+	osrp_replay_destroy(&replay);
+}
+
+static void set_lzma_size(ByteSlice *compressed, uint64_t size)
+{
+	for (int i = 0; i < 8; ++i) {
+		compressed->items[LZMA_SIZE_OFFSET + i] = (char) (size >> (i * 8));
+	}
+}
+
+static int check(const char *name, const ByteSlice *file, const ByteSlice *compressed)
+{
+	int failures = 0;
+	struct ReplayFrames decoded = {0};
+	if (osrp_decode_frames(compressed, &decoded) < 0) {
+		printf("%s: osrp_decode_frames failed\n", name);
+		return 1;
+	}
+
+	OsrpFrameIter iter;
+	size_t n = 0;
+	int ret = osrp_frame_iter_init(&iter, compressed);
+	if (ret == 0) {
+		ReplayFrame frame;
+		while ((ret = osrp_frame_iter_next(&iter, &frame)) == 0) {
+			if (n >= decoded.len || memcmp(&frame, &decoded.items[n], sizeof(frame)) != 0) break;
+			++n;
+		}
+		osrp_frame_iter_destroy(&iter);
+	}
+	if (ret != 1 || n != decoded.len) {
+		printf("%s: iterator stopped at %zu of %zu frames (%d)\n", name, n, decoded.len, ret);
+		++failures;
+	}
+
+	StreamReader reader;
+	memory_reader_init(&reader, file);
+	OsuReplay replay = {0};
+	if (osrp_parse_osr(&reader, &replay) < 0 || replay.frames.len != decoded.len
+	    || memcmp(replay.frames.items, decoded.items, sizeof(*decoded.items) * decoded.len) != 0) {
+		printf("%s: osrp_parse_osr disagrees\n", name);
+		++failures;
+	}
+	osrp_replay_destroy(&replay);
+
+	printf("%s: %zu frames, %zu bytes compressed\n", name, decoded.len, compressed->len);
+	free(decoded.items);
+	return failures;
+}
+
+/*
+ * Checks `file` with its LZMA header sizeless and then sized; the text
+ * must be at least `min_ratio` times the size of its compressed frames
+ */
+static int check_replay(const char *name, ByteSlice *file, uint64_t min_ratio)
+{
+	char label[64];
+	ByteSlice compressed;
+	find_frames(file, &compressed);
+
+	ByteArray text = {0};
+	if (osrp_decompress_replay(&compressed, &text) < 0) panic("Could not decompress\n");
+	uint64_t text_len = text.len;
+	string_builder_free(&text);
+	if (text_len < compressed.len * min_ratio) panic("%s: compresses less than %"PRIu64":1\n", name, min_ratio);
+
+	int failures = 0;
+	set_lzma_size(&compressed, UINT64_MAX);
+	snprintf(label, sizeof(label), "%s, streamed", name);
+	failures += check(label, file, &compressed);
+	set_lzma_size(&compressed, text_len);
+	snprintf(label, sizeof(label), "%s, sized", name);
+	failures += check(label, file, &compressed);
+	return failures;
+}
+
+int main(void)
+{
+	int failures = 0;
+	ByteSlice files[] = { gen_replay(true), gen_replay(false) };
+	failures += check_replay("varied", &files[0], 0);
+	/* Past LZMA_MAX_RATIO, which sized decoding must not fall back on */
+	failures += check_replay("alike", &files[1], 64);
+
+	free(files[0].items);
+	free(files[1].items);
+	return failures == 0 ? 0 : 1;
+}
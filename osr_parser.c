@@ -1,23 +1,35 @@
 #include <assert.h>
-#include <inttypes.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include "easylzma/decompress.h"
 #include "easylzma/compress.h"
+#include "easylzma-master/src/pavlov/LzmaDec.h"
 
 #include "osr_parser.h"
 #include "binary_parser.h"
 #include "string_builder.h"
 #include "xutils.h"
 #include "mods.h"
+#include "delim_scan.h"
+#include "decimal.h"
 
 #define QARRAY_MALLOC xmalloc
 #define QARRAY_REALLOC xrealloc
 
 #include "qarray.h"
 
+#define LZMA_HEADER_SIZE 13
+/*
+ * Most replay text compresses well within this, though runs of identical
+ * frames go far beyond it; only bounds sizes that get allocated up front
+ */
+#define LZMA_MAX_RATIO 64
+/* osu! writes 2 MiB dictionaries; anything past this is a damaged header */
+#define LZMA_DIC_SIZE_MAX ((size_t) 64 << 20)
+
 #define STB_SPRINTF_STATIC
 #define STB_SPRINTF_IMPLEMENTATION
 #include "stb_sprintf.h"
@@ -62,16 +74,6 @@ static int compress_read(void *ctx, void *buf, size_t *size)
 	return 0;
 }
 
-static size_t decompress_write(void *ctx, const void *buf, size_t size)
-{
-	const char *b = buf;
-	ByteArray *byte_array = ctx;
-	for (size_t i = 0; i < size; ++i) {
-		string_builder_push(byte_array, b[i]);
-	}
-	return size;
-}
-
 static int decompress_read(void *ctx, void *buf, size_t *size)
 {
 	void **read_ctx = ctx;
@@ -91,9 +93,52 @@ static int decompress_read(void *ctx, void *buf, size_t *size)
 	return 0;
 }
 
+/* Writers are buffered by this much for the length of a call, so the
+ * caller's `write_n` sees blocks rather than single fields
+ */
+#define WRITE_BUFFER_SIZE (1024 * 4)
+
+/* Room for one formatted frame, even when every float takes the fallback */
+#define FRAME_TEXT_MAX 256
+
+/* `%.*f` of `value`; `out` needs 64 bytes */
+static inline size_t format_fixed(char *out, float value, int precision)
+{
+	size_t len = dec_format_fixed(out, value, precision);
+	if (len == 0) len = (size_t) stbsp_sprintf(out, "%.*f", precision, value);
+	return len;
+}
+
+/* `%0.4f|%0.4f|%0.4f|%d,`, as frames are stored */
+static size_t format_frame_record(char *out, float delta, ReplayFrame frame)
+{
+	size_t len = format_fixed(out, delta, 4);
+	out[len++] = '|';
+	len += format_fixed(&out[len], frame.mouse_x, 4);
+	out[len++] = '|';
+	len += format_fixed(&out[len], frame.mouse_y, 4);
+	out[len++] = '|';
+	len += dec_format_i64(&out[len], frame.button_state);
+	out[len++] = ',';
+	return len;
+}
+
+/* `%0.3f,%0.3f,%0.3f,%d\n` */
+static size_t format_frame_csv(char *out, ReplayFrame frame)
+{
+	size_t len = format_fixed(out, frame.time, 3);
+	out[len++] = ',';
+	len += format_fixed(&out[len], frame.mouse_x, 3);
+	out[len++] = ',';
+	len += format_fixed(&out[len], frame.mouse_y, 3);
+	out[len++] = ',';
+	len += dec_format_i64(&out[len], frame.button_state);
+	out[len++] = '\n';
+	return len;
+}
+
 static Str replay_frames_to_str(const struct ReplayFrames *frames)
 {
-	char b[1024] = {0};
 	StringBuilder sb = {0};
 	string_builder_init_cap(&sb, 1024 * 4);
 	float current_time = 0.0;
@@ -106,18 +151,12 @@ static Str replay_frames_to_str(const struct ReplayFrames *frames)
 		ReplayFrame frame = frames->items[i];
 		float diff = frame.time - current_time;
 		current_time = frame.time;
-		float mouse_x = frame.mouse_x;
-		float mouse_y = frame.mouse_y;
-		int buttons = frame.button_state;
-		size_t fmt_size = (size_t) stbsp_snprintf(b, 1024, "%0.4f|%0.4f|%0.4f|%d,", diff, mouse_x, mouse_y, buttons);
-		assert(fmt_size <= 1024);
-		Str s = { .items = b, .len = fmt_size };
-		string_builder_push_str(&sb, s);
+		/* Formatted in place, doubling when a frame might not fit */
+		if (sb.cap - sb.len < FRAME_TEXT_MAX) string_builder_reserve(&sb, sb.cap > FRAME_TEXT_MAX ? sb.cap : FRAME_TEXT_MAX);
+		sb.len += format_frame_record(&sb.items[sb.len], diff, frame);
 	}
 
-	size_t fmt_size = (size_t) stbsp_snprintf(b, 1024, "-1234|0|0|0");
-	assert(fmt_size <= 1024);
-	string_builder_push_str(&sb, (Str) { .items = b, .len = fmt_size });
+	string_builder_push_str(&sb, to_str("-1234|0|0|0"));
 	return string_builder_build(&sb);
 }
 
@@ -140,185 +179,1007 @@ static Str hp_graph_to_str(const HPGraph *graph)
 	return string_builder_build(&sb);
 }
 
-/* https://github.com/ppy/osu/blob/8bbbedaec3a1af9a255a32e3f186cfebd25d6783/osu.Game/Scoring/Legacy/LegacyScoreDecoder.cs#L263 */
-int osrp_parse_replay_frames(const ByteSlice *src, struct ReplayFrames *out)
+static bool is_seed_frame(const char *record, size_t len)
 {
-	int ret = 0;
-	float current_time = 0.0;
-	ReplayFrame *frames = NULL;
-	size_t len = 0;
-	size_t cap = 0;
-
-	size_t cursor = 0;
-	while (cursor < src->len) {
-		size_t tmp = cursor;
-		size_t num_fields = 0;
-		size_t field_locations[4]; /* idx to end of each field */
-		while (tmp < src->len && src->items[tmp] != ',') {
-			if (src->items[tmp] == '|') {
-				field_locations[num_fields++] = tmp - 1;
-			}
-			++tmp;
-		}
-		field_locations[num_fields++] = tmp - 1;
+	/* NOTE: The RNG seed frame is written as `-12345|0|0|seed` */
+	static const char prefix[] = "-1234";
+	return len >= sizeof(prefix) - 1 && memcmp(record, prefix, sizeof(prefix) - 1) == 0;
+}
+
+/*
+ * `field_ends` holds the index of the '|' ending each of the first three
+ * fields, `record_end` the index of the ',' (or end of buffer) after the last
+ */
+static void parse_frame_record(const char *items, size_t start, const size_t field_ends[3], size_t record_end, float *offset, ReplayFrame *frame)
+{
+	double d;
+	int64_t i;
 
-		if (num_fields < 4) {
-			cursor = ++tmp;
+	dec_parse_f64(&items[start], &items[field_ends[0]], &d);
+	*offset = (float) d;
+
+	dec_parse_f64(&items[field_ends[0] + 1], &items[field_ends[1]], &d);
+	frame->mouse_x = (float) d;
+
+	dec_parse_f64(&items[field_ends[1] + 1], &items[field_ends[2]], &d);
+	frame->mouse_y = (float) d;
+
+	dec_parse_i64(&items[field_ends[2] + 1], &items[record_end], &i);
+	frame->button_state = (int) i;
+}
+
+/* Elements per `OSRP_COLUMN_ALIGN` bytes of a column */
+#define COLUMN_STRIDE (OSRP_COLUMN_ALIGN / sizeof(float))
+
+/* Reallocates the columns with room for `cap` frames, rounded up to the stride */
+static void frame_columns_resize(ReplayFrameColumns *columns, size_t cap)
+{
+	cap = (cap + COLUMN_STRIDE - 1) / COLUMN_STRIDE * COLUMN_STRIDE;
+	if (cap == 0) cap = COLUMN_STRIDE;
+
+	size_t column_size = cap * sizeof(float);
+	char *block = xmalloc(column_size * 4 + OSRP_COLUMN_ALIGN - 1);
+	uintptr_t base = ((uintptr_t) block + OSRP_COLUMN_ALIGN - 1) & ~(uintptr_t) (OSRP_COLUMN_ALIGN - 1);
+	float *time = (float *) base;
+	float *mouse_x = (float *) (base + column_size);
+	float *mouse_y = (float *) (base + column_size * 2);
+	int32_t *button_state = (int32_t *) (base + column_size * 3);
+
+	if (columns->len > 0) {
+		memcpy(time, columns->time, columns->len * sizeof(*time));
+		memcpy(mouse_x, columns->mouse_x, columns->len * sizeof(*mouse_x));
+		memcpy(mouse_y, columns->mouse_y, columns->len * sizeof(*mouse_y));
+		memcpy(button_state, columns->button_state, columns->len * sizeof(*button_state));
+	}
+	free(columns->block);
+
+	columns->cap = cap;
+	columns->time = time;
+	columns->mouse_x = mouse_x;
+	columns->mouse_y = mouse_y;
+	columns->button_state = button_state;
+	columns->block = block;
+}
+
+static inline void frame_columns_push(ReplayFrameColumns *columns, ReplayFrame frame)
+{
+	if (columns->len >= columns->cap) frame_columns_resize(columns, columns->cap ? columns->cap * 2 : 64);
+	size_t i = columns->len++;
+	columns->time[i] = frame.time;
+	columns->mouse_x[i] = frame.mouse_x;
+	columns->mouse_y[i] = frame.mouse_y;
+	columns->button_state[i] = (int32_t) frame.button_state;
+}
+
+static void frame_columns_remove_range(ReplayFrameColumns *columns, size_t idx, size_t n)
+{
+	size_t tail = columns->len - idx - n;
+	memmove(&columns->time[idx], &columns->time[idx + n], tail * sizeof(*columns->time));
+	memmove(&columns->mouse_x[idx], &columns->mouse_x[idx + n], tail * sizeof(*columns->mouse_x));
+	memmove(&columns->mouse_y[idx], &columns->mouse_y[idx + n], tail * sizeof(*columns->mouse_y));
+	memmove(&columns->button_state[idx], &columns->button_state[idx + n], tail * sizeof(*columns->button_state));
+	columns->len -= n;
+}
+
+void osrp_frames_to_columns(const struct ReplayFrames *frames, ReplayFrameColumns *out)
+{
+	*out = (ReplayFrameColumns) {0};
+	frame_columns_resize(out, frames->len);
+	for (size_t i = 0; i < frames->len; ++i) {
+		out->time[i] = frames->items[i].time;
+		out->mouse_x[i] = frames->items[i].mouse_x;
+		out->mouse_y[i] = frames->items[i].mouse_y;
+		out->button_state[i] = (int32_t) frames->items[i].button_state;
+	}
+	out->len = frames->len;
+}
+
+void osrp_columns_to_frames(const ReplayFrameColumns *columns, struct ReplayFrames *out)
+{
+	out->len = columns->len;
+	out->items = xmalloc(sizeof(*out->items) * (columns->len ? columns->len : 1));
+	for (size_t i = 0; i < columns->len; ++i) {
+		out->items[i] = (ReplayFrame) {
+			.time = columns->time[i],
+			.mouse_x = columns->mouse_x[i],
+			.mouse_y = columns->mouse_y[i],
+			.button_state = columns->button_state[i],
+		};
+	}
+}
+
+void osrp_frame_columns_destroy(ReplayFrameColumns *columns)
+{
+	free(columns->block);
+	*columns = (ReplayFrameColumns) {0};
+}
+
+/*
+ * Incremental frame decoder. Text can be fed in arbitrary chunks; a record
+ * split across chunks is carried over until its ',' arrives.
+ *
+ * Frames go into `columns` when set, otherwise into `frames`.
+ */
+typedef struct FrameDecoder {
+	float current_time;
+	const Allocator *allocator; /* For `frames` */
+	ReplayFrame *frames;
+	size_t len;
+	size_t cap;
+	ReplayFrameColumns *columns;
+	StringBuilder carry;
+} FrameDecoder;
+
+static void frame_decoder_init(FrameDecoder *dec, ReplayFrameColumns *columns, const Allocator *allocator)
+{
+	dec->current_time = 0.0;
+	dec->allocator = allocator;
+	dec->frames = NULL;
+	dec->len = 0;
+	dec->cap = 0;
+	dec->columns = columns;
+	if (columns) *columns = (ReplayFrameColumns) {0};
+	dec->carry = (StringBuilder) {0};
+}
+
+static inline size_t frame_decoder_len(const FrameDecoder *dec)
+{
+	return dec->columns ? dec->columns->len : dec->len;
+}
+
+static inline float *frame_decoder_time(FrameDecoder *dec, size_t idx)
+{
+	return dec->columns ? &dec->columns->time[idx] : &dec->frames[idx].time;
+}
+
+static inline bool frame_decoder_is_skip(const FrameDecoder *dec, size_t idx)
+{
+	if (dec->columns) {
+		return dec->columns->mouse_x[idx] == 256.0 && dec->columns->mouse_y[idx] == -500.0;
+	}
+	return dec->frames[idx].mouse_x == 256.0 && dec->frames[idx].mouse_y == -500.0;
+}
+
+static void frame_decoder_copy(FrameDecoder *dec, size_t dst, size_t src)
+{
+	if (dec->columns) {
+		ReplayFrameColumns *columns = dec->columns;
+		columns->time[dst] = columns->time[src];
+		columns->mouse_x[dst] = columns->mouse_x[src];
+		columns->mouse_y[dst] = columns->mouse_y[src];
+		columns->button_state[dst] = columns->button_state[src];
+	} else {
+		dec->frames[dst] = dec->frames[src];
+	}
+}
+
+/* Makes room for `n` more frames up front, so pushes don't reallocate */
+static void frame_decoder_reserve(FrameDecoder *dec, size_t n)
+{
+	if (dec->columns) {
+		if (dec->columns->len + n > dec->columns->cap) frame_columns_resize(dec->columns, dec->columns->len + n);
+	} else {
+		qa_reserve_alloc(dec->allocator, &dec->frames, &dec->len, &dec->cap, n);
+	}
+}
+
+static void frame_decoder_remove_range(FrameDecoder *dec, size_t idx, size_t n)
+{
+	if (dec->columns) frame_columns_remove_range(dec->columns, idx, n);
+	else qa_remove_range(&dec->frames, &dec->len, idx, n);
+}
+
+static inline void frame_decoder_push(FrameDecoder *dec, ReplayFrame frame)
+{
+	if (dec->columns) frame_columns_push(dec->columns, frame);
+	else qa_push_alloc(dec->allocator, &dec->frames, &dec->len, &dec->cap, frame);
+}
+
+/*
+ * Leading frame fixups from LegacyScoreDecoder. osu! applies them after
+ * every frame is added, but they only look at the first three frames, so
+ * the pushes are replayed over the decoded frames until one changes
+ * nothing with three frames in place; no later push could either.
+ *
+ * Dropped frames are tracked as an offset and removed in one go.
+ */
+typedef struct FrameFixup {
+	size_t head; /* Frames dropped from the front */
+	size_t len;  /* Frames pushed so far, less the dropped ones */
+	bool done;
+} FrameFixup;
+
+/* Replays the push of frame `head + len` */
+static void frame_fixup_push(FrameFixup *fix, FrameDecoder *dec)
+{
+	size_t head = fix->head;
+	bool changed = false;
+	++fix->len;
+
+	if (fix->len >= 2 && *frame_decoder_time(dec, head + 1) < *frame_decoder_time(dec, head)) {
+		*frame_decoder_time(dec, head + 1) = *frame_decoder_time(dec, head);
+		*frame_decoder_time(dec, head) = 0.0;
+		changed = true;
+	}
+
+	if (fix->len >= 3 && *frame_decoder_time(dec, head) > *frame_decoder_time(dec, head + 2)) {
+		float time = *frame_decoder_time(dec, head + 2);
+		*frame_decoder_time(dec, head) = *frame_decoder_time(dec, head + 1) = time;
+		changed = true;
+	}
+
+	if (fix->len >= 2 && frame_decoder_is_skip(dec, head + 1)) {
+		/* Drop the second frame by moving the first over it */
+		frame_decoder_copy(dec, head + 1, head);
+		++head;
+		--fix->len;
+		changed = true;
+	}
+
+	if (fix->len >= 1 && frame_decoder_is_skip(dec, head)) {
+		++head;
+		--fix->len;
+		changed = true;
+	}
+
+	fix->head = head;
+	fix->done = !changed && fix->len >= 3;
+}
+
+/* Runs the fixups over every frame not yet seen by `fix` */
+static void frame_fixup_run(FrameFixup *fix, FrameDecoder *dec)
+{
+	size_t total = frame_decoder_len(dec);
+	while (!fix->done && fix->head + fix->len < total) frame_fixup_push(fix, dec);
+}
+
+static void frame_decoder_fixup(FrameDecoder *dec)
+{
+	FrameFixup fix = {0};
+	frame_fixup_run(&fix, dec);
+	frame_decoder_remove_range(dec, 0, fix.head);
+}
+
+/*
+ * Decodes every complete record in `items`. Unless `final` is set, the
+ * trailing record is assumed to be cut short and is left unparsed.
+ *
+ * Returns the number of bytes consumed.
+ */
+static size_t frame_decoder_records(FrameDecoder *dec, const char *items, size_t len, bool final)
+{
+	DelimScanner scanner;
+	ds_init(&scanner, items, len, '|', ',');
+
+	size_t record_start = 0;
+	size_t num_fields = 1;
+	size_t field_ends[3];
+	while (1) {
+		size_t pos;
+		int kind = ds_next(&scanner, &pos);
+		if (kind == DS_FIELD) {
+			if (num_fields <= 3) field_ends[num_fields - 1] = pos;
+			++num_fields;
 			continue;
 		}
-
-		{
-			const char *s = "-1234";
-			const char *p = &src->items[cursor];
-			bool eq = true;
-			while (*s && p < src->items + src->len) {
-				eq = *s == *p;
-				if (!eq) break;
-				++s;
-				++p;
-			}
-			if (eq) {
-				cursor = ++tmp;
-				continue;
-			}
+		if (kind == DS_END && !final) break;
+
+		/* Records with less than 4 fields are ignored */
+		if (num_fields >= 4 && !is_seed_frame(&items[record_start], pos - record_start)) {
+			ReplayFrame frame = {0};
+			float offset;
+			parse_frame_record(items, record_start, field_ends, pos, &offset, &frame);
+			dec->current_time += offset;
+			frame.time = dec->current_time;
+			frame_decoder_push(dec, frame);
 		}
 
-		ReplayFrame frame = {0};
-		char *endptr;
+		if (kind == DS_END) return len;
+		record_start = pos + 1;
+		num_fields = 1;
+	}
 
-		endptr = &src->items[field_locations[0]];
-		float offset = (float) strtod(&src->items[cursor], &endptr);
-		if (!endptr) {
-			ret = -EOSR_DAMAGED_FILE;
-			goto error_1;
-		}
-		current_time += offset;
-		frame.time = current_time;
+	return record_start;
+}
 
-		/* Offset cursor past the deliminator to first char */
-		cursor = field_locations[0] + 2;
-		endptr = &src->items[field_locations[1]];
-		frame.mouse_x = (float) strtod(&src->items[cursor], &endptr);
-		if (!endptr) {
-			ret = -EOSR_DAMAGED_FILE;
-			goto error_1;
+static void frame_decoder_feed(FrameDecoder *dec, const char *buf, size_t size)
+{
+	if (dec->carry.len > 0) {
+		const char *sep = memchr(buf, ',', size);
+		if (!sep) {
+			string_builder_push_str(&dec->carry, (Str) { .items = (char *) buf, .len = size });
+			return;
 		}
+		size_t n = (size_t) (sep - buf) + 1;
+		string_builder_push_str(&dec->carry, (Str) { .items = (char *) buf, .len = n });
+		frame_decoder_records(dec, dec->carry.items, dec->carry.len, false);
+		dec->carry.len = 0;
+		buf += n;
+		size -= n;
+	}
 
-		cursor = field_locations[1] + 2;
-		endptr = &src->items[field_locations[2]];
-		frame.mouse_y = (float) strtod(&src->items[cursor], &endptr);
-		if (!endptr) {
-			ret = -EOSR_DAMAGED_FILE;
-			goto error_1;
+	size_t consumed = frame_decoder_records(dec, buf, size, false);
+	if (consumed < size) {
+		if (!dec->carry.items) string_builder_init_cap(&dec->carry, 64);
+		string_builder_push_str(&dec->carry, (Str) { .items = (char *) &buf[consumed], .len = size - consumed });
+	}
+}
+
+/*
+ * Moves the decoded frames into `out` (left alone when decoding into
+ * columns) and releases the decoder
+ */
+static void frame_decoder_finish(FrameDecoder *dec, struct ReplayFrames *out)
+{
+	frame_decoder_records(dec, dec->carry.items, dec->carry.len, true);
+	if (dec->carry.items) string_builder_free(&dec->carry);
+	frame_decoder_fixup(dec);
+	if (out) {
+		/* Give back what an estimated reservation overshot */
+		if (dec->len > 0 && dec->len < dec->cap) {
+			dec->frames = allocator_realloc(dec->allocator, dec->frames,
+				sizeof(*dec->frames) * dec->cap, sizeof(*dec->frames) * dec->len);
+			dec->cap = dec->len;
 		}
+		out->len = dec->len;
+		out->items = dec->frames;
+	}
+}
 
-		cursor = field_locations[2] + 2;
-		endptr = &src->items[field_locations[3]];
-		char *nptr = &src->items[cursor];
-		frame.button_state = strtoimax(nptr, &endptr, 10);
+static void frame_decoder_free(FrameDecoder *dec)
+{
+	if (dec->carry.items) string_builder_free(&dec->carry);
+	if (dec->columns) osrp_frame_columns_destroy(dec->columns);
+	allocator_free(dec->allocator, dec->frames);
+}
 
-		qa_push(&frames, &len, &cap, frame);
+static size_t decompress_write_frames(void *ctx, const void *buf, size_t size)
+{
+	frame_decoder_feed(ctx, buf, size);
+	return size;
+}
 
-		if (len >= 2 && frames[1].time < frames[0].time) {
-			frames[1].time = frames[0].time;
-			frames[0].time = 0.0;
-		}
+static size_t decompress_write_bytes(void *ctx, const void *buf, size_t size)
+{
+	ByteArray *byte_array = ctx;
+	string_builder_push_str(byte_array, (Str) { .items = (char *) buf, .len = size });
+	return size;
+}
 
-		if (len >= 3 && frames[0].time > frames[2].time) {
-			frames[0].time = frames[1].time = frames[2].time;
+/*
+ * The LZMA-alone header is 5 bytes of properties followed by the
+ * uncompressed size as a little endian u64, all 1s when unknown.
+ *
+ * Returns false when the size is unknown.
+ */
+static bool lzma_header_size(const ByteSlice *compressed, uint64_t *out)
+{
+	if (compressed->len < LZMA_HEADER_SIZE) return false;
+	uint64_t size = 0;
+	for (int i = 0; i < 8; ++i) {
+		size |= (uint64_t) (unsigned char) compressed->items[5 + i] << (i * 8);
+	}
+	if (size == UINT64_MAX) return false;
+	*out = size;
+	return true;
+}
+
+/* Same as `lzma_header_size`, also false when implausible for `compressed` */
+static bool lzma_uncompressed_size(const ByteSlice *compressed, size_t *out)
+{
+	uint64_t size;
+	if (!lzma_header_size(compressed, &size)) return false;
+	/* Don't trust a damaged header with a huge allocation */
+	if (size / LZMA_MAX_RATIO > compressed->len) return false;
+	*out = (size_t) size;
+	return true;
+}
+
+/* Size of each pooled block, stored in front of it */
+#define LZMA_POOL_HEADER 16
+
+/*
+ * The decoder allocates its probability tables (and, when streaming, the
+ * dictionary) at the start of every run and frees them at the end; blocks
+ * freed into the pool are handed back out on the next run instead.
+ */
+static void *lzma_pool_alloc(OsrpContext *ctx, size_t size)
+{
+	size_t best = OSRP_LZMA_POOL_SIZE;
+	size_t best_cap = SIZE_MAX;
+	for (size_t i = 0; i < OSRP_LZMA_POOL_SIZE; ++i) {
+		char *block = ctx->lzma_pool[i];
+		if (!block) continue;
+		size_t cap = *(size_t *) (block - LZMA_POOL_HEADER);
+		/* Don't give a dictionary away for a header */
+		if (cap < size || cap / 2 > size) continue;
+		if (cap < best_cap) {
+			best = i;
+			best_cap = cap;
 		}
+	}
+	if (best < OSRP_LZMA_POOL_SIZE) {
+		void *block = ctx->lzma_pool[best];
+		ctx->lzma_pool[best] = NULL;
+		return block;
+	}
 
-		if (len >= 2 && frames[1].mouse_x == 256.0 && frames[1].mouse_y == -500.0) {
-			qa_remove(&frames, &len, 1, NULL);
+	char *block = malloc(LZMA_POOL_HEADER + size);
+	if (!block) return NULL;
+	*(size_t *) block = size;
+	return block + LZMA_POOL_HEADER;
+}
+
+static void lzma_pool_free(OsrpContext *ctx, void *ptr)
+{
+	if (!ptr) return;
+	for (size_t i = 0; i < OSRP_LZMA_POOL_SIZE; ++i) {
+		if (!ctx->lzma_pool[i]) {
+			ctx->lzma_pool[i] = ptr;
+			return;
 		}
+	}
+	free((char *) ptr - LZMA_POOL_HEADER);
+}
+
+static void *elzma_pool_alloc(void *ctx, unsigned int size)
+{
+	return lzma_pool_alloc(ctx, size);
+}
+
+static void elzma_pool_free(void *ctx, void *ptr)
+{
+	lzma_pool_free(ctx, ptr);
+}
+
+/* `ISzAlloc` hands itself to its callbacks */
+typedef struct LzmaPoolAlloc {
+	ISzAlloc alloc;
+	OsrpContext *ctx;
+} LzmaPoolAlloc;
+
+static void *lzmadec_pool_alloc(void *p, size_t size)
+{
+	return lzma_pool_alloc(((LzmaPoolAlloc *) p)->ctx, size);
+}
+
+static void lzmadec_pool_free(void *p, void *address)
+{
+	lzma_pool_free(((LzmaPoolAlloc *) p)->ctx, address);
+}
+
+/*
+ * Decodes all of `compressed` straight into `dest`, which has room for
+ * exactly `size` bytes, the uncompressed size from the header. The output
+ * doubles as the dictionary, so no copies are made on either side.
+ */
+static int lzma_decode_direct(OsrpContext *ctx, const ByteSlice *compressed, char *dest, size_t size)
+{
+	LzmaPoolAlloc alloc = {
+		.alloc = { .Alloc = lzmadec_pool_alloc, .Free = lzmadec_pool_free },
+		.ctx = ctx,
+	};
+	SizeT dest_len = size;
+	SizeT src_len = compressed->len - LZMA_HEADER_SIZE;
+	ELzmaStatus status;
+	SRes res = LzmaDecode(
+		(Byte *) dest, &dest_len,
+		(const Byte *) compressed->items + LZMA_HEADER_SIZE, &src_len,
+		(const Byte *) compressed->items, LZMA_PROPS_SIZE,
+		LZMA_FINISH_ANY, &status, &alloc.alloc
+	);
+	if (res != SZ_OK || dest_len != size) return -EOSR_DAMAGED_FILE;
+	return 0;
+}
+
+/* Text decoded per step of `lzma_decode_frames`, parsed while still in cache */
+#define LZMA_DECODE_WINDOW (1024 * 64)
+
+/*
+ * Decodes `compressed`, `size` bytes from the header, into `dec` a window
+ * at a time. The text only ever lives in the dictionary, min(dicSize,
+ * size) bytes, which the decoder wraps around once full.
+ */
+static int lzma_decode_frames(OsrpContext *ctx, const ByteSlice *compressed, size_t size, FrameDecoder *dec)
+{
+	LzmaPoolAlloc alloc = {
+		.alloc = { .Alloc = lzmadec_pool_alloc, .Free = lzmadec_pool_free },
+		.ctx = ctx,
+	};
+	CLzmaDec lzma;
+	LzmaDec_Construct(&lzma);
+	if (LzmaDec_AllocateProbs(&lzma, (const Byte *) compressed->items, LZMA_PROPS_SIZE, &alloc.alloc) != SZ_OK) {
+		return -EOSR_DAMAGED_FILE;
+	}
+	/* Bounds the one allocation made from the header */
+	if (lzma.prop.dicSize > LZMA_DIC_SIZE_MAX) {
+		LzmaDec_FreeProbs(&lzma, &alloc.alloc);
+		return -EOSR_DAMAGED_FILE;
+	}
+	size_t dic_size = lzma.prop.dicSize < size ? lzma.prop.dicSize : size;
+	if (dic_size < 4096) dic_size = 4096;
+	lzma.dic = lzma_pool_alloc(ctx, dic_size);
+	if (!lzma.dic) {
+		LzmaDec_FreeProbs(&lzma, &alloc.alloc);
+		return -EOSR_DAMAGED_FILE;
+	}
+	lzma.dicBufSize = dic_size;
+	LzmaDec_Init(&lzma);
 
-		if (len >= 1 && frames[0].mouse_x == 256.0 && frames[0].mouse_y == -500.0) {
-			qa_remove(&frames, &len, 0, NULL);
+	int ret = 0;
+	size_t in_pos = LZMA_HEADER_SIZE;
+	size_t left = size;
+	bool reserved = false;
+	while (left > 0) {
+		if (lzma.dicPos == lzma.dicBufSize) lzma.dicPos = 0;
+		size_t start = lzma.dicPos;
+		size_t step = lzma.dicBufSize - start;
+		if (step > LZMA_DECODE_WINDOW) step = LZMA_DECODE_WINDOW;
+		if (step > left) step = left;
+
+		SizeT in_len = compressed->len - in_pos;
+		ELzmaStatus status;
+		SRes res = LzmaDec_DecodeToDic(
+			&lzma, start + step,
+			(const Byte *) &compressed->items[in_pos], &in_len,
+			LZMA_FINISH_ANY, &status
+		);
+		size_t out_len = lzma.dicPos - start;
+		in_pos += in_len;
+		if (res != SZ_OK || (in_len == 0 && out_len == 0)) {
+			ret = -EOSR_DAMAGED_FILE;
+			break;
+		}
+		left -= out_len;
+
+		const char *text = (const char *) &lzma.dic[start];
+		if (!reserved) {
+			/* Estimated from the first window, trusting the header no
+			 * further than LZMA_MAX_RATIO; finishing gives back any excess
+			 */
+			size_t records = ds_count(text, out_len, ',');
+			double expected = (double) compressed->len * LZMA_MAX_RATIO;
+			if ((double) size < expected) expected = (double) size;
+			frame_decoder_reserve(dec, (size_t) ((double) records * expected / out_len) + 1);
+			reserved = true;
 		}
+		frame_decoder_feed(dec, text, out_len);
+	}
+
+	lzma_pool_free(ctx, lzma.dic);
+	lzma.dic = NULL;
+	LzmaDec_FreeProbs(&lzma, &alloc.alloc);
+	return ret;
+}
+
+static elzma_decompress_handle lzma_handle(OsrpContext *ctx)
+{
+	if (!ctx->lzma) {
+		ctx->lzma = elzma_decompress_alloc();
+		if (!ctx->lzma) panic("failed to allocate LZMA decoder\n");
+	}
+	/* Set on every call in case `ctx` moved; easylzma hands the malloc
+	 * context to the free callback too
+	 */
+	elzma_decompress_set_allocation_callbacks(ctx->lzma, elzma_pool_alloc, ctx, elzma_pool_free, ctx);
+	return ctx->lzma;
+}
+
+void osrp_context_destroy(OsrpContext *ctx)
+{
+	if (ctx->lzma) {
+		elzma_decompress_handle hand = ctx->lzma;
+		elzma_decompress_free(&hand);
+		ctx->lzma = NULL;
 	}
+	for (size_t i = 0; i < OSRP_LZMA_POOL_SIZE; ++i) {
+		if (ctx->lzma_pool[i]) free((char *) ctx->lzma_pool[i] - LZMA_POOL_HEADER);
+		ctx->lzma_pool[i] = NULL;
+	}
+}
+
+int osrp_decompress_replay_ctx(OsrpContext *ctx, const ByteSlice *compressed, ByteArray *out)
+{
+	size_t size;
+	if (lzma_uncompressed_size(compressed, &size)) {
+		string_builder_reserve(out, size);
+		int ret = lzma_decode_direct(ctx, compressed, out->items + out->len, size);
+		if (ret < 0) return ret;
+		out->len += size;
+		return 0;
+	}
+
+	/* Streamed without a known size */
+	size_t read_idx = 0;
+	void *read_ctx[] = { (void *) compressed, &read_idx };
+	int result = elzma_decompress_run(
+		lzma_handle(ctx),
+		decompress_read, read_ctx,
+		decompress_write_bytes, out,
+		ELZMA_lzma
+	);
+	if (result != 0) return -EOSR_DAMAGED_FILE;
+	return 0;
+}
+
+int osrp_decompress_replay(const ByteSlice *compressed, ByteArray *out)
+{
+	OsrpContext ctx = {0};
+	int ret = osrp_decompress_replay_ctx(&ctx, compressed, out);
+	osrp_context_destroy(&ctx);
+	return ret;
+}
+
+/* https://github.com/ppy/osu/blob/8bbbedaec3a1af9a255a32e3f186cfebd25d6783/osu.Game/Scoring/Legacy/LegacyScoreDecoder.cs#L263 */
+int osrp_parse_replay_frames(const ByteSlice *src, struct ReplayFrames *out)
+{
+	FrameDecoder dec;
+	frame_decoder_init(&dec, NULL, NULL);
+	/* One per ',' plus an unterminated last record */
+	frame_decoder_reserve(&dec, ds_count(src->items, src->len, ',') + 1);
+	frame_decoder_records(&dec, src->items, src->len, true);
+	frame_decoder_finish(&dec, out);
+	return 0;
+}
 
+int osrp_parse_replay_frame_columns(const ByteSlice *src, ReplayFrameColumns *out)
+{
+	FrameDecoder dec;
+	frame_decoder_init(&dec, out, NULL);
+	frame_decoder_reserve(&dec, ds_count(src->items, src->len, ',') + 1);
+	frame_decoder_records(&dec, src->items, src->len, true);
+	frame_decoder_finish(&dec, NULL);
+	return 0;
+}
+
+static int parse_hp_graph(Str hp_str, HPGraph *out, const Allocator *allocator)
+{
+	int ret = 0;
+	size_t len = 0;
+	size_t size = 0;
+	HPGraphPoint *graph_points = NULL;
+
+	DelimScanner scanner;
+	ds_init(&scanner, hp_str.items, hp_str.len, '|', ',');
+
+	size_t record_start = 0;
+	size_t field_end = 0;
+	size_t num_fields = 1;
+	while (1) {
+		size_t pos;
+		int kind = ds_next(&scanner, &pos);
+		if (kind == DS_FIELD) {
+			field_end = pos;
+			++num_fields;
+			continue;
+		}
+		if (kind == DS_END) {
+			/* Every point is terminated by ',' */
+			if (pos != record_start) {
+				ret = -EOSR_DAMAGED_FILE;
+				goto error_1;
+			}
+			break;
+		}
+		if (num_fields != 2) {
+			ret = -EOSR_DAMAGED_FILE;
+			goto error_1;
+		}
+
+		HPGraphPoint point = {0};
+		int64_t time;
+		double value;
+		dec_parse_i64(&hp_str.items[record_start], &hp_str.items[field_end], &time);
+		dec_parse_f64(&hp_str.items[field_end + 1], &hp_str.items[pos], &value);
+		point.time = (int32_t) time;
+		point.value = (float) value;
+		qa_push_alloc(allocator, &graph_points, &len, &size, point);
+
+		record_start = pos + 1;
+		num_fields = 1;
+	}
 	out->len = len;
-	out->items = frames;
+	out->items = graph_points;
+
+	return ret;
+
 error_1:
-	if (ret) free(frames);
+	allocator_free(allocator, graph_points);
 	return ret;
 }
 
 int osrp_parse_hp_graph(Str hp_str, HPGraph *out)
 {
-	size_t ret = 0;
-	size_t len = 0;
-	size_t size = 0;
-	HPGraphPoint *graph_points = NULL;
-	size_t cursor = 0;
-	while (cursor < hp_str.len) {
-		HPGraphPoint point = {0};
-		/* Two boundaries; end of first field, and
-		 * end of second field
-		 */
-		size_t field_boundaries[2];
+	return parse_hp_graph(hp_str, out, NULL);
+}
+
+/* Decompresses into `dec`, which is released on error */
+static int decode_frames(OsrpContext *ctx, const ByteSlice *compressed, FrameDecoder *dec)
+{
+	/* Nothing is allocated from the size, so highly compressed text is
+	 * decoded here too
+	 */
+	uint64_t size;
+	if (lzma_header_size(compressed, &size) && size <= SIZE_MAX) {
+		int ret = lzma_decode_frames(ctx, compressed, (size_t) size, dec);
+		if (ret < 0) frame_decoder_free(dec);
+		return ret;
+	}
+
+	/* Streamed without a known size, records are parsed as chunks arrive */
+	size_t read_idx = 0;
+	void *read_ctx[] = { (void *) compressed, &read_idx };
+	int result = elzma_decompress_run(
+		lzma_handle(ctx),
+		decompress_read, read_ctx,
+		decompress_write_frames, dec,
+		ELZMA_lzma
+	);
+	if (result != 0) {
+		/* TODO: Decompress error reason */
+		frame_decoder_free(dec);
+		return -EOSR_DAMAGED_FILE;
+	}
+	return 0;
+}
+
+int osrp_decode_frames_ctx(OsrpContext *ctx, const ByteSlice *compressed, struct ReplayFrames *out)
+{
+	FrameDecoder dec;
+	frame_decoder_init(&dec, NULL, ctx->allocator);
+	int ret = decode_frames(ctx, compressed, &dec);
+	if (ret < 0) return ret;
+	frame_decoder_finish(&dec, out);
+	return 0;
+}
+
+int osrp_decode_frames(const ByteSlice *compressed, struct ReplayFrames *out)
+{
+	OsrpContext ctx = {0};
+	int ret = osrp_decode_frames_ctx(&ctx, compressed, out);
+	osrp_context_destroy(&ctx);
+	return ret;
+}
+
+int osrp_decode_frame_columns(const ByteSlice *compressed, ReplayFrameColumns *out)
+{
+	FrameDecoder dec;
+	OsrpContext ctx = {0};
+	frame_decoder_init(&dec, out, NULL);
+	int ret = decode_frames(&ctx, compressed, &dec);
+	osrp_context_destroy(&ctx);
+	if (ret < 0) return ret;
+	frame_decoder_finish(&dec, NULL);
+	return 0;
+}
+
+/* Text decoded per step while iterating */
+#define FRAME_ITER_WINDOW (1024 * 4)
+
+typedef struct FrameIterState {
+	CLzmaDec lzma;
+	ByteSlice compressed;
+	size_t in_pos;
+	bool has_size;
+	uint64_t remaining; /* Uncompressed bytes left, when `has_size` */
+	bool eos;
+
+	/* Decoded text not parsed yet */
+	char *text;
+	size_t text_len;
+	size_t text_cap;
+
+	/* Frames parsed from the last window. Until the fixups are done every
+	 * frame is kept, but that only spans the first few frames.
+	 */
+	FrameDecoder dec;
+	FrameFixup fix;
+	size_t pos; /* Next frame to yield */
+} FrameIterState;
+
+static void *lzmadec_alloc(void *p, size_t size)
+{
+	(void) p;
+	return malloc(size);
+}
+
+static void lzmadec_free(void *p, void *address)
+{
+	(void) p;
+	free(address);
+}
+
+static ISzAlloc lzmadec_heap = { .Alloc = lzmadec_alloc, .Free = lzmadec_free };
+
+int osrp_frame_iter_init(OsrpFrameIter *iter, const ByteSlice *compressed)
+{
+	iter->state = NULL;
+	if (compressed->len < LZMA_HEADER_SIZE) return -EOSR_DAMAGED_FILE;
+
+	FrameIterState *s = xmalloc(sizeof(*s));
+	LzmaDec_Construct(&s->lzma);
+	CLzmaProps props;
+	if (LzmaProps_Decode(&props, (const Byte *) compressed->items, LZMA_PROPS_SIZE) != SZ_OK) {
+		free(s);
+		return -EOSR_DAMAGED_FILE;
+	}
+
+	s->compressed = *compressed;
+	s->in_pos = LZMA_HEADER_SIZE;
+	/* Nothing is allocated from the size, so any ratio is taken as is */
+	uint64_t size;
+	s->has_size = lzma_header_size(compressed, &size);
+	s->remaining = s->has_size ? size : 0;
+	s->eos = s->has_size && size == 0;
+
+	/* Bounds the one allocation made from the header */
+	if (props.dicSize > LZMA_DIC_SIZE_MAX) {
+		free(s);
+		return -EOSR_DAMAGED_FILE;
+	}
+	/* A dictionary larger than the whole output is never filled */
+	size_t dic_size = props.dicSize;
+	if (s->has_size && size < dic_size) dic_size = (size_t) size;
+	if (dic_size < 4096) dic_size = 4096;
+	if (LzmaDec_AllocateProbs(&s->lzma, (const Byte *) compressed->items, LZMA_PROPS_SIZE, &lzmadec_heap) != SZ_OK) {
+		free(s);
+		return -EOSR_DAMAGED_FILE;
+	}
+	s->lzma.dic = malloc(dic_size);
+	if (!s->lzma.dic) {
+		LzmaDec_FreeProbs(&s->lzma, &lzmadec_heap);
+		free(s);
+		return -EOSR_DAMAGED_FILE;
+	}
+	s->lzma.dicBufSize = dic_size;
+	LzmaDec_Init(&s->lzma);
+
+	s->text = xmalloc(FRAME_ITER_WINDOW);
+	s->text_len = 0;
+	s->text_cap = FRAME_ITER_WINDOW;
+
+	frame_decoder_init(&s->dec, NULL, NULL);
+	s->fix = (FrameFixup) {0};
+	s->pos = 0;
+	iter->state = s;
+	return 0;
+}
+
+/* Decodes until the window is full or the stream ends */
+static int frame_iter_fill(FrameIterState *s)
+{
+	while (!s->eos && s->text_len < s->text_cap) {
+		SizeT out_len = s->text_cap - s->text_len;
+		if (s->has_size && out_len > s->remaining) out_len = (SizeT) s->remaining;
+		SizeT in_len = s->compressed.len - s->in_pos;
+		ELzmaStatus status;
+		SRes res = LzmaDec_DecodeToBuf(
+			&s->lzma,
+			(Byte *) &s->text[s->text_len], &out_len,
+			(const Byte *) &s->compressed.items[s->in_pos], &in_len,
+			LZMA_FINISH_ANY, &status
+		);
+		if (res != SZ_OK) return -EOSR_DAMAGED_FILE;
+		s->in_pos += in_len;
+		s->text_len += out_len;
+		if (s->has_size) s->remaining -= out_len;
+
+		if (s->has_size) {
+			if (s->remaining == 0) s->eos = true;
+			else if (status == LZMA_STATUS_FINISHED_WITH_MARK) return -EOSR_DAMAGED_FILE;
+			else if (in_len == 0 && out_len == 0) return -EOSR_DAMAGED_FILE;
+		} else if (status == LZMA_STATUS_FINISHED_WITH_MARK) {
+			s->eos = true;
+		} else if (in_len == 0 && out_len == 0) {
+			/* Out of input */
+			if (status != LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK) return -EOSR_DAMAGED_FILE;
+			s->eos = true;
+		}
+	}
+	return 0;
+}
+
+/* Parses the next window of frames; returns 1 once there are no more */
+static int frame_iter_refill(FrameIterState *s)
+{
+	/* Yielded frames are only dropped once the fixups are done with them */
+	if (s->fix.done) {
+		s->dec.len = 0;
+		s->pos = 0;
+	}
 
-		size_t tmp = cursor;
-		size_t fb_idx = 0;
-		while (1) {
-			if (tmp >= hp_str.len) {
-				ret = -1;
-				goto error_1;
-			}
-			if (fb_idx >= sizeof(field_boundaries)) {
-				ret = -1;
-				goto error_1;
-			}
-			if (hp_str.items[tmp] == '|') {
-				field_boundaries[fb_idx++] = tmp - 1;
-				++tmp;
-			} else if (hp_str.items[tmp] == ',') {
-				field_boundaries[fb_idx] = tmp - 1;
-				if (fb_idx != 1) {
-					ret = -1;
-					goto error_1;
-				}
-				break;
-			} else {
-				++tmp;
-			}
-		}
-		const char *nptr;
-		char *endptr;
-		nptr = &hp_str.items[cursor];
-		endptr = &hp_str.items[field_boundaries[0]];
-		point.time = (int32_t) strtoimax(nptr, &endptr, 10);
-		if (!endptr) {
-			ret = -1;
-			goto error_1;
+	while (1) {
+		int ret = frame_iter_fill(s);
+		if (ret < 0) return ret;
+
+		size_t consumed = frame_decoder_records(&s->dec, s->text, s->text_len, s->eos);
+		memmove(s->text, &s->text[consumed], s->text_len - consumed);
+		s->text_len -= consumed;
+		if (s->text_len == s->text_cap) {
+			/* One record fills the window; only damaged files get here */
+			s->text_cap *= 2;
+			s->text = xrealloc(s->text, s->text_cap);
 		}
 
-		cursor = field_boundaries[0] + 1;
-		nptr = &hp_str.items[cursor];
-		endptr = &hp_str.items[field_boundaries[1]];
-		point.value = (float) strtod(nptr, &endptr);
-		if (!endptr) {
-			ret = -EOSR_DAMAGED_FILE;
-			goto error_1;
+		if (!s->fix.done) {
+			frame_fixup_run(&s->fix, &s->dec);
+			if (!s->fix.done && !s->eos) continue;
+			frame_decoder_remove_range(&s->dec, 0, s->fix.head);
+			s->fix.done = true;
 		}
-		cursor = field_boundaries[1] + 2;
-		qa_push(&graph_points, &len, &size, point);
+		if (s->pos < s->dec.len) return 0;
+		if (s->eos) return 1;
 	}
-	out->len = len;
-	out->items = graph_points;
+}
+
+int osrp_frame_iter_next(OsrpFrameIter *iter, ReplayFrame *out)
+{
+	FrameIterState *s = iter->state;
+	if (s->pos >= s->dec.len || !s->fix.done) {
+		int ret = frame_iter_refill(s);
+		if (ret != 0) return ret;
+	}
+	*out = s->dec.frames[s->pos++];
+	return 0;
+}
+
+void osrp_frame_iter_destroy(OsrpFrameIter *iter)
+{
+	FrameIterState *s = iter->state;
+	if (!s) return;
+	LzmaDec_FreeProbs(&s->lzma, &lzmadec_heap);
+	free(s->lzma.dic);
+	free(s->text);
+	frame_decoder_free(&s->dec);
+	free(s);
+	iter->state = NULL;
+}
 
+/*
+ * Borrows the string when the reader allows it, otherwise reads it into a
+ * fresh allocation. `owned` tells whether `out` has to be freed.
+ */
+static int read_str(StreamReader *reader, Str *out, bool *owned)
+{
+	int ret;
+	*owned = !reader->stable;
+	if (*owned) ret = binp_read_str(reader, out);
+	else ret = binp_borrow_str(reader, out);
+	if (ret == 1) {
+		out->items = NULL;
+		out->len = 0;
+	}
 	return ret;
+}
 
-error_1:
-	if (graph_points) free(graph_points);
+static int read_hash(StreamReader *reader, char hash[32])
+{
+	Str s;
+	bool owned;
+	int ret = read_str(reader, &s, &owned);
+	if (ret < 0) return ret;
+	if (s.len != 32) ret = -EOSR_DAMAGED_FILE;
+	else memcpy(hash, s.items, 32);
+	if (owned) free(s.items);
 	return ret;
 }
 
-/* https://github.com/ppy/osu/blob/8bbbedaec3a1af9a255a32e3f186cfebd25d6783/osu.Game/Scoring/Legacy/LegacyScoreDecoder.cs#L36 */
-int osrp_parse_osr(StreamReader *reader, OsuReplay *out)
+/*
+ * Decodes what an .osr shares with a scores.db score, from the mode up to
+ * the timestamp. The username and HP graph are only decoded when `keep`
+ * asks for them (`OSRP_SCORE_*`); otherwise they are stepped over and left
+ * empty.
+ *
+ * https://github.com/ppy/osu/blob/8bbbedaec3a1af9a255a32e3f186cfebd25d6783/osu.Game/Scoring/Legacy/LegacyScoreDecoder.cs#L36
+ */
+static int parse_score_header(OsrpContext *ctx, StreamReader *reader, OsuReplay *out, unsigned keep)
 {
 	int ret = 0;
-	if (reader->read_n(reader->ctx, 1, &out->mode) != 0) {
+	const Allocator *allocator = ctx->allocator;
+	out->allocator = allocator;
+	out->username = (Str) {0};
+	out->hp_graph = (HPGraph) {0};
+	if (stream_read(reader, 1, &out->mode) != 0) {
 		return -1;
 	}
 
@@ -326,39 +1187,19 @@ int osrp_parse_osr(StreamReader *reader, OsuReplay *out)
 		return -1;
 	}
 
-	Str tmp_str = {0};
-	ret = binp_read_str(reader, &tmp_str);
-	if (ret < 0) {
-		return -1;
-	}
-	if (tmp_str.len != sizeof(out->beatmap_hash)) {
-		free(tmp_str.items);
+	if (read_hash(reader, out->beatmap_hash) < 0) {
 		return -1;
 	}
 
-	/* TODO: Try to avoid copies */
-	memcpy(out->beatmap_hash, tmp_str.items, sizeof(out->beatmap_hash));
-	free(tmp_str.items);
-	tmp_str.items = NULL;
-	tmp_str.len = 0;
-
-	ret = binp_read_str(reader, &out->username);
+	if (keep & OSRP_SCORE_USERNAME) ret = binp_read_str_alloc(reader, &out->username, allocator);
+	else ret = binp_skip_str(reader);
 	if (ret < 0) {
 		return -1;
 	}
-	ret = binp_read_str(reader, &tmp_str);
-	if (ret < 0) {
+	if (read_hash(reader, out->md5hash) < 0) {
+		ret = -1;
 		goto error_1;
 	}
-	if (tmp_str.len != sizeof(out->md5hash)) {
-		free(tmp_str.items);
-		return -1;
-	}
-	/* TODO: Try to avoid copies */
-	memcpy(out->md5hash, tmp_str.items, sizeof(out->md5hash));
-	free(tmp_str.items);
-	tmp_str.items = NULL;
-	tmp_str.len = 0;
 
 	/* XXX: Provide error message */
 #define expect(fn, output)                 \
@@ -380,62 +1221,96 @@ int osrp_parse_osr(StreamReader *reader, OsuReplay *out)
 	expect(binp_read_i32, out->mod_bitfield);
 #undef expect
 
-	ret = binp_read_str(reader, &tmp_str);
-	if (ret < 0) {
+	if (keep & OSRP_SCORE_HP_GRAPH) {
+		Str hp_str;
+		bool hp_owned;
+		ret = read_str(reader, &hp_str, &hp_owned);
+		if (ret < 0) {
+			goto error_1;
+		}
+		ret = parse_hp_graph(hp_str, &out->hp_graph, allocator);
+		if (hp_owned) free(hp_str.items);
+		if (ret < 0) {
+			goto error_1;
+		}
+	} else if ((ret = binp_skip_str(reader)) < 0) {
 		goto error_1;
 	}
-	ret = osrp_parse_hp_graph(tmp_str, &out->hp_graph);
+
+	ret = binp_read_i64(reader, &out->date_time);
 	if (ret < 0) {
-		free(tmp_str.items);
-		goto error_1;
+		goto error_2;
 	}
-	free(tmp_str.items);
+	return 0;
 
-	/* XXX: Provide error msg */
-#define expect(fn, output)                 \
-	do {                               \
-		ret = fn(reader, &output); \
-		if (ret < 0) goto error_2; \
-	} while (0)
-	expect(binp_read_i64, out->date_time);
-#undef expect
+#define efree(ptr) allocator_free(allocator, ptr)
+error_2:
+	efree(out->hp_graph.items);
+error_1:
+	efree(out->username.items);
+#undef efree
+
+	return ret;
+}
+
+/* Only there with Target Practice, after everything else */
+static int read_target_accuracy(StreamReader *reader, OsuReplay *out)
+{
+	out->target_accuracy = 0.0;
+	if (!(out->mod_bitfield & MOD_TARGET)) return 0;
+	if (stream_read(reader, sizeof(out->target_accuracy), &out->target_accuracy) != 0) {
+		return -EOSR_DAMAGED_FILE;
+	}
+	return 0;
+}
+
+static int parse_osr(OsrpContext *ctx, StreamReader *reader, OsuReplay *out, bool decode_frames)
+{
+	size_t start = reader->pos;
+	const Allocator *allocator = ctx->allocator;
+	int ret = parse_score_header(ctx, reader, out, OSRP_SCORE_USERNAME | OSRP_SCORE_HP_GRAPH);
+	if (ret < 0) {
+		return ret;
+	}
+	out->target_accuracy = 0.0;
 
-	ByteSlice compressed_replay;
+	ByteSlice compressed_replay = {0};
+	bool compressed_owned = false;
 	{
-		int result = binp_read_byte_array(reader, &compressed_replay);
-		if (result < 0) {
-			ret = result;
-			goto error_2;
-		} else if (result == 1) {
+		int32_t len;
+		if (binp_read_i32(reader, &len) < 0) {
+			ret = -EOSR_DAMAGED_FILE;
 			goto error_2;
 		}
-		ByteArray byte_array = {0};
-		elzma_decompress_handle hand = elzma_decompress_alloc();
-		string_builder_init_cap(&byte_array, compressed_replay.len * 3 / 2);
-		size_t read_idx = 0;
-		void *read_ctx[] = { &compressed_replay, &read_idx };
-		result = elzma_decompress_run(
-			hand,
-			decompress_read, read_ctx,
-			decompress_write, &byte_array,
-			ELZMA_lzma
-		);
-		if (result != 0) {
-			/* TODO: Decompress error reason */
-			string_builder_free(&byte_array);
-			elzma_decompress_free(&hand);
-			ret = -1;
-			goto error_3;
+		out->frames.len = 0;
+		out->frames.items = NULL;
+		out->replay_data.offset = reader->pos - start;
+		out->replay_data.len = 0;
+		out->replay_data.items = NULL;
+		if (len <= 0) goto error_2;
+		out->replay_data.len = (size_t) len;
+		compressed_replay.len = (size_t) len;
+
+		/* Memory backed readers lend the compressed bytes in place */
+		compressed_replay.items = (char *) stream_borrow(reader, compressed_replay.len);
+		if (compressed_replay.items) {
+			out->replay_data.items = compressed_replay.items;
+		} else if (decode_frames) {
+			compressed_replay.items = xmalloc(compressed_replay.len);
+			compressed_owned = true;
+			if (stream_read(reader, compressed_replay.len, compressed_replay.items) != 0) {
+				ret = -EOSR_DAMAGED_FILE;
+				goto error_3;
+			}
+		} else if (stream_skip(reader, compressed_replay.len) != 0) {
+			ret = -EOSR_DAMAGED_FILE;
+			goto error_2;
 		}
 
-		elzma_decompress_free(&hand);
-		ByteSlice barray = string_builder_build(&byte_array);
-		if (osrp_parse_replay_frames(&barray, &out->frames) < 0) {
-			free(barray.items);
-			ret = -1;
-			goto error_3;
+		if (decode_frames) {
+			ret = osrp_decode_frames_ctx(ctx, &compressed_replay, &out->frames);
+			if (ret < 0) goto error_3;
 		}
-		free(barray.items);
 	}
 
 	if (out->version >= 20140721) {
@@ -453,28 +1328,81 @@ int osrp_parse_osr(StreamReader *reader, OsuReplay *out)
 	} else {
 		goto error_3;
 	}
+	ret = read_target_accuracy(reader, out);
 
-#define efree(ptr) if (ret < 0) free(ptr)
+#define efree(ptr) if (ret < 0) allocator_free(allocator, ptr)
 error_3:
-	free(compressed_replay.items);
+	if (compressed_owned) free(compressed_replay.items);
+	efree(out->frames.items);
 error_2:
 	efree(out->hp_graph.items);
-error_1:
 	efree(out->username.items);
 #undef efree
 
 	return ret;
 }
 
-/* XXX: osu!stable cannot parse the replay data
- *
- * I suspect this is because the compression header/settings are not the
- * same, and they are hardcoded in stable
- * */
-int osrp_write_osr(StreamWriter *writer, const OsuReplay *in)
+int osrp_parse_score_ctx(OsrpContext *ctx, StreamReader *reader, OsuReplay *out, unsigned keep)
+{
+	int ret = parse_score_header(ctx, reader, out, keep);
+	if (ret < 0) {
+		return ret;
+	}
+	out->frames.len = 0;
+	out->frames.items = NULL;
+	out->replay_data = (struct ReplayData) {0};
+
+	/* Always -1, scores.db keeps no replays; step over one anyway */
+	int32_t len;
+	if (binp_read_i32(reader, &len) < 0 ||
+	    (len > 0 && stream_skip(reader, (size_t) len) != 0) ||
+	    binp_read_i64(reader, &out->online_id) < 0 ||
+	    read_target_accuracy(reader, out) < 0) {
+		allocator_free(out->allocator, out->hp_graph.items);
+		allocator_free(out->allocator, out->username.items);
+		return -EOSR_DAMAGED_FILE;
+	}
+	return 0;
+}
+
+int osrp_parse_score(StreamReader *reader, OsuReplay *out, unsigned keep)
+{
+	OsrpContext ctx = {0};
+	int ret = osrp_parse_score_ctx(&ctx, reader, out, keep);
+	osrp_context_destroy(&ctx);
+	return ret;
+}
+
+int osrp_parse_osr_ctx(OsrpContext *ctx, StreamReader *reader, OsuReplay *out)
+{
+	return parse_osr(ctx, reader, out, true);
+}
+
+int osrp_parse_osr(StreamReader *reader, OsuReplay *out)
+{
+	OsrpContext ctx = {0};
+	int ret = parse_osr(&ctx, reader, out, true);
+	osrp_context_destroy(&ctx);
+	return ret;
+}
+
+int osrp_parse_osr_header_ctx(OsrpContext *ctx, StreamReader *reader, OsuReplay *out)
+{
+	return parse_osr(ctx, reader, out, false);
+}
+
+int osrp_parse_osr_header(StreamReader *reader, OsuReplay *out)
+{
+	OsrpContext ctx = {0};
+	int ret = parse_osr(&ctx, reader, out, false);
+	osrp_context_destroy(&ctx);
+	return ret;
+}
+
+static int write_osr(StreamWriter *writer, const OsuReplay *in)
 {
 	int ret = 0;
-	if (writer->write_n(writer->ctx, 1, &in->mode) < 0) {
+	if (stream_write(writer, 1, &in->mode) < 0) {
 		return -1;
 	}
 
@@ -532,16 +1460,17 @@ int osrp_write_osr(StreamWriter *writer, const OsuReplay *in)
 		/* XXX: Want to set these to the LZMA properties used
 		 * in sharpcompress and osu!
 		struct elzma_compress_handle_exposed *h = (struct elzma_compress_handle_exposed *) &hand;
-		h->props.dictSize = 1 << 21;
 		h->props.btMode = 4;
 		h->props.algo = 2;
-		h->props.lc = 3;
-		h->props.pb = 2;
-		h->props.lp = 0;
 		h->props.fb = 255;
 		*/
 
 		Str replay_str = replay_frames_to_str(&in->frames);
+		/* Like osu!, record the size so readers can decode without
+		 * streaming; 0 leaves the stream sizeless
+		 */
+		elzma_compress_config(hand, ELZMA_LC_DEFAULT, ELZMA_LP_DEFAULT, ELZMA_PB_DEFAULT,
+			5, 1 << 21, ELZMA_lzma, replay_str.len);
 		size_t read_idx = 0;
 		void *read_ctx[2] = { &replay_str, &read_idx };
 		ByteArray byte_array = {0};
@@ -581,39 +1510,534 @@ int osrp_write_osr(StreamWriter *writer, const OsuReplay *in)
 		return -1;
 	}
 
+	if (in->mod_bitfield & MOD_TARGET) {
+		ret = stream_write(writer, sizeof(in->target_accuracy), &in->target_accuracy);
+		if (ret < 0) {
+			return -1;
+		}
+	}
+
+	return ret;
+}
+
+/* XXX: osu!stable cannot parse the replay data
+ *
+ * I suspect this is because the compression header/settings are not the
+ * same, and they are hardcoded in stable
+ * */
+int osrp_write_osr(StreamWriter *writer, const OsuReplay *in)
+{
+	char buf[WRITE_BUFFER_SIZE];
+	BufferedWriter out;
+	buffered_writer_init(&out, writer, buf, sizeof(buf));
+	int ret = write_osr(&out.writer, in);
+	if (ret < 0) return ret;
+	if (buffered_writer_flush(&out) < 0) return -1;
+	return ret;
+}
+
+/*
+ * Frame cache file, see `osrp_write_cache`. Every field is in host byte
+ * order (like the rest of the binary formats here), and each section
+ * starts on an `OSRP_COLUMN_ALIGN` boundary, so a mapped file can be used
+ * in place.
+ */
+#define CACHE_FORMAT_VERSION 1
+#define CACHE_HEADER_SIZE 192
+
+/* Time column holds int16 deltas from the previous frame, in whole ms */
+#define CACHE_TIME_DELTA16 (1 << 0)
+/* Button column holds one byte per frame */
+#define CACHE_BUTTONS_U8 (1 << 1)
+
+typedef struct CacheHeader {
+	char magic[4];
+	uint32_t format;
+	int64_t date_time;
+	int64_t online_id;
+	int32_t version;
+	int32_t total_score;
+	int32_t mod_bitfield;
+	uint32_t flags;
+	char beatmap_hash[32];
+	char md5hash[32];
+	uint16_t count300;
+	uint16_t count100;
+	uint16_t count50;
+	uint16_t count_geki;
+	uint16_t count_katu;
+	uint16_t count_miss;
+	uint16_t max_combo;
+	uint8_t mode;
+	uint8_t is_perfect;
+	uint32_t username_len;
+	uint32_t hp_graph_len;
+	uint64_t frames_len;
+
+	/* Offsets from the start of the file */
+	uint64_t username;
+	uint64_t hp_graph;
+	uint64_t time;
+	uint64_t mouse_x;
+	uint64_t mouse_y;
+	uint64_t button_state;
+
+	double target_accuracy; /* Zero in caches from before it was kept */
+} CacheHeader;
+
+static inline uint64_t cache_align(uint64_t offset)
+{
+	return (offset + OSRP_COLUMN_ALIGN - 1) & ~(uint64_t) (OSRP_COLUMN_ALIGN - 1);
+}
+
+/* Whether every time is a whole number of ms, reachable in int16 steps */
+static bool cache_times_fit_delta16(const struct ReplayFrames *frames)
+{
+	int32_t prev = 0;
+	for (size_t i = 0; i < frames->len; ++i) {
+		float time = frames->items[i].time;
+		/* Also rules out -0.0, nan and anything a float can't count to */
+		if (!(time >= -16777216.0f && time <= 16777216.0f)) return false;
+		int32_t ms = (int32_t) time;
+		float back = (float) ms;
+		if (memcmp(&back, &time, sizeof(time)) != 0) return false;
+		int32_t delta = ms - prev;
+		if (delta < INT16_MIN || delta > INT16_MAX) return false;
+		prev = ms;
+	}
+	return true;
+}
+
+static bool cache_buttons_fit_u8(const struct ReplayFrames *frames)
+{
+	for (size_t i = 0; i < frames->len; ++i) {
+		if (frames->items[i].button_state < 0 || frames->items[i].button_state > UINT8_MAX) return false;
+	}
+	return true;
+}
+
+/* Pads from `*pos` up to `offset` */
+static int cache_pad(StreamWriter *writer, uint64_t *pos, uint64_t offset)
+{
+	static const char zeros[OSRP_COLUMN_ALIGN] = {0};
+	size_t n = (size_t) (offset - *pos);
+	*pos = offset;
+	return n ? stream_write(writer, n, zeros) : 0;
+}
+
+/* Columns are converted through a block at a time */
+#define CACHE_BLOCK_FRAMES 1024
+
+static int write_cache(StreamWriter *writer, const OsuReplay *in)
+{
+	const struct ReplayFrames *frames = &in->frames;
+	uint32_t flags = 0;
+	if (cache_times_fit_delta16(frames)) flags |= CACHE_TIME_DELTA16;
+	if (cache_buttons_fit_u8(frames)) flags |= CACHE_BUTTONS_U8;
+	size_t time_size = flags & CACHE_TIME_DELTA16 ? sizeof(int16_t) : sizeof(float);
+	size_t button_size = flags & CACHE_BUTTONS_U8 ? sizeof(uint8_t) : sizeof(int32_t);
+	uint64_t len = frames->len;
+
+	assert(sizeof(CacheHeader) == CACHE_HEADER_SIZE);
+	CacheHeader header = {
+		.magic = OSRP_CACHE_MAGIC,
+		.format = CACHE_FORMAT_VERSION,
+		.date_time = in->date_time,
+		.online_id = in->online_id,
+		.target_accuracy = in->target_accuracy,
+		.version = in->version,
+		.total_score = in->total_score,
+		.mod_bitfield = in->mod_bitfield,
+		.flags = flags,
+		.count300 = in->count300,
+		.count100 = in->count100,
+		.count50 = in->count50,
+		.count_geki = in->count_geki,
+		.count_katu = in->count_katu,
+		.count_miss = in->count_miss,
+		.max_combo = in->max_combo,
+		.mode = in->mode,
+		.is_perfect = in->is_perfect,
+		.username_len = (uint32_t) in->username.len,
+		.hp_graph_len = (uint32_t) in->hp_graph.len,
+		.frames_len = len,
+	};
+	memcpy(header.beatmap_hash, in->beatmap_hash, sizeof(header.beatmap_hash));
+	memcpy(header.md5hash, in->md5hash, sizeof(header.md5hash));
+	header.username = CACHE_HEADER_SIZE;
+	header.hp_graph = cache_align(header.username + in->username.len);
+	header.time = cache_align(header.hp_graph + in->hp_graph.len * sizeof(HPGraphPoint));
+	header.mouse_x = cache_align(header.time + len * time_size);
+	header.mouse_y = cache_align(header.mouse_x + len * sizeof(float));
+	header.button_state = cache_align(header.mouse_y + len * sizeof(float));
+
+	uint64_t pos = CACHE_HEADER_SIZE;
+	if (stream_write(writer, sizeof(header), &header) < 0) return -1;
+	if (in->username.len > 0 && stream_write(writer, in->username.len, in->username.items) < 0) return -1;
+	pos += in->username.len;
+	if (cache_pad(writer, &pos, header.hp_graph) < 0) return -1;
+	pos += in->hp_graph.len * sizeof(HPGraphPoint);
+	if (in->hp_graph.len > 0 && stream_write(writer, in->hp_graph.len * sizeof(HPGraphPoint), in->hp_graph.items) < 0) return -1;
+
+	union {
+		int16_t delta[CACHE_BLOCK_FRAMES];
+		float f32[CACHE_BLOCK_FRAMES];
+		int32_t i32[CACHE_BLOCK_FRAMES];
+		uint8_t u8[CACHE_BLOCK_FRAMES];
+	} block;
+
+	/* One column at a time: time, mouse_x, mouse_y, button_state */
+	uint64_t offsets[] = { header.time, header.mouse_x, header.mouse_y, header.button_state };
+	size_t sizes[] = { time_size, sizeof(float), sizeof(float), button_size };
+	for (int column = 0; column < 4; ++column) {
+		if (cache_pad(writer, &pos, offsets[column]) < 0) return -1;
+		int32_t prev = 0;
+		for (size_t start = 0; start < len; start += CACHE_BLOCK_FRAMES) {
+			size_t n = len - start < CACHE_BLOCK_FRAMES ? len - start : CACHE_BLOCK_FRAMES;
+			const ReplayFrame *f = &frames->items[start];
+			for (size_t i = 0; i < n; ++i) {
+				switch (column) {
+				case 0:
+					if (flags & CACHE_TIME_DELTA16) {
+						int32_t ms = (int32_t) f[i].time;
+						block.delta[i] = (int16_t) (ms - prev);
+						prev = ms;
+					} else {
+						block.f32[i] = f[i].time;
+					}
+					break;
+				case 1: block.f32[i] = f[i].mouse_x; break;
+				case 2: block.f32[i] = f[i].mouse_y; break;
+				default:
+					if (flags & CACHE_BUTTONS_U8) block.u8[i] = (uint8_t) f[i].button_state;
+					else block.i32[i] = (int32_t) f[i].button_state;
+				}
+			}
+			if (stream_write(writer, n * sizes[column], &block) < 0) return -1;
+		}
+		pos += len * sizes[column];
+	}
+
+	return 0;
+}
+
+int osrp_write_cache(StreamWriter *writer, const OsuReplay *in)
+{
+	char buf[WRITE_BUFFER_SIZE];
+	BufferedWriter out;
+	buffered_writer_init(&out, writer, buf, sizeof(buf));
+	int ret = write_cache(&out.writer, in);
+	if (ret < 0) return ret;
+	return buffered_writer_flush(&out);
+}
+
+/* Moves the reader from `*pos` to the section at `offset` */
+static int cache_seek(StreamReader *reader, uint64_t *pos, uint64_t offset)
+{
+	if (offset < *pos || offset % OSRP_COLUMN_ALIGN != 0) return -EOSR_DAMAGED_FILE;
+	if (stream_skip(reader, (size_t) (offset - *pos)) != 0) return -EOSR_DAMAGED_FILE;
+	*pos = offset;
+	return 0;
+}
+
+/* Reads `n` bytes of the section at `offset` into `out` */
+static int cache_read(StreamReader *reader, uint64_t *pos, uint64_t offset, size_t n, void *out)
+{
+	int ret = cache_seek(reader, pos, offset);
+	if (ret < 0) return ret;
+	if (n > 0 && stream_read(reader, n, out) != 0) return -EOSR_DAMAGED_FILE;
+	*pos += n;
+	return 0;
+}
+
+/*
+ * Checks the sections follow each other, without overlapping, within
+ * `limit` bytes. `end` is set to where the last one stops.
+ */
+static bool cache_layout_valid(const CacheHeader *h, uint64_t limit, uint64_t *end)
+{
+	size_t time_size = h->flags & CACHE_TIME_DELTA16 ? sizeof(int16_t) : sizeof(float);
+	size_t button_size = h->flags & CACHE_BUTTONS_U8 ? sizeof(uint8_t) : sizeof(int32_t);
+	/* Keeps the products below from overflowing */
+	if (h->frames_len > SIZE_MAX / sizeof(ReplayFrame) || h->frames_len > (UINT64_MAX >> 8)) return false;
+	uint64_t sections[][2] = {
+		{ h->username, h->username_len },
+		{ h->hp_graph, (uint64_t) h->hp_graph_len * sizeof(HPGraphPoint) },
+		{ h->time, h->frames_len * time_size },
+		{ h->mouse_x, h->frames_len * sizeof(float) },
+		{ h->mouse_y, h->frames_len * sizeof(float) },
+		{ h->button_state, h->frames_len * button_size },
+	};
+	uint64_t pos = CACHE_HEADER_SIZE;
+	for (size_t i = 0; i < sizeof(sections) / sizeof(*sections); ++i) {
+		uint64_t offset = sections[i][0];
+		uint64_t size = sections[i][1];
+		if (offset < pos || offset > limit || size > limit - offset) return false;
+		pos = offset + size;
+	}
+	*end = pos;
+	return true;
+}
+
+/* Largest step of `cache_drain`, so a damaged length can't allocate much */
+#define CACHE_DRAIN_STEP (1024 * 1024)
+
+/* Reads `n` bytes, growing the buffer only as they arrive; NULL when short */
+static char *cache_drain(StreamReader *reader, uint64_t n)
+{
+	if (n > SIZE_MAX) return NULL;
+	size_t cap = n < CACHE_DRAIN_STEP ? (size_t) n : CACHE_DRAIN_STEP;
+	char *buf = xmalloc(cap > 0 ? cap : 1);
+	size_t len = 0;
+	while (len < n) {
+		if (len == cap) {
+			cap = cap < n - cap ? cap * 2 : (size_t) n;
+			buf = xrealloc(buf, cap);
+		}
+		size_t step = cap - len < CACHE_DRAIN_STEP ? cap - len : CACHE_DRAIN_STEP;
+		if (stream_read(reader, step, &buf[len]) != 0) {
+			free(buf);
+			return NULL;
+		}
+		len += step;
+	}
+	return buf;
+}
+
+/*
+ * Column decoders; each writes one 4 byte element every `stride` bytes of
+ * `out`, so frames and columns are filled alike
+ */
+static void cache_unpack_raw32(const char *data, size_t len, char *out, size_t stride)
+{
+	for (size_t i = 0; i < len; ++i) memcpy(&out[i * stride], &data[i * 4], 4);
+}
+
+static void cache_unpack_delta16(const char *data, size_t len, char *out, size_t stride)
+{
+	int64_t ms = 0;
+	for (size_t i = 0; i < len; ++i) {
+		int16_t delta;
+		memcpy(&delta, &data[i * sizeof(delta)], sizeof(delta));
+		ms += delta;
+		float time = (float) ms;
+		memcpy(&out[i * stride], &time, sizeof(time));
+	}
+}
+
+static void cache_unpack_u8(const char *data, size_t len, char *out, size_t stride)
+{
+	for (size_t i = 0; i < len; ++i) {
+		int32_t b = (unsigned char) data[i];
+		memcpy(&out[i * stride], &b, sizeof(b));
+	}
+}
+
+static int read_cache(StreamReader *reader, OsuReplay *out, ReplayFrameColumns *columns)
+{
+	int ret = 0;
+	CacheHeader h;
+	assert(sizeof(CacheHeader) == CACHE_HEADER_SIZE);
+	if (stream_read(reader, sizeof(h), &h) != 0) return -EOSR_UNKNOWN_FILE;
+	if (memcmp(h.magic, OSRP_CACHE_MAGIC, sizeof(h.magic)) != 0 || h.format != CACHE_FORMAT_VERSION) {
+		return -EOSR_UNKNOWN_FILE;
+	}
+	/* Memory backed readers can vet the whole layout up front */
+	uint64_t limit = reader->stable ? CACHE_HEADER_SIZE + (uint64_t) reader->buf_len : UINT64_MAX;
+	uint64_t end;
+	if (!cache_layout_valid(&h, limit, &end)) return -EOSR_DAMAGED_FILE;
+
+	/*
+	 * Other readers can't be vetted, so the rest is drained into memory
+	 * first: a damaged length then fails on the short read instead of
+	 * allocating its whole size
+	 */
+	char *body = NULL;
+	StreamReader body_reader;
+	if (!reader->stable) {
+		body = cache_drain(reader, end - CACHE_HEADER_SIZE);
+		if (!body) return -EOSR_DAMAGED_FILE;
+		ByteSlice slice = { .items = body, .len = (size_t) (end - CACHE_HEADER_SIZE) };
+		memory_reader_init(&body_reader, &slice);
+		reader = &body_reader;
+	}
+
+	*out = (OsuReplay) {
+		.mode = h.mode,
+		.version = h.version,
+		.count300 = h.count300,
+		.count100 = h.count100,
+		.count50 = h.count50,
+		.count_geki = h.count_geki,
+		.count_katu = h.count_katu,
+		.count_miss = h.count_miss,
+		.total_score = h.total_score,
+		.max_combo = h.max_combo,
+		.is_perfect = h.is_perfect,
+		.mod_bitfield = h.mod_bitfield,
+		.date_time = h.date_time,
+		.online_id = h.online_id,
+		.target_accuracy = h.target_accuracy,
+	};
+	memcpy(out->beatmap_hash, h.beatmap_hash, sizeof(out->beatmap_hash));
+	memcpy(out->md5hash, h.md5hash, sizeof(out->md5hash));
+
+	uint64_t pos = CACHE_HEADER_SIZE;
+	if (h.username_len > 0) {
+		out->username.len = h.username_len;
+		out->username.items = xmalloc(h.username_len);
+	}
+	if ((ret = cache_read(reader, &pos, h.username, h.username_len, out->username.items)) < 0) goto error_1;
+
+	size_t hp_size = sizeof(HPGraphPoint) * h.hp_graph_len;
+	if (h.hp_graph_len > 0) {
+		out->hp_graph.len = h.hp_graph_len;
+		out->hp_graph.items = xmalloc(hp_size);
+	}
+	if ((ret = cache_read(reader, &pos, h.hp_graph, hp_size, out->hp_graph.items)) < 0) goto error_2;
+
+	size_t len = (size_t) h.frames_len;
+	ReplayFrame *frames = NULL;
+	if (columns) {
+		*columns = (ReplayFrameColumns) {0};
+		frame_columns_resize(columns, len);
+		columns->len = len;
+	} else if (len > 0) {
+		frames = xmalloc(sizeof(*frames) * len);
+	}
+
+	bool time_delta = h.flags & CACHE_TIME_DELTA16;
+	bool buttons_u8 = h.flags & CACHE_BUTTONS_U8;
+	struct {
+		uint64_t offset;
+		size_t size; /* Per element */
+		char *column;
+		size_t field;
+	} sections[] = {
+		{ h.time, time_delta ? sizeof(int16_t) : 4, columns ? (char *) columns->time : NULL, offsetof(ReplayFrame, time) },
+		{ h.mouse_x, 4, columns ? (char *) columns->mouse_x : NULL, offsetof(ReplayFrame, mouse_x) },
+		{ h.mouse_y, 4, columns ? (char *) columns->mouse_y : NULL, offsetof(ReplayFrame, mouse_y) },
+		{ h.button_state, buttons_u8 ? 1 : 4, columns ? (char *) columns->button_state : NULL, offsetof(ReplayFrame, button_state) },
+	};
+	for (size_t i = 0; i < sizeof(sections) / sizeof(*sections) && len > 0; ++i) {
+		size_t size = len * sections[i].size;
+		char *dst = sections[i].column;
+		size_t stride = 4;
+		if (!dst) {
+			dst = (char *) frames + sections[i].field;
+			stride = sizeof(*frames);
+		}
+
+		/* Raw columns are read straight into place */
+		if (sections[i].column && sections[i].size == 4) {
+			if ((ret = cache_read(reader, &pos, sections[i].offset, size, dst)) < 0) goto error_3;
+			continue;
+		}
+
+		if ((ret = cache_seek(reader, &pos, sections[i].offset)) < 0) goto error_3;
+		/* Borrowed in place from memory readers */
+		char *scratch = NULL;
+		const char *data = stream_borrow(reader, size);
+		if (!data) {
+			data = scratch = xmalloc(size);
+			if (stream_read(reader, size, scratch) != 0) {
+				free(scratch);
+				ret = -EOSR_DAMAGED_FILE;
+				goto error_3;
+			}
+		}
+		pos += size;
+
+		if (sections[i].size == 4) cache_unpack_raw32(data, len, dst, stride);
+		else if (i == 0) cache_unpack_delta16(data, len, dst, stride);
+		else cache_unpack_u8(data, len, dst, stride);
+		free(scratch);
+	}
+
+	out->frames.len = columns ? 0 : len;
+	out->frames.items = frames;
+	free(body);
+	return 0;
+
+error_3:
+	if (columns) osrp_frame_columns_destroy(columns);
+	free(frames);
+error_2:
+	free(out->hp_graph.items);
+error_1:
+	free(out->username.items);
+	free(body);
 	return ret;
 }
 
+int osrp_read_cache(StreamReader *reader, OsuReplay *out)
+{
+	return read_cache(reader, out, NULL);
+}
+
+int osrp_read_cache_columns(StreamReader *reader, OsuReplay *out, ReplayFrameColumns *columns)
+{
+	return read_cache(reader, out, columns);
+}
+
 void osrp_replay_destroy(OsuReplay *replay)
 {
-	free(replay->hp_graph.items);
-	free(replay->username.items);
-	free(replay->frames.items);
+	allocator_free(replay->allocator, replay->hp_graph.items);
+	allocator_free(replay->allocator, replay->username.items);
+	allocator_free(replay->allocator, replay->frames.items);
 }
 
-int osrp_replay_frame_csv(StreamWriter *writer, const OsuReplay *replay, bool header)
+/* Formats in place, flushing first when a frame might not fit */
+static inline int csv_push(BufferedWriter *out, ReplayFrame frame)
+{
+	StreamWriter *w = &out->writer;
+	if (w->buf_len < FRAME_TEXT_MAX && buffered_writer_flush(out) < 0) return -1;
+	size_t len = format_frame_csv(w->buf, frame);
+	w->buf += len;
+	w->buf_len -= len;
+	return 0;
+}
+
+static int replay_frame_csv(BufferedWriter *out, const OsuReplay *replay, bool header)
 {
-	char buf[1024];
 	if (header) {
-		size_t fmt_size = (size_t) stbsp_snprintf(
-			buf, 1024, "time,mouse_x,mouse_y,button_state\n"
-		);
-		assert(fmt_size < 1024);
-		if (writer->write_n(writer->ctx, fmt_size, buf) != 0) {
+		static const char columns[] = "time,mouse_x,mouse_y,button_state\n";
+		if (stream_write(&out->writer, sizeof(columns) - 1, columns) != 0) {
 			return -1;
 		}
 	}
 
-	for (size_t i = 0; i < replay->frames.len; ++i) {
-		ReplayFrame frame = replay->frames.items[i];
-		size_t fmt_size = (size_t) stbsp_snprintf(
-			buf, 1024, "%0.3f,%0.3f,%0.3f,%d\n",
-			frame.time, frame.mouse_x, frame.mouse_y, frame.button_state
-		);
-		assert(fmt_size < 1024);
-		if (writer->write_n(writer->ctx, fmt_size, buf) != 0) {
-			return -1;
+	if (replay->frames.items || !replay->replay_data.items) {
+		for (size_t i = 0; i < replay->frames.len; ++i) {
+			if (csv_push(out, replay->frames.items[i]) < 0) return -1;
 		}
+		return 0;
 	}
-	return 0;
+
+	ByteSlice compressed = {
+		.items = (char *) replay->replay_data.items,
+		.len = replay->replay_data.len,
+	};
+	OsrpFrameIter iter;
+	int ret = osrp_frame_iter_init(&iter, &compressed);
+	if (ret < 0) return ret;
+	ReplayFrame frame;
+	while ((ret = osrp_frame_iter_next(&iter, &frame)) == 0) {
+		if (csv_push(out, frame) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	osrp_frame_iter_destroy(&iter);
+	return ret < 0 ? ret : 0;
+}
+
+int osrp_replay_frame_csv(StreamWriter *writer, const OsuReplay *replay, bool header)
+{
+	char buf[WRITE_BUFFER_SIZE];
+	BufferedWriter out;
+	buffered_writer_init(&out, writer, buf, sizeof(buf));
+	int ret = replay_frame_csv(&out, replay, header);
+	if (ret < 0) return ret;
+	return buffered_writer_flush(&out);
 }
@@ -36,6 +36,28 @@ typedef struct ReplayFrame {
 	int button_state;
 } ReplayFrame;
 
+/* Alignment of every column in `ReplayFrameColumns` */
+#define OSRP_COLUMN_ALIGN 32
+
+/*
+ * Structure-of-arrays form of `struct ReplayFrames`, for column scans.
+ *
+ * Each column starts on an `OSRP_COLUMN_ALIGN` byte boundary and has room
+ * for `cap` elements, a multiple of `OSRP_COLUMN_ALIGN / 4`, so vector
+ * loads may run into the padding past `len`. The padding is unspecified.
+ *
+ * All columns share `block`; release with `osrp_frame_columns_destroy`.
+ */
+typedef struct ReplayFrameColumns {
+	size_t len;
+	size_t cap;
+	float *time; /* NOTE: This is NOT delta */
+	float *mouse_x;
+	float *mouse_y;
+	int32_t *button_state;
+	void *block;
+} ReplayFrameColumns;
+
 /* XXX: Pack this better */
 typedef struct OsuReplay {
 	unsigned char mode;
@@ -69,19 +91,178 @@ typedef struct OsuReplay {
 		ReplayFrame *items;
 	} frames;
 
+	/* Location of the LZMA compressed frames, relative to the reader
+	 * position when parsing started. `items` points into the reader's
+	 * memory for `stable` readers and is NULL otherwise; never freed.
+	 */
+	struct ReplayData {
+		size_t offset;
+		size_t len;
+		const char *items;
+	} replay_data;
+
 	int64_t online_id;
+	double target_accuracy; /* NOTE: Only stored with Target Practice */
+
+	/* Where the owned fields came from, see `OsrpContext` */
+	const Allocator *allocator;
 } OsuReplay;
 
+#define OSRP_LZMA_POOL_SIZE 4
+
+/*
+ * Caller owned parse state; zero initialize for the defaults and release
+ * with `osrp_context_destroy`. Reuse one per thread across replays.
+ */
+typedef struct OsrpContext {
+	/* Backs everything a parsed replay owns (username, HP graph and
+	 * frames), NULL for the heap. Short lived scratch buffers always
+	 * come from the heap.
+	 *
+	 * With an arena, skip `osrp_replay_destroy` and reset the arena.
+	 */
+	const Allocator *allocator;
+
+	/* LZMA decoder state kept for the next replay: the streaming
+	 * decoder (with its 320 KiB of buffers) used when the header has
+	 * no size, and a pool of the tables and dictionaries allocated
+	 * while decoding. Created on first use.
+	 */
+	void *lzma;
+	void *lzma_pool[OSRP_LZMA_POOL_SIZE];
+} OsrpContext;
+
+void osrp_context_destroy(OsrpContext *ctx);
+
 const char *osrp_error_msg(int error_code);
 
 int osrp_parse_replay_frames(const ByteSlice *src, struct ReplayFrames *out);
 
+/*
+ * Decompress LZMA replay data into its text form, appending to `out`.
+ *
+ * `out` must be zero initialized or initialized, its `allocator` is used.
+ * It is grown once up front when the LZMA header records the uncompressed
+ * size.
+ */
+int osrp_decompress_replay(const ByteSlice *compressed, ByteArray *out);
+
+int osrp_decompress_replay_ctx(OsrpContext *ctx, const ByteSlice *compressed, ByteArray *out);
+
 int osrp_parse_osr(StreamReader *reader, OsuReplay *out);
 
+int osrp_parse_osr_ctx(OsrpContext *ctx, StreamReader *reader, OsuReplay *out);
+
+/*
+ * Same as `osrp_parse_osr`, except the compressed frames are skipped
+ * (seeking when the reader supports it) and `out->frames` is left empty.
+ *
+ * Frames can be decoded later from the bytes at `out->replay_data` with
+ * `osrp_decode_frames`.
+ */
+int osrp_parse_osr_header(StreamReader *reader, OsuReplay *out);
+
+int osrp_parse_osr_header_ctx(OsrpContext *ctx, StreamReader *reader, OsuReplay *out);
+
+int osrp_decode_frames(const ByteSlice *compressed, struct ReplayFrames *out);
+
+/* Fields of a score that allocate, for `keep` in `osrp_parse_score` */
+enum {
+	OSRP_SCORE_USERNAME = 1 << 0,
+	OSRP_SCORE_HP_GRAPH = 1 << 1,
+};
+
+/*
+ * Reads one score the way scores.db stores them: the header of an .osr
+ * (decoded by the same code as `osrp_parse_osr`) without its replay,
+ * followed by the online id.
+ *
+ * Only the fields in `keep` are allocated, the rest are skipped and left
+ * empty; with `keep` of 0 nothing is allocated at all.
+ */
+int osrp_parse_score(StreamReader *reader, OsuReplay *out, unsigned keep);
+
+int osrp_parse_score_ctx(OsrpContext *ctx, StreamReader *reader, OsuReplay *out, unsigned keep);
+
+int osrp_decode_frames_ctx(OsrpContext *ctx, const ByteSlice *compressed, struct ReplayFrames *out);
+
+/*
+ * Same as `osrp_parse_replay_frames` and `osrp_decode_frames`, except frames
+ * are written straight into the columns of `out`.
+ */
+int osrp_parse_replay_frame_columns(const ByteSlice *src, ReplayFrameColumns *out);
+
+int osrp_decode_frame_columns(const ByteSlice *compressed, ReplayFrameColumns *out);
+
+/* Conversions between layouts; `out` is overwritten, not appended to */
+void osrp_frames_to_columns(const struct ReplayFrames *frames, ReplayFrameColumns *out);
+
+void osrp_columns_to_frames(const ReplayFrameColumns *columns, struct ReplayFrames *out);
+
+void osrp_frame_columns_destroy(ReplayFrameColumns *columns);
+
+/*
+ * Pull based frame decoder. Frames are decoded a few KiB of text at a time,
+ * so memory use doesn't grow with the length of the replay.
+ *
+ * `compressed` is borrowed and must outlive the iterator. Frames come out
+ * the same as from `osrp_decode_frames`, leading fixups included.
+ *
+ * Usage:
+ * OsrpFrameIter iter;
+ * ReplayFrame frame;
+ * if (osrp_frame_iter_init(&iter, &compressed) < 0) ...
+ * while ((ret = osrp_frame_iter_next(&iter, &frame)) == 0) ...
+ * osrp_frame_iter_destroy(&iter);
+ */
+typedef struct OsrpFrameIter {
+	void *state;
+} OsrpFrameIter;
+
+int osrp_frame_iter_init(OsrpFrameIter *iter, const ByteSlice *compressed);
+
+/*
+ * Returns 0 and sets `out` for the next frame, 1 when there are no more.
+ * Damaged data may only be noticed after some frames were returned.
+ */
+int osrp_frame_iter_next(OsrpFrameIter *iter, ReplayFrame *out);
+
+/* Safe to call after a failed init */
+void osrp_frame_iter_destroy(OsrpFrameIter *iter);
+
 void osrp_replay_destroy(OsuReplay *replay);
 
+/*
+ * Frames are taken from `replay->frames` when it was decoded, otherwise
+ * streamed from `replay->replay_data` (see `osrp_parse_osr_header`).
+ */
 int osrp_replay_frame_csv(StreamWriter *writer, const OsuReplay *replay, bool header);
 
 int osrp_write_osr(StreamWriter *writer, const OsuReplay *in);
 
+/* First bytes of a file written by `osrp_write_cache` */
+#define OSRP_CACHE_MAGIC "OSRC"
+
+/*
+ * Writes `in` as a frame cache: a fixed 192 byte header with the replay
+ * metadata, then the username, the HP graph and one section per frame
+ * column, each starting on an `OSRP_COLUMN_ALIGN` boundary.
+ *
+ * Times are stored as int16 deltas when they're all whole milliseconds
+ * that close together, raw floats otherwise. Coordinates are always raw
+ * floats, buttons take a byte each when they fit. Nothing is lost, and the
+ * file can be mapped and read without parsing any text.
+ */
+int osrp_write_cache(StreamWriter *writer, const OsuReplay *in);
+
+/*
+ * Reads a replay written by `osrp_write_cache`; frames go into
+ * `out->frames`. `out->replay_data` is left empty, and owned fields come
+ * from the heap.
+ */
+int osrp_read_cache(StreamReader *reader, OsuReplay *out);
+
+/* Same as `osrp_read_cache`, except frames go into `columns` */
+int osrp_read_cache_columns(StreamReader *reader, OsuReplay *out, ReplayFrameColumns *columns);
+
 #endif
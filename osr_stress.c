@@ -0,0 +1,205 @@
+/*
+ * Parses valid and truncated replays on many threads at once and checks
+ * that every thread only ever sees its own error messages.
+ *
+ * Each corrupt replay is cut in the middle of a username of a different
+ * length, so the message it fails with ("Could not read N bytes...") is
+ * unique to it. The expected results come from a single threaded pass.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xutils.h"
+#include "osr_parser.h"
+#include "binary_parser.h"
+#include "mods.h"
+#include "stream.h"
+#include "string_builder.h"
+
+#define DEFAULT_THREADS 16
+#define DEFAULT_ROUNDS 200
+#define FRAMES 512
+
+/* Replay type (1), version (4) and beatmap hash (2 + 32) */
+#define USERNAME_OFFSET 39
+
+typedef struct Input {
+	ByteSlice file;
+	bool corrupt;
+	size_t frames;
+
+	/* Result of the single threaded pass */
+	int ret;
+	char msg[256];
+	size_t msg_len;
+} Input;
+
+typedef struct Worker {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	const Input *input;
+	size_t rounds;
+	size_t failures;
+} Worker;
+
+static int write_string_builder(void *ctx, size_t size, const void *buf)
+{
+	string_builder_push_str(ctx, (Str) { .items = (char *) buf, .len = size });
+	return 0;
+}
+
+static void gen_input(size_t id, Input *out)
+{
+	char username[128];
+	size_t username_len = 8 + id;
+	if (username_len >= sizeof(username)) panic("Too many threads\n");
+	for (size_t i = 0; i < username_len; ++i) username[i] = 'a' + (char) (i % 26);
+
+	OsuReplay replay = {0};
+	replay.mode = MODE_OSU;
+	replay.version = 20240101;
+	memset(replay.beatmap_hash, '0' + (char) (id % 10), sizeof(replay.beatmap_hash));
+	memset(replay.md5hash, 'f', sizeof(replay.md5hash));
+	replay.username = (Str) { .items = username, .len = username_len };
+	replay.total_score = (int32_t) id;
+	replay.mod_bitfield = MOD_HIDDEN;
+
+	replay.frames.len = FRAMES;
+	replay.frames.items = xmalloc(sizeof(*replay.frames.items) * FRAMES);
+	for (size_t i = 0; i < FRAMES; ++i) {
+		replay.frames.items[i] = (ReplayFrame) {
+			.time = (float) (16 * i),
+			.mouse_x = (float) ((i * 7 + id) % 512),
+			.mouse_y = (float) ((i * 3 + id) % 384),
+			.button_state = (int) (i % 4),
+		};
+	}
+
+	StringBuilder sb;
+	string_builder_init(&sb);
+	StreamWriter writer = { .ctx = &sb, .write_n = write_string_builder };
+	if (osrp_write_osr(&writer, &replay) < 0) panic("Could not write replay %zu\n", id);
+	free(replay.frames.items);
+
+	*out = (Input) {0};
+	out->file = string_builder_build(&sb);
+	out->corrupt = id % 2 == 1;
+	out->frames = FRAMES;
+	if (out->corrupt) {
+		/* Cut halfway through the username */
+		out->file.len = USERNAME_OFFSET + 2 + username_len / 2;
+	}
+}
+
+static int parse(const Input *input, size_t *frames)
+{
+	StreamReader reader;
+	memory_reader_init(&reader, &input->file);
+	OsuReplay replay = {0};
+	int ret = osrp_parse_osr(&reader, &replay);
+	*frames = ret < 0 ? 0 : replay.frames.len;
+	if (ret >= 0) osrp_replay_destroy(&replay);
+	return ret;
+}
+
+static void *worker_run(void *arg)
+{
+	Worker *worker = arg;
+	const Input *input = worker->input;
+	pthread_barrier_wait(worker->barrier);
+
+	for (size_t round = 0; round < worker->rounds; ++round) {
+		size_t frames;
+		int ret = parse(input, &frames);
+		bool ok = ret == input->ret
+			&& strcmp(osrp_error_msg(ret), osrp_error_msg(input->ret)) == 0
+			&& binp_error_msg_len() == input->msg_len
+			&& memcmp(binp_error_msg(), input->msg, input->msg_len) == 0;
+		if (!input->corrupt) ok = ok && frames == input->frames;
+		if (!ok) {
+			fprintf(stderr, "Round %zu: got %d \"%.*s\", expected %d \"%.*s\"\n",
+				round, ret, (int) binp_error_msg_len(), binp_error_msg(),
+				input->ret, (int) input->msg_len, input->msg);
+			worker->failures++;
+		}
+	}
+	return NULL;
+}
+
+/* Runs the expected pass on its own thread so it starts with no error */
+static void *expect_run(void *arg)
+{
+	Input *input = arg;
+	size_t frames;
+	input->ret = parse(input, &frames);
+	input->msg_len = binp_error_msg_len();
+	if (input->msg_len > sizeof(input->msg)) panic("Error message too long\n");
+	memcpy(input->msg, binp_error_msg(), input->msg_len);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	size_t threads = DEFAULT_THREADS;
+	size_t rounds = DEFAULT_ROUNDS;
+	if (argc > 1) threads = strtoul(argv[1], NULL, 10);
+	if (argc > 2) rounds = strtoul(argv[2], NULL, 10);
+	if (threads < 2) {
+		fprintf(stderr, "Usage: %s [THREADS >= 2] [ROUNDS]\n", argv[0]);
+		return 1;
+	}
+
+	Input *inputs = xmalloc(sizeof(*inputs) * threads);
+	for (size_t i = 0; i < threads; ++i) {
+		gen_input(i, &inputs[i]);
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, expect_run, &inputs[i]) != 0) panic("pthread_create\n");
+		pthread_join(thread, NULL);
+
+		if (inputs[i].corrupt ? inputs[i].ret >= 0 : inputs[i].ret < 0) {
+			panic("Replay %zu: unexpected result %d\n", i, inputs[i].ret);
+		}
+		if (!inputs[i].corrupt && inputs[i].msg_len != 0) {
+			panic("Replay %zu: message set without an error\n", i);
+		}
+		for (size_t j = 0; j < i; ++j) {
+			if (inputs[i].corrupt && inputs[j].corrupt && inputs[i].msg_len == inputs[j].msg_len
+			    && memcmp(inputs[i].msg, inputs[j].msg, inputs[i].msg_len) == 0) {
+				panic("Replays %zu and %zu fail with the same message\n", j, i);
+			}
+		}
+	}
+
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, (unsigned) threads);
+	Worker *workers = xmalloc(sizeof(*workers) * threads);
+	for (size_t i = 0; i < threads; ++i) {
+		workers[i] = (Worker) {
+			.barrier = &barrier,
+			.input = &inputs[i],
+			.rounds = rounds,
+		};
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+			panic("pthread_create\n");
+		}
+	}
+
+	size_t failures = 0;
+	for (size_t i = 0; i < threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		failures += workers[i].failures;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	printf("%zu threads, %zu rounds: %zu mismatches\n", threads, rounds, failures);
+
+	for (size_t i = 0; i < threads; ++i) free(inputs[i].file.items);
+	free(inputs);
+	free(workers);
+	return failures == 0 ? 0 : 1;
+}
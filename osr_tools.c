@@ -2,16 +2,44 @@
  * Example program using the osr parser.
  */
 
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "xutils.h"
 #include "osr_parser.h"
 #include "binary_parser.h"
 #include "mods.h"
 #include "stream.h"
+#include "string_builder.h"
+
+#define QARRAY_MALLOC xmalloc
+#define QARRAY_REALLOC xrealloc
+
+#include "qarray.h"
+
+typedef struct Options {
+	bool csv;
+	bool export_cache;
+	bool mods;
+	bool username;
+	bool hash;
+	bool beatmap_hash;
+	bool count_300;
+	bool count_100;
+	bool count_50;
+	bool count_miss;
+	bool score;
+	bool max_combo;
+} Options;
 
 static int read_file(void *ctx, size_t size, void *buf)
 {
@@ -25,6 +53,24 @@ static int read_file(void *ctx, size_t size, void *buf)
 	}
 }
 
+static int read_file_some(void *ctx, size_t size, void *buf, size_t *num_read)
+{
+	FILE *f = ctx;
+	*num_read = fread(buf, 1, size, f);
+	if (*num_read == 0 && ferror(f)) return -1;
+	return 0;
+}
+
+static int skip_file(void *ctx, size_t size)
+{
+	FILE *f = ctx;
+	if (fseek(f, (long) size, SEEK_CUR) == 0) {
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
 static int write_file(void *ctx, size_t size, const void *buf)
 {
 	FILE *f = ctx;
@@ -35,11 +81,392 @@ static int write_file(void *ctx, size_t size, const void *buf)
 	}
 }
 
+static int write_string_builder(void *ctx, size_t size, const void *buf)
+{
+	string_builder_push_str(ctx, (Str) { .items = (char *) buf, .len = size });
+	return 0;
+}
+
+static void out_printf(StreamWriter *writer, const char *fmt, ...)
+{
+	char buf[1024 * 4];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0) return;
+	if ((size_t) len >= sizeof(buf)) len = sizeof(buf) - 1;
+	writer->write_n(writer->ctx, (size_t) len, buf);
+}
+
+static void out_puts(StreamWriter *writer, const char *label, const char *s, size_t len)
+{
+	writer->write_n(writer->ctx, strlen(label), label);
+	writer->write_n(writer->ctx, len, s);
+	writer->write_n(writer->ctx, 1, "\n");
+}
+
+static bool has_osr_ext(const char *name)
+{
+	size_t len = strlen(name);
+	return len >= 4 && strcmp(&name[len - 4], ".osr") == 0;
+}
+
+/* `foo.osr` (or any `foo.ext`) is cached as `foo.osrc` */
+static char *cache_path(const char *fname)
+{
+	const char *base = strrchr(fname, '/');
+	base = base ? base + 1 : fname;
+	const char *ext = strrchr(base, '.');
+	size_t len = ext && ext != base ? (size_t) (ext - fname) : strlen(fname);
+
+	StringBuilder sb;
+	string_builder_init(&sb);
+	string_builder_push_str(&sb, (Str) { .items = (char *) fname, .len = len });
+	string_builder_push_cstr(&sb, ".osrc");
+	return string_builder_build_cstr(&sb);
+}
+
+static int export_cache(const char *fname, const OsuReplay *replay, StreamWriter *out, StreamWriter *err)
+{
+	int ret = 0;
+	char *path = cache_path(fname);
+	/* Already a cache; rewriting it would truncate the mapped input */
+	if (strcmp(path, fname) == 0) {
+		out_printf(out, "cache: %s\n", path);
+		free(path);
+		return 0;
+	}
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		out_printf(err, "ERROR:Failed to open file:%s\n", path);
+		free(path);
+		return 1;
+	}
+	StreamWriter writer = { .ctx = f, .write_n = write_file };
+	int write_ret = osrp_write_cache(&writer, replay);
+	if (fclose(f) != 0 || write_ret < 0) {
+		out_printf(err, "ERROR:Could not write cache:%s\n", path);
+		ret = 1;
+	} else {
+		out_printf(out, "cache: %s\n", path);
+	}
+	free(path);
+	return ret;
+}
+
+/*
+ * Parses `fname` and writes the fields selected by `opts` to `out`, and
+ * any error to `err`.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+static int process_file(OsrpContext *ctx, const char *fname, const Options *opts, StreamWriter *out, StreamWriter *err)
+{
+	int ret = 0;
+	FILE *f = NULL;
+	char *read_buf = NULL;
+	StreamReader file_reader;
+	BufferedReader buffered;
+	StreamReader *reader;
+	/* Prefer mapping the file so nothing is copied out of it; fall back to
+	 * buffered reads for pipes and other unmappable files
+	 */
+	MappedFile mapped = {0};
+	if (mapped_file_open(&mapped, fname) == 0) {
+		reader = &mapped.reader;
+	} else {
+		f = fopen(fname, "rb");
+		if (!f) {
+			out_printf(err, "ERROR:Failed to open file:%s\n", fname);
+			return 1;
+		}
+		static const size_t read_buf_cap = 1024 * 64;
+		read_buf = xmalloc(read_buf_cap);
+		/* Outlives this block, `buffered` keeps pointing at it */
+		file_reader = (StreamReader) {
+			.ctx = f,
+			.read_n = read_file,
+			.skip_n = skip_file,
+			.read_some = read_file_some,
+		};
+		buffered_reader_init(&buffered, &file_reader, read_buf, read_buf_cap);
+		reader = &buffered.reader;
+	}
+
+	OsuReplay replay = {0};
+	/* Caches are recognized when mapped; `.osr` files never start with
+	 * the magic since their first byte is the mode
+	 */
+	bool is_cache = reader == &mapped.reader && mapped.data.len >= 4
+		&& memcmp(mapped.data.items, OSRP_CACHE_MAGIC, 4) == 0;
+	/* Only decompress frames when they are needed, and stream them out
+	 * of the mapping when it stays around
+	 */
+	if (is_cache) ret = osrp_read_cache(reader, &replay);
+	else if ((opts->csv && !reader->stable) || opts->export_cache) ret = osrp_parse_osr_ctx(ctx, reader, &replay);
+	else ret = osrp_parse_osr_header_ctx(ctx, reader, &replay);
+	if (ret < 0) {
+		out_printf(err, "ERROR:Could not parse osr:%s:%s\n", fname, osrp_error_msg(ret));
+		ret = 1;
+		goto error_1;
+	}
+
+	if (opts->csv) {
+		if ((ret = osrp_replay_frame_csv(out, &replay, true)) < 0) {
+			out_printf(err, "ERROR:Could not put csv:%s\n", osrp_error_msg(ret));
+			ret = 1;
+			goto error_2;
+		}
+	}
+
+	if (opts->export_cache && export_cache(fname, &replay, out, err) != 0) {
+		ret = 1;
+		goto error_2;
+	}
+
+	if (opts->mods) out_printf(out, "mods: 0x%X\n", replay.mod_bitfield);
+	if (opts->username) out_puts(out, "username: ", replay.username.items, replay.username.len);
+	if (opts->hash) out_puts(out, "hash: ", replay.md5hash, sizeof(replay.md5hash));
+	if (opts->beatmap_hash) out_puts(out, "beatmap hash: ", replay.beatmap_hash, sizeof(replay.beatmap_hash));
+	if (opts->count_300) out_printf(out, "300s: %u\n", replay.count300);
+	if (opts->count_100) out_printf(out, "100s: %u\n", replay.count100);
+	if (opts->count_50) out_printf(out, "50s: %u\n", replay.count50);
+	if (opts->count_miss) out_printf(out, "misses: %u\n", replay.count_miss);
+	if (opts->score) out_printf(out, "score: %u\n", replay.total_score);
+	if (opts->max_combo) out_printf(out, "max combo: %u\n", replay.max_combo);
+
+error_2:
+	osrp_replay_destroy(&replay);
+
+error_1:
+	mapped_file_close(&mapped);
+	if (f) fclose(f);
+	free(read_buf);
+	return ret;
+}
+
+/*
+ * Batch mode
+ *
+ * Workers claim file indices in input order from a shared counter, and the
+ * main thread prints each result in the same order once it is ready.
+ * Finished results wait for the ones ahead of them, so a slow file only
+ * stops claims once `BATCH_MAX_BUFFERED` bytes of output (or
+ * `BATCH_MAX_PENDING` files) pile up behind it; memory stays bounded
+ * whatever the number of files.
+ */
+#define BATCH_MAX_PENDING 4096
+#define BATCH_MAX_BUFFERED ((size_t) 64 << 20)
+
+typedef struct BatchResult {
+	StringBuilder out;
+	StringBuilder err;
+	int status;
+	bool done;
+} BatchResult;
+
+typedef struct Batch {
+	char **paths;
+	size_t len;
+	const Options *opts;
+
+	/* Results in flight, file `i` in `results[i % window]` */
+	BatchResult *results;
+	size_t window;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Next file to claim, and number of files printed */
+	size_t next;
+	size_t printed;
+	/* Output of finished files waiting to be printed */
+	size_t buffered;
+} Batch;
+
+static bool take_next(Batch *batch, size_t *idx)
+{
+	bool ok = false;
+	pthread_mutex_lock(&batch->lock);
+	/* The next file to print is always claimable, so printing never waits
+	 * on a file nobody has taken
+	 */
+	while (batch->next < batch->len && batch->next > batch->printed &&
+	       (batch->next >= batch->printed + batch->window || batch->buffered >= BATCH_MAX_BUFFERED)) {
+		pthread_cond_wait(&batch->cond, &batch->lock);
+	}
+	if (batch->next < batch->len) {
+		*idx = batch->next++;
+		ok = true;
+	}
+	pthread_mutex_unlock(&batch->lock);
+	return ok;
+}
+
+static void *batch_worker(void *arg)
+{
+	Batch *batch = arg;
+	/* Decoder buffers are reused for every file this worker handles */
+	OsrpContext ctx = {0};
+	size_t idx;
+	while (take_next(batch, &idx)) {
+		BatchResult *result = &batch->results[idx % batch->window];
+		string_builder_init(&result->out);
+		string_builder_init(&result->err);
+		StreamWriter out = { .ctx = &result->out, .write_n = write_string_builder };
+		StreamWriter err = { .ctx = &result->err, .write_n = write_string_builder };
+		out_printf(&out, "file: %s\n", batch->paths[idx]);
+		result->status = process_file(&ctx, batch->paths[idx], batch->opts, &out, &err);
+
+		pthread_mutex_lock(&batch->lock);
+		result->done = true;
+		batch->buffered += result->out.len + result->err.len;
+		pthread_cond_broadcast(&batch->cond);
+		pthread_mutex_unlock(&batch->lock);
+	}
+	osrp_context_destroy(&ctx);
+	return NULL;
+}
+
+static int run_batch(char **paths, size_t len, const Options *opts, size_t num_workers)
+{
+	int ret = 0;
+	if (num_workers > len) num_workers = len;
+	if (num_workers == 0) num_workers = 1;
+
+	Batch batch = {
+		.paths = paths,
+		.len = len,
+		.opts = opts,
+		.window = len < BATCH_MAX_PENDING ? (len ? len : 1) : BATCH_MAX_PENDING,
+	};
+	batch.results = xmalloc(sizeof(*batch.results) * batch.window);
+	memset(batch.results, 0, sizeof(*batch.results) * batch.window);
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+
+	pthread_t *threads = xmalloc(sizeof(*threads) * num_workers);
+	for (size_t i = 0; i < num_workers; ++i) {
+		if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0) {
+			panic("Could not spawn worker thread\n");
+		}
+	}
+
+	/* Keeps draining results after a failed write so the workers finish */
+	bool write_failed = false;
+	for (size_t i = 0; i < len; ++i) {
+		BatchResult *result = &batch.results[i % batch.window];
+		pthread_mutex_lock(&batch.lock);
+		while (!result->done) pthread_cond_wait(&batch.cond, &batch.lock);
+		pthread_mutex_unlock(&batch.lock);
+
+		if (!write_failed && fwrite(result->out.items, 1, result->out.len, stdout) != result->out.len) {
+			write_failed = true;
+		}
+		fwrite(result->err.items, 1, result->err.len, stderr);
+		if (result->status) ret = 1;
+		size_t size = result->out.len + result->err.len;
+		string_builder_free(&result->out);
+		string_builder_free(&result->err);
+
+		pthread_mutex_lock(&batch.lock);
+		result->done = false;
+		batch.buffered -= size;
+		batch.printed = i + 1;
+		pthread_cond_broadcast(&batch.cond);
+		pthread_mutex_unlock(&batch.lock);
+	}
+	if (fflush(stdout) != 0 || write_failed) {
+		eprintf("ERROR:Could not write output\n");
+		ret = 1;
+	}
+
+	for (size_t i = 0; i < num_workers; ++i) pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+	free(threads);
+	free(batch.results);
+	return ret;
+}
+
+static void collect_dir(const char *dir, char ***paths, size_t *len, size_t *cap)
+{
+	DIR *d = opendir(dir);
+	if (!d) {
+		eprintf("ERROR:Failed to open directory:%s\n", dir);
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		const char *name = entry->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+		StringBuilder sb;
+		string_builder_init(&sb);
+		string_builder_push_cstr(&sb, (char *) dir);
+		string_builder_push(&sb, '/');
+		string_builder_push_cstr(&sb, (char *) name);
+		char *path = string_builder_build_cstr(&sb);
+
+		bool is_dir = entry->d_type == DT_DIR;
+		bool is_file = entry->d_type == DT_REG;
+		bool is_link = entry->d_type == DT_LNK;
+		struct stat st;
+		if (entry->d_type == DT_UNKNOWN && lstat(path, &st) == 0) {
+			is_dir = S_ISDIR(st.st_mode);
+			is_file = S_ISREG(st.st_mode);
+			is_link = S_ISLNK(st.st_mode);
+		}
+		/* Linked replays are read, but linked directories aren't walked
+		 * since they can lead back up the tree
+		 */
+		if (is_link && stat(path, &st) == 0) is_file = S_ISREG(st.st_mode);
+
+		if (is_dir) {
+			collect_dir(path, paths, len, cap);
+			free(path);
+		} else if (is_file && has_osr_ext(name)) {
+			qa_push(paths, len, cap, path);
+		} else {
+			free(path);
+		}
+	}
+	closedir(d);
+}
+
+static void collect_stdin(char ***paths, size_t *len, size_t *cap)
+{
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t n;
+	while ((n = getline(&line, &line_cap, stdin)) >= 0) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+		if (n == 0) continue;
+		char *path = xmalloc((size_t) n + 1);
+		memcpy(path, line, (size_t) n + 1);
+		qa_push(paths, len, cap, path);
+	}
+	free(line);
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
 static const char *help =
 	"Usage: osr_tools <FILE> [OPTION]\n"
+	"       osr_tools --batch <DIR|-> [OPTION]\n"
+	"\n"
+	"With --batch, every .osr file under DIR (or each path read from stdin\n"
+	"when given -) is parsed, and results are printed in sorted (or input)\n"
+	"order.\n"
 	"\n"
 	"Options:\n"
 	"  --csv                   Outputs csv-formatted frames to stdout\n"
+	"  --export-cache          Writes the decoded replay next to FILE as .osrc,\n"
+	"                          which is read back much faster than the .osr\n"
 	"  --mods                  Show mods used\n"
 	"  --username              Show username\n"
 	"  --hash                  Show replay md5hash\n"
@@ -49,7 +476,8 @@ static const char *help =
 	"  --count-50              Show 50 count\n"
 	"  --count-miss            Show miss count\n"
 	"  --score                 Show score\n"
-	"  --max-combo             Show max combo\n";
+	"  --max-combo             Show max combo\n"
+	"  --jobs <N>              Worker threads for --batch (default: all cores)\n";
 
 int main(int argc, char **argv)
 {
@@ -61,94 +489,81 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	char *fname = argv[1];
-	FILE *f = fopen(fname, "rb");
-	if (!f) {
-		eprintf("ERROR:Failed to open file:%s\n", fname);
+	bool batch = strcmp(argv[1], "--batch") == 0;
+	size_t first_opt = batch ? 3 : 2;
+	if (batch && argc < 4) {
+		eprintf("Missing arguments...\n");
+		eprintf(help);
 		exit(1);
 	}
+	char *fname = batch ? argv[2] : argv[1];
 
-	bool csv_opt = false;
-	bool mods_opt = false;
-	bool username_opt = false;
-	bool hash_opt = false;
-	bool beatmap_hash_opt = false;
-	bool count_300_opt = false;
-	bool count_100_opt = false;
-	bool count_50_opt = false;
-	bool count_miss_opt = false;
-	bool score_opt = false;
-	bool max_combo_opt = false;
-	for (size_t i = 2; i < (size_t) argc; ++i) {
+	Options opts = {0};
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	bool jobs_given = false;
+	for (size_t i = first_opt; i < (size_t) argc; ++i) {
 		const char *arg = argv[i];
-		if (strcmp(arg, "--csv") == 0) csv_opt = true;
-		else if (strcmp(arg, "--mods") == 0) mods_opt = true;
-		else if (strcmp(arg, "--username") == 0) username_opt = true;
-		else if (strcmp(arg, "--hash") == 0) hash_opt = true;
-		else if (strcmp(arg, "--beatmap-hash") == 0) beatmap_hash_opt = true;
-		else if (strcmp(arg, "--count-300") == 0) count_300_opt = true;
-		else if (strcmp(arg, "--count-100") == 0) count_100_opt = true;
-		else if (strcmp(arg, "--count-50") == 0) count_50_opt = true;
-		else if (strcmp(arg, "--count-miss") == 0) count_miss_opt = true;
-		else if (strcmp(arg, "--score") == 0) score_opt = true;
-		else if (strcmp(arg, "--max-combo") == 0) max_combo_opt = true;
-		else {
+		if (strcmp(arg, "--csv") == 0) opts.csv = true;
+		else if (strcmp(arg, "--export-cache") == 0) opts.export_cache = true;
+		else if (strcmp(arg, "--mods") == 0) opts.mods = true;
+		else if (strcmp(arg, "--username") == 0) opts.username = true;
+		else if (strcmp(arg, "--hash") == 0) opts.hash = true;
+		else if (strcmp(arg, "--beatmap-hash") == 0) opts.beatmap_hash = true;
+		else if (strcmp(arg, "--count-300") == 0) opts.count_300 = true;
+		else if (strcmp(arg, "--count-100") == 0) opts.count_100 = true;
+		else if (strcmp(arg, "--count-50") == 0) opts.count_50 = true;
+		else if (strcmp(arg, "--count-miss") == 0) opts.count_miss = true;
+		else if (strcmp(arg, "--score") == 0) opts.score = true;
+		else if (strcmp(arg, "--max-combo") == 0) opts.max_combo = true;
+		else if (strcmp(arg, "--jobs") == 0 && i + 1 < (size_t) argc) {
+			char *end;
+			jobs = strtol(argv[++i], &end, 10);
+			jobs_given = true;
+			if (*end != '\0' || jobs <= 0) {
+				eprintf("ERROR:Bad job count:%s\n", argv[i]);
+				exit(1);
+			}
+		} else {
 			eprintf("ERROR:Unknown flag:%s\n", arg);
 			eprintf(help);
-			goto error_1;
+			exit(1);
 		}
 	}
 
-	StreamReader reader = {
-		.ctx = f,
-		.read_n = read_file,
-	};
-	StreamWriter writer = {
-		.ctx = stdout,
-		.write_n = write_file,
-	};
-	OsuReplay replay = {0};
-	if ((ret = osrp_parse_osr(&reader, &replay)) < 0) {
-		eprintf("ERROR:Could not parse osr:%s:%s\n", fname, osrp_error_msg(ret));
-		ret = 1;
-		goto error_1;
+	if (!batch && jobs_given) {
+		eprintf("ERROR:--jobs only applies to --batch\n");
+		eprintf(help);
+		exit(1);
 	}
 
-	if (csv_opt) {
-		if ((ret = osrp_replay_frame_csv(&writer, &replay, true)) < 0) {
-			eprintf("ERROR:Could not put csv:%s\n", osrp_error_msg(ret));
-			goto error_2;
+	if (!batch) {
+		StreamWriter out = { .ctx = stdout, .write_n = write_file };
+		StreamWriter err = { .ctx = stderr, .write_n = write_file };
+		OsrpContext ctx = {0};
+		int ret = process_file(&ctx, fname, &opts, &out, &err);
+		osrp_context_destroy(&ctx);
+		/* Failed writes stick to the stream, whichever field they were in */
+		if (fflush(stdout) != 0 || ferror(stdout)) {
+			eprintf("ERROR:Could not write output\n");
+			ret = 1;
 		}
+		return ret;
 	}
 
-	if (mods_opt) printf("mods: 0x%X\n", replay.mod_bitfield);
-	if (username_opt) {
-		fputs("username: ", stdout);
-		fwrite(replay.username.items, 1, replay.username.len, stdout);
-		putc('\n', stdout);
-	}
-	if (hash_opt) {
-		fputs("hash: ", stdout);
-		fwrite(replay.md5hash, 1, sizeof(replay.md5hash), stdout);
-		putc('\n', stdout);
-	}
-	if (beatmap_hash_opt) {
-		fputs("beatmap hash: ", stdout);
-		fwrite(replay.beatmap_hash, 1, sizeof(replay.beatmap_hash), stdout);
-		putc('\n', stdout);
+	char **paths = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+	if (strcmp(fname, "-") == 0) {
+		collect_stdin(&paths, &len, &cap);
+	} else {
+		collect_dir(fname, &paths, &len, &cap);
+		qsort(paths, len, sizeof(*paths), cmp_path);
 	}
-	if (count_300_opt) printf("300s: %u\n", replay.count300);
-	if (count_100_opt) printf("100s: %u\n", replay.count100);
-	if (count_50_opt) printf("50s: %u\n", replay.count50);
-	if (count_miss_opt) printf("misses: %u\n", replay.count_miss);
-	if (score_opt) printf("score: %u\n", replay.total_score);
-	if (max_combo_opt) printf("max combo: %u\n", replay.max_combo);
 
-error_2:
-	osrp_replay_destroy(&replay);
+	ret = run_batch(paths, len, &opts, jobs > 0 ? (size_t) jobs : 1);
 
-error_1:
-	fclose(f);
+	for (size_t i = 0; i < len; ++i) free(paths[i]);
+	free(paths);
 	return ret;
 #endif
 }
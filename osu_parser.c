@@ -0,0 +1,477 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osu_parser.h"
+#include "xutils.h"
+#include "delim_scan.h"
+#include "decimal.h"
+
+#define QARRAY_MALLOC xmalloc
+#define QARRAY_REALLOC xrealloc
+
+#include "qarray.h"
+
+/* Read size when pulling a file out of a reader that can't lend it */
+#define READ_CHUNK_SIZE (1024 * 64)
+
+static const char *section_names[OSUP_SECTION_COUNT] = {
+	[OSUP_SECTION_GENERAL] = "General",
+	[OSUP_SECTION_EDITOR] = "Editor",
+	[OSUP_SECTION_METADATA] = "Metadata",
+	[OSUP_SECTION_DIFFICULTY] = "Difficulty",
+	[OSUP_SECTION_EVENTS] = "Events",
+	[OSUP_SECTION_TIMING_POINTS] = "TimingPoints",
+	[OSUP_SECTION_COLOURS] = "Colours",
+	[OSUP_SECTION_HIT_OBJECTS] = "HitObjects",
+};
+
+const char *osup_error_msg(int error_code)
+{
+	switch (-error_code) {
+	case EOSU_DAMAGED_FILE:
+		return "Potentially damaged or corrupt file";
+		break;
+	case EOSU_UNKNOWN_FILE:
+		return "Unknown file";
+		break;
+	default:
+		return "Bad osu error code";
+	}
+}
+
+const char *osup_section_name(int section)
+{
+	if (section < 0 || section >= OSUP_SECTION_COUNT) return NULL;
+	return section_names[section];
+}
+
+static inline bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static Str trim(const char *begin, const char *end)
+{
+	while (begin < end && is_space(*begin)) ++begin;
+	while (end > begin && is_space(end[-1])) --end;
+	return (Str) { .items = (char *) begin, .len = (size_t) (end - begin) };
+}
+
+/*
+ * Sets `line` to the next line in [*p, end) with surrounding whitespace
+ * trimmed, skipping blank lines and `//` comments. Returns false at the end.
+ */
+static bool next_line(const char **p, const char *end, Str *line)
+{
+	while (*p < end) {
+		const char *nl = memchr(*p, '\n', (size_t) (end - *p));
+		const char *line_end = nl ? nl : end;
+		*line = trim(*p, line_end);
+		*p = nl ? nl + 1 : end;
+		if (line->len == 0) continue;
+		if (line->len >= 2 && line->items[0] == '/' && line->items[1] == '/') continue;
+		return true;
+	}
+	return false;
+}
+
+/* Copies everything left in `reader` into `out` */
+static int read_all(StreamReader *reader, ByteArray *out)
+{
+	if (reader->buf_len > 0) {
+		string_builder_push_str(out, (Str) { .items = (char *) reader->buf, .len = reader->buf_len });
+		stream_skip(reader, reader->buf_len);
+	}
+	if (!reader->read_some) return -EOSU_UNKNOWN_FILE;
+
+	while (1) {
+		/* Doubles, reserving alone would grow by one chunk at a time */
+		if (out->cap - out->len < READ_CHUNK_SIZE) {
+			string_builder_reserve(out, out->cap > READ_CHUNK_SIZE ? out->cap : READ_CHUNK_SIZE);
+		}
+		size_t num_read;
+		if (reader->read_some(reader->ctx, out->cap - out->len, &out->items[out->len], &num_read) < 0) {
+			return -EOSU_DAMAGED_FILE;
+		}
+		if (num_read == 0) break;
+		out->len += num_read;
+		reader->pos += num_read;
+	}
+	return 0;
+}
+
+static int section_index(Str name)
+{
+	for (int i = 0; i < OSUP_SECTION_COUNT; ++i) {
+		size_t len = strlen(section_names[i]);
+		if (name.len == len && memcmp(name.items, section_names[i], len) == 0) return i;
+	}
+	return -1;
+}
+
+/* https://github.com/ppy/osu/blob/8bbbedaec3a1af9a255a32e3f186cfebd25d6783/osu.Game/Beatmaps/Formats/Decoder.cs */
+static int parse_header(OsuBeatmap *out, const char **p, const char *end)
+{
+	static const char bom[] = "\xEF\xBB\xBF";
+	static const char magic[] = "osu file format v";
+	if ((size_t) (end - *p) >= sizeof(bom) - 1 && memcmp(*p, bom, sizeof(bom) - 1) == 0) {
+		*p += sizeof(bom) - 1;
+	}
+
+	Str line;
+	if (!next_line(p, end, &line)) return -EOSU_UNKNOWN_FILE;
+	if (line.len < sizeof(magic) - 1 || memcmp(line.items, magic, sizeof(magic) - 1) != 0) {
+		return -EOSU_UNKNOWN_FILE;
+	}
+	int64_t version;
+	const char *digits = &line.items[sizeof(magic) - 1];
+	if (dec_parse_i64(digits, &line.items[line.len], &version) == 0) return -EOSU_UNKNOWN_FILE;
+	out->format_version = (int32_t) version;
+	return 0;
+}
+
+/*
+ * One pass over the lines, noting where each section starts and ends.
+ * Only the first byte of each line is looked at, so skipping a section
+ * is a `memchr` per line.
+ */
+static void index_sections(OsuBeatmap *out, const char *p, const char *end)
+{
+	int current = -1;
+	const char *body = NULL;
+	while (p < end) {
+		const char *nl = memchr(p, '\n', (size_t) (end - p));
+		const char *line_end = nl ? nl : end;
+		if (*p == '[') {
+			const char *close = memchr(p, ']', (size_t) (line_end - p));
+			if (close) {
+				if (current >= 0 && !out->sections[current].items) {
+					out->sections[current] = (Str) { .items = (char *) body, .len = (size_t) (p - body) };
+				}
+				current = section_index((Str) { .items = (char *) p + 1, .len = (size_t) (close - p - 1) });
+				body = nl ? nl + 1 : end;
+			}
+		}
+		p = nl ? nl + 1 : end;
+	}
+	/* Repeated sections keep the first */
+	if (current >= 0 && !out->sections[current].items) {
+		out->sections[current] = (Str) { .items = (char *) body, .len = (size_t) (end - body) };
+	}
+}
+
+int osup_parse_osu(StreamReader *reader, OsuBeatmap *out)
+{
+	*out = (OsuBeatmap) {0};
+	if (reader->stable) {
+		out->data.len = reader->buf_len;
+		out->data.items = (char *) stream_borrow(reader, reader->buf_len);
+	} else {
+		ByteArray data = {0};
+		int ret = read_all(reader, &data);
+		if (ret < 0) {
+			if (data.items) string_builder_free(&data);
+			return ret;
+		}
+		out->data = string_builder_build(&data);
+		out->owned = true;
+	}
+
+	const char *p = out->data.items;
+	const char *end = p + out->data.len;
+	int ret = parse_header(out, &p, end);
+	if (ret < 0) {
+		osup_beatmap_destroy(out);
+		return ret;
+	}
+	index_sections(out, p, end);
+	return 0;
+}
+
+int osup_find_value(const OsuBeatmap *beatmap, int section, const char *key, Str *out)
+{
+	if (section < 0 || section >= OSUP_SECTION_COUNT) return 1;
+	const Str *body = &beatmap->sections[section];
+	const char *p = body->items;
+	const char *end = p + body->len;
+	size_t key_len = strlen(key);
+
+	Str line;
+	while (next_line(&p, end, &line)) {
+		const char *colon = memchr(line.items, ':', line.len);
+		if (!colon) continue;
+		Str name = trim(line.items, colon);
+		if (name.len != key_len || memcmp(name.items, key, key_len) != 0) continue;
+		*out = trim(colon + 1, &line.items[line.len]);
+		return 0;
+	}
+	return 1;
+}
+
+int osup_find_f64(const OsuBeatmap *beatmap, int section, const char *key, double *out)
+{
+	Str value;
+	int ret = osup_find_value(beatmap, section, key, &value);
+	if (ret != 0) return ret;
+	if (dec_parse_f64(value.items, &value.items[value.len], out) == 0) return -EOSU_DAMAGED_FILE;
+	return 0;
+}
+
+int osup_find_i64(const OsuBeatmap *beatmap, int section, const char *key, int64_t *out)
+{
+	Str value;
+	int ret = osup_find_value(beatmap, section, key, &value);
+	if (ret != 0) return ret;
+	if (dec_parse_i64(value.items, &value.items[value.len], out) == 0) return -EOSU_DAMAGED_FILE;
+	return 0;
+}
+
+/* https://github.com/ppy/osu/blob/8bbbedaec3a1af9a255a32e3f186cfebd25d6783/osu.Game/Beatmaps/Formats/LegacyBeatmapDecoder.cs#L336 */
+int osup_parse_difficulty(const OsuBeatmap *beatmap, OsuDifficulty *out)
+{
+	static const struct {
+		const char *key;
+		double fallback;
+	} settings[] = {
+		{ "HPDrainRate", 5.0 },
+		{ "CircleSize", 5.0 },
+		{ "OverallDifficulty", 5.0 },
+		{ "ApproachRate", -1.0 },
+		{ "SliderMultiplier", 1.4 },
+		{ "SliderTickRate", 1.0 },
+	};
+	double values[sizeof(settings) / sizeof(*settings)];
+	for (size_t i = 0; i < sizeof(settings) / sizeof(*settings); ++i) {
+		int ret = osup_find_f64(beatmap, OSUP_SECTION_DIFFICULTY, settings[i].key, &values[i]);
+		if (ret < 0) return ret;
+		if (ret == 1) values[i] = settings[i].fallback;
+	}
+
+	out->hp_drain_rate = (float) values[0];
+	out->circle_size = (float) values[1];
+	out->overall_difficulty = (float) values[2];
+	/* Maps before ApproachRate was split out use OD for it */
+	out->approach_rate = values[3] < 0.0 ? out->overall_difficulty : (float) values[3];
+	out->slider_multiplier = values[4];
+	out->slider_tick_rate = values[5];
+	return 0;
+}
+
+/*
+ * Splits `line` at ',' into at most `max` fields; returns how many there
+ * were (which can be more than `max`)
+ */
+static size_t split_fields(Str line, Str *fields, size_t max)
+{
+	const char *p = line.items;
+	const char *end = p + line.len;
+	size_t n = 0;
+	while (1) {
+		const char *comma = memchr(p, ',', (size_t) (end - p));
+		const char *field_end = comma ? comma : end;
+		if (n < max) fields[n] = (Str) { .items = (char *) p, .len = (size_t) (field_end - p) };
+		++n;
+		if (!comma) break;
+		p = comma + 1;
+	}
+	return n;
+}
+
+static inline double field_f64(Str field)
+{
+	double d;
+	dec_parse_f64(field.items, &field.items[field.len], &d);
+	return d;
+}
+
+static inline float field_f32(Str field)
+{
+	return (float) field_f64(field);
+}
+
+static inline int32_t field_i32(Str field)
+{
+	int64_t i;
+	dec_parse_i64(field.items, &field.items[field.len], &i);
+	return (int32_t) i;
+}
+
+/* https://github.com/ppy/osu/blob/8bbbedaec3a1af9a255a32e3f186cfebd25d6783/osu.Game/Beatmaps/Formats/LegacyBeatmapDecoder.cs#L378 */
+int osup_parse_timing_points(const OsuBeatmap *beatmap, OsuTimingPoints *out)
+{
+	const Str *body = &beatmap->sections[OSUP_SECTION_TIMING_POINTS];
+	const char *p = body->items;
+	const char *end = p + body->len;
+
+	OsuTimingPoint *items = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+	/* At most one point per line */
+	qa_reserve(&items, &len, &cap, ds_count(body->items, body->len, '\n') + 1);
+
+	Str line;
+	while (next_line(&p, end, &line)) {
+		Str fields[8];
+		size_t num_fields = split_fields(line, fields, 8);
+		if (num_fields < 2) {
+			free(items);
+			return -EOSU_DAMAGED_FILE;
+		}
+
+		/* Older formats stop early; the rest take these values */
+		OsuTimingPoint point = {
+			.time = field_f64(fields[0]),
+			.beat_length = field_f64(fields[1]),
+			.meter = 4,
+			.sample_set = 0,
+			.sample_index = 0,
+			.volume = 100,
+			.uninherited = true,
+			.effects = 0,
+		};
+		if (num_fields > 2) point.meter = field_i32(fields[2]);
+		if (num_fields > 3) point.sample_set = field_i32(fields[3]);
+		if (num_fields > 4) point.sample_index = field_i32(fields[4]);
+		if (num_fields > 5) point.volume = field_i32(fields[5]);
+		if (num_fields > 6) point.uninherited = field_i32(fields[6]) == 1;
+		if (num_fields > 7) point.effects = field_i32(fields[7]);
+		qa_push(&items, &len, &cap, point);
+	}
+
+	out->len = len;
+	out->items = items;
+	return 0;
+}
+
+/*
+ * Rounded so the byte columns also fill whole `OSUP_COLUMN_ALIGN` blocks and
+ * every column after them stays aligned
+ */
+static void hit_objects_alloc(OsuHitObjects *out, size_t cap)
+{
+	cap = (cap + OSUP_COLUMN_ALIGN - 1) / OSUP_COLUMN_ALIGN * OSUP_COLUMN_ALIGN;
+	if (cap == 0) cap = OSUP_COLUMN_ALIGN;
+
+	size_t wide = cap * 4;
+	char *block = xmalloc(wide * 8 + cap * 3 + OSUP_COLUMN_ALIGN - 1);
+	uintptr_t base = ((uintptr_t) block + OSUP_COLUMN_ALIGN - 1) & ~(uintptr_t) (OSUP_COLUMN_ALIGN - 1);
+	uintptr_t bytes = base + wide * 8;
+	*out = (OsuHitObjects) {
+		.cap = cap,
+		.x = (float *) base,
+		.y = (float *) (base + wide),
+		.time = (float *) (base + wide * 2),
+		.end_time = (float *) (base + wide * 3),
+		.length = (float *) (base + wide * 4),
+		.slides = (int32_t *) (base + wide * 5),
+		.curve_offset = (uint32_t *) (base + wide * 6),
+		.curve_len = (uint32_t *) (base + wide * 7),
+		.type = (uint8_t *) bytes,
+		.hitsound = (uint8_t *) (bytes + cap),
+		.curve_type = (uint8_t *) (bytes + cap * 2),
+		.block = block,
+	};
+}
+
+/* `B|x:y|x:y...`, the control points go on the end of the pool */
+static int parse_curve(OsuHitObjects *out, size_t i, Str field)
+{
+	const char *p = field.items;
+	const char *end = p + field.len;
+	if (p == end) return -EOSU_DAMAGED_FILE;
+
+	out->curve_type[i] = (uint8_t) *p;
+	out->curve_offset[i] = (uint32_t) out->curve_points_len;
+	const char *bar = memchr(p, '|', (size_t) (end - p));
+	while (bar) {
+		p = bar + 1;
+		bar = memchr(p, '|', (size_t) (end - p));
+		const char *point_end = bar ? bar : end;
+		const char *colon = memchr(p, ':', (size_t) (point_end - p));
+		if (!colon) return -EOSU_DAMAGED_FILE;
+
+		OsuCurvePoint *point = &out->curve_points[out->curve_points_len++];
+		point->x = field_f32((Str) { .items = (char *) p, .len = (size_t) (colon - p) });
+		point->y = field_f32((Str) { .items = (char *) colon + 1, .len = (size_t) (point_end - colon - 1) });
+	}
+	out->curve_len[i] = (uint32_t) (out->curve_points_len - out->curve_offset[i]);
+	return 0;
+}
+
+/* https://osu.ppy.sh/wiki/en/Client/File_formats/osu_%28file_format%29#hit-objects */
+int osup_parse_hit_objects(const OsuBeatmap *beatmap, OsuHitObjects *out)
+{
+	const Str *body = &beatmap->sections[OSUP_SECTION_HIT_OBJECTS];
+	const char *p = body->items;
+	const char *end = p + body->len;
+
+	/* At most one object per line and every control point follows a '|' */
+	hit_objects_alloc(out, ds_count(body->items, body->len, '\n') + 1);
+	out->curve_points = xmalloc(sizeof(*out->curve_points) * (ds_count(body->items, body->len, '|') + 1));
+
+	int ret;
+	Str line;
+	while (next_line(&p, end, &line)) {
+		Str fields[8];
+		size_t num_fields = split_fields(line, fields, 8);
+		if (num_fields < 5) {
+			ret = -EOSU_DAMAGED_FILE;
+			goto error;
+		}
+
+		size_t i = out->len;
+		int32_t type = field_i32(fields[3]);
+		out->x[i] = field_f32(fields[0]);
+		out->y[i] = field_f32(fields[1]);
+		out->time[i] = field_f32(fields[2]);
+		out->end_time[i] = out->time[i];
+		out->length[i] = 0.0f;
+		out->slides[i] = 1;
+		out->curve_offset[i] = 0;
+		out->curve_len[i] = 0;
+		out->type[i] = (uint8_t) type;
+		out->hitsound[i] = (uint8_t) field_i32(fields[4]);
+		out->curve_type[i] = 0;
+
+		if (type & OSUP_HIT_SLIDER) {
+			if (num_fields < 6) {
+				ret = -EOSU_DAMAGED_FILE;
+				goto error;
+			}
+			ret = parse_curve(out, i, fields[5]);
+			if (ret < 0) goto error;
+			if (num_fields > 6) out->slides[i] = field_i32(fields[6]);
+			if (num_fields > 7) out->length[i] = field_f32(fields[7]);
+		} else if ((type & (OSUP_HIT_SPINNER | OSUP_HIT_HOLD)) && num_fields > 5) {
+			/* Holds write `endTime:hitSample`, parsing stops at the ':' */
+			out->end_time[i] = field_f32(fields[5]);
+		}
+		++out->len;
+	}
+	return 0;
+
+error:
+	osup_hit_objects_destroy(out);
+	return ret;
+}
+
+void osup_timing_points_destroy(OsuTimingPoints *timing_points)
+{
+	free(timing_points->items);
+	timing_points->items = NULL;
+	timing_points->len = 0;
+}
+
+void osup_hit_objects_destroy(OsuHitObjects *hit_objects)
+{
+	free(hit_objects->block);
+	free(hit_objects->curve_points);
+	*hit_objects = (OsuHitObjects) {0};
+}
+
+void osup_beatmap_destroy(OsuBeatmap *beatmap)
+{
+	if (beatmap->owned) free(beatmap->data.items);
+	*beatmap = (OsuBeatmap) {0};
+}
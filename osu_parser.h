@@ -0,0 +1,165 @@
+#ifndef OSU_PARSER_H
+#define OSU_PARSER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "string_builder.h"
+#include "stream.h"
+
+enum {
+	EOSU_DAMAGED_FILE = 1, /* Headers valid; bad data */
+	EOSU_UNKNOWN_FILE,     /* Headers invalid */
+};
+
+enum {
+	OSUP_SECTION_GENERAL = 0,
+	OSUP_SECTION_EDITOR,
+	OSUP_SECTION_METADATA,
+	OSUP_SECTION_DIFFICULTY,
+	OSUP_SECTION_EVENTS,
+	OSUP_SECTION_TIMING_POINTS,
+	OSUP_SECTION_COLOURS,
+	OSUP_SECTION_HIT_OBJECTS,
+	OSUP_SECTION_COUNT,
+};
+
+/*
+ * A .osu file with the location of each section. Nothing inside a section
+ * is decoded until asked for, so a storyboard in `[Events]` costs no more
+ * than the scan for the next header.
+ *
+ * Release with `osup_beatmap_destroy`.
+ */
+typedef struct OsuBeatmap {
+	int32_t format_version; /* From `osu file format vN`, 0 when missing */
+
+	/* The whole file; borrowed from `stable` readers, owned otherwise */
+	Str data;
+	bool owned;
+
+	/* Body of each section, between its header line and the next one.
+	 * Empty (NULL `items`) when the section is missing.
+	 */
+	Str sections[OSUP_SECTION_COUNT];
+} OsuBeatmap;
+
+typedef struct OsuDifficulty {
+	float hp_drain_rate;
+	float circle_size;
+	float overall_difficulty;
+	float approach_rate; /* NOTE: Same as `overall_difficulty` in old maps */
+	double slider_multiplier;
+	double slider_tick_rate;
+} OsuDifficulty;
+
+typedef struct OsuTimingPoint {
+	double time;
+	/* Milliseconds per beat for uninherited points, otherwise a negative
+	 * inverse slider velocity percentage
+	 */
+	double beat_length;
+	int32_t meter;
+	int32_t sample_set;
+	int32_t sample_index;
+	int32_t volume;
+	bool uninherited;
+	int32_t effects;
+} OsuTimingPoint;
+
+typedef struct OsuTimingPoints {
+	size_t len;
+	OsuTimingPoint *items;
+} OsuTimingPoints;
+
+/* Bits of `OsuHitObjects.type`; bits 4-6 are the combo colour skip */
+enum {
+	OSUP_HIT_CIRCLE = 1 << 0,
+	OSUP_HIT_SLIDER = 1 << 1,
+	OSUP_HIT_NEW_COMBO = 1 << 2,
+	OSUP_HIT_SPINNER = 1 << 3,
+	OSUP_HIT_HOLD = 1 << 7, /* osu!mania */
+};
+
+typedef struct OsuCurvePoint {
+	float x;
+	float y;
+} OsuCurvePoint;
+
+/* Alignment of every column in `OsuHitObjects` */
+#define OSUP_COLUMN_ALIGN 32
+
+/*
+ * [HitObjects] as parallel columns, one element per object.
+ *
+ * Slider control points of every object live in `curve_points`; object i
+ * owns `curve_len[i]` of them starting at `curve_offset[i]` (0 and 0 for
+ * anything but sliders).
+ *
+ * Columns share `block` and start on `OSUP_COLUMN_ALIGN` byte boundaries
+ * like `ReplayFrameColumns`. Release with `osup_hit_objects_destroy`.
+ */
+typedef struct OsuHitObjects {
+	size_t len;
+	size_t cap;
+	float *x;
+	float *y;
+	float *time;
+	float *end_time; /* Spinners and holds; same as `time` otherwise */
+	float *length;   /* Slider length in osu!pixels, 0 when not given */
+	int32_t *slides; /* 1 when not given */
+	uint32_t *curve_offset;
+	uint32_t *curve_len;
+	uint8_t *type;
+	uint8_t *hitsound;
+	uint8_t *curve_type; /* 'B', 'C', 'L' or 'P'; 0 for non-sliders */
+	void *block;
+
+	size_t curve_points_len;
+	OsuCurvePoint *curve_points;
+} OsuHitObjects;
+
+const char *osup_error_msg(int error_code);
+
+const char *osup_section_name(int section);
+
+/*
+ * Reads the rest of `reader` and indexes its sections in one pass.
+ *
+ * Readers that aren't `stable` need `read_some`.
+ */
+int osup_parse_osu(StreamReader *reader, OsuBeatmap *out);
+
+/*
+ * Looks up `key` in a `Key: Value` section ([General], [Editor],
+ * [Metadata], [Difficulty] and [Colours]), setting `out` to its value
+ * with surrounding whitespace trimmed.
+ *
+ * Returns 0 when found, 1 otherwise. `out` points into `beatmap->data`.
+ */
+int osup_find_value(const OsuBeatmap *beatmap, int section, const char *key, Str *out);
+
+/* Same as `osup_find_value`, parsing the value as a number */
+int osup_find_f64(const OsuBeatmap *beatmap, int section, const char *key, double *out);
+
+int osup_find_i64(const OsuBeatmap *beatmap, int section, const char *key, int64_t *out);
+
+/* Missing settings get osu!'s defaults */
+int osup_parse_difficulty(const OsuBeatmap *beatmap, OsuDifficulty *out);
+
+/* Points are kept in file order */
+int osup_parse_timing_points(const OsuBeatmap *beatmap, OsuTimingPoints *out);
+
+/*
+ * Both the columns and the control point pool are sized up front from the
+ * section, so decoding allocates twice no matter how many objects there are.
+ */
+int osup_parse_hit_objects(const OsuBeatmap *beatmap, OsuHitObjects *out);
+
+void osup_timing_points_destroy(OsuTimingPoints *timing_points);
+
+void osup_hit_objects_destroy(OsuHitObjects *hit_objects);
+
+void osup_beatmap_destroy(OsuBeatmap *beatmap);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Parses small .osu fixtures, both lent by a memory reader and copied out
+ * of one that can't lend, and checks sections, values, timing points and
+ * every kind of hit object.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xutils.h"
+#include "osu_parser.h"
+#include "stream.h"
+#include "string_builder.h"
+
+/* CRLF with a BOM, comments, [General] twice and no [Difficulty] */
+static const char fixture[] =
+	"\xEF\xBB\xBF" "osu file format v14\r\n"
+	"\r\n"
+	"[General]\r\n"
+	"AudioFilename: audio.mp3\r\n"
+	"// Mode: 0\r\n"
+	"Mode: 3\r\n"
+	"\r\n"
+	"[Metadata]\r\n"
+	"Title:Fixture\r\n"
+	"Version: Hard \r\n"
+	"\r\n"
+	"[Events]\r\n"
+	"//Background and Video events\r\n"
+	"0,0,\"bg.jpg\",0,0\r\n"
+	"\r\n"
+	"[TimingPoints]\r\n"
+	"0,500,4,2,0,60,1,0\r\n"
+	"// Inherited, kiai\r\n"
+	"1000,-50,4,2,0,60,0,1\r\n"
+	"2000,400\r\n"
+	"\r\n"
+	"[General]\r\n"
+	"AudioFilename: other.mp3\r\n"
+	"\r\n"
+	"[HitObjects]\r\n"
+	"256,192,100,5,0,0:0:0:0:\r\n"
+	"// Slider\r\n"
+	"100,100,500,2,2,B|200:100|200:200|300:200,2,250.5,2|0|0,0:0|0:0|0:0,0:0:0:0:\r\n"
+	"256,192,1000,12,0,3000,0:0:0:0:\r\n"
+	"64,192,4000,128,0,4500:0:0:0:0:\r\n";
+
+/* LF only, from before ApproachRate was split out of OverallDifficulty */
+static const char old_fixture[] =
+	"osu file format v5\n"
+	"[Difficulty]\n"
+	"HPDrainRate: 6\n"
+	"OverallDifficulty:7\n";
+
+static int failures = 0;
+
+#define check(cond, ...)                       \
+	do {                                   \
+		if (!(cond)) {                 \
+			printf(__VA_ARGS__);   \
+			++failures;            \
+		}                              \
+	} while (0)
+
+static bool str_eq(Str s, const char *cstr)
+{
+	return s.len == strlen(cstr) && memcmp(s.items, cstr, s.len) == 0;
+}
+
+/* Hands out a few bytes at a time and lends nothing */
+typedef struct Trickle {
+	const char *items;
+	size_t len;
+	size_t pos;
+} Trickle;
+
+static int trickle_read_some(void *ctx, size_t size, void *buf, size_t *num_read)
+{
+	Trickle *t = ctx;
+	size_t n = t->len - t->pos;
+	if (n > 7) n = 7;
+	if (n > size) n = size;
+	memcpy(buf, &t->items[t->pos], n);
+	t->pos += n;
+	*num_read = n;
+	return 0;
+}
+
+static int trickle_read(void *ctx, size_t size, void *buf)
+{
+	Trickle *t = ctx;
+	if (t->len - t->pos < size) return 1;
+	memcpy(buf, &t->items[t->pos], size);
+	t->pos += size;
+	return 0;
+}
+
+static int parse(const char *src, size_t len, bool stable, OsuBeatmap *out)
+{
+	if (stable) {
+		ByteSlice slice = { .items = (char *) src, .len = len };
+		StreamReader reader;
+		memory_reader_init(&reader, &slice);
+		return osup_parse_osu(&reader, out);
+	}
+	Trickle trickle = { .items = src, .len = len };
+	StreamReader reader = {
+		.ctx = &trickle,
+		.read_n = trickle_read,
+		.read_some = trickle_read_some,
+	};
+	return osup_parse_osu(&reader, out);
+}
+
+static void check_fixture(const char *name, bool stable)
+{
+	OsuBeatmap beatmap;
+	int ret = parse(fixture, sizeof(fixture) - 1, stable, &beatmap);
+	if (ret < 0) {
+		check(false, "%s: could not parse: %s\n", name, osup_error_msg(ret));
+		return;
+	}
+	check(beatmap.owned == !stable, "%s: owned is %d\n", name, beatmap.owned);
+	check(beatmap.format_version == 14, "%s: format version %d\n", name, beatmap.format_version);
+	check(beatmap.sections[OSUP_SECTION_EVENTS].items != NULL, "%s: [Events] missing\n", name);
+	check(beatmap.sections[OSUP_SECTION_DIFFICULTY].items == NULL, "%s: [Difficulty] found\n", name);
+
+	/* The first [General] wins, its comment is skipped and \r trimmed */
+	Str value;
+	int64_t mode;
+	check(osup_find_value(&beatmap, OSUP_SECTION_GENERAL, "AudioFilename", &value) == 0
+	      && str_eq(value, "audio.mp3"), "%s: AudioFilename is %.*s\n", name, (int) value.len, value.items);
+	check(osup_find_i64(&beatmap, OSUP_SECTION_GENERAL, "Mode", &mode) == 0 && mode == 3,
+	      "%s: Mode is %lld\n", name, (long long) mode);
+	check(osup_find_value(&beatmap, OSUP_SECTION_METADATA, "Version", &value) == 0 && str_eq(value, "Hard"),
+	      "%s: Version is \"%.*s\"\n", name, (int) value.len, value.items);
+	check(osup_find_value(&beatmap, OSUP_SECTION_METADATA, "Artist", &value) == 1, "%s: found Artist\n", name);
+
+	OsuDifficulty difficulty;
+	check(osup_parse_difficulty(&beatmap, &difficulty) == 0
+	      && difficulty.hp_drain_rate == 5.0f && difficulty.circle_size == 5.0f
+	      && difficulty.overall_difficulty == 5.0f && difficulty.approach_rate == 5.0f
+	      && difficulty.slider_multiplier == 1.4 && difficulty.slider_tick_rate == 1.0,
+	      "%s: [Difficulty] defaults wrong\n", name);
+
+	OsuTimingPoints points;
+	if (osup_parse_timing_points(&beatmap, &points) < 0) {
+		check(false, "%s: could not parse timing points\n", name);
+	} else {
+		check(points.len == 3, "%s: %zu timing points\n", name, points.len);
+		if (points.len == 3) {
+			const OsuTimingPoint *p = points.items;
+			check(p[0].time == 0.0 && p[0].beat_length == 500.0 && p[0].meter == 4 && p[0].sample_set == 2
+			      && p[0].volume == 60 && p[0].uninherited && p[0].effects == 0,
+			      "%s: timing point 0 wrong\n", name);
+			check(p[1].time == 1000.0 && p[1].beat_length == -50.0 && !p[1].uninherited && p[1].effects == 1,
+			      "%s: timing point 1 wrong\n", name);
+			check(p[2].time == 2000.0 && p[2].beat_length == 400.0 && p[2].meter == 4 && p[2].volume == 100
+			      && p[2].uninherited, "%s: timing point 2 defaults wrong\n", name);
+		}
+		osup_timing_points_destroy(&points);
+	}
+
+	OsuHitObjects objects;
+	if (osup_parse_hit_objects(&beatmap, &objects) < 0) {
+		check(false, "%s: could not parse hit objects\n", name);
+		osup_beatmap_destroy(&beatmap);
+		return;
+	}
+	check(objects.len == 4, "%s: %zu hit objects\n", name, objects.len);
+	if (objects.len == 4) {
+		check(objects.type[0] == (OSUP_HIT_CIRCLE | OSUP_HIT_NEW_COMBO) && objects.time[0] == 100.0f
+		      && objects.end_time[0] == 100.0f && objects.curve_len[0] == 0 && objects.curve_type[0] == 0,
+		      "%s: circle wrong\n", name);
+
+		check(objects.type[1] == OSUP_HIT_SLIDER && objects.x[1] == 100.0f && objects.time[1] == 500.0f
+		      && objects.hitsound[1] == 2 && objects.curve_type[1] == 'B' && objects.curve_len[1] == 3
+		      && objects.slides[1] == 2 && objects.length[1] == 250.5f,
+		      "%s: slider wrong\n", name);
+		static const OsuCurvePoint curve[] = { { 200, 100 }, { 200, 200 }, { 300, 200 } };
+		for (size_t i = 0; i < 3 && objects.curve_len[1] == 3; ++i) {
+			const OsuCurvePoint *point = &objects.curve_points[objects.curve_offset[1] + i];
+			check(point->x == curve[i].x && point->y == curve[i].y, "%s: slider point %zu is %g:%g\n",
+			      name, i, point->x, point->y);
+		}
+
+		check(objects.type[2] == (OSUP_HIT_SPINNER | OSUP_HIT_NEW_COMBO) && objects.time[2] == 1000.0f
+		      && objects.end_time[2] == 3000.0f && objects.curve_len[2] == 0,
+		      "%s: spinner wrong\n", name);
+		check(objects.type[3] == OSUP_HIT_HOLD && objects.x[3] == 64.0f && objects.time[3] == 4000.0f
+		      && objects.end_time[3] == 4500.0f,
+		      "%s: hold ends at %g\n", name, objects.end_time[3]);
+	}
+	osup_hit_objects_destroy(&objects);
+	osup_beatmap_destroy(&beatmap);
+}
+
+int main(void)
+{
+	check_fixture("lent", true);
+	check_fixture("copied", false);
+
+	OsuBeatmap beatmap;
+	OsuDifficulty difficulty;
+	if (parse(old_fixture, sizeof(old_fixture) - 1, true, &beatmap) < 0) {
+		check(false, "old: could not parse\n");
+	} else {
+		check(beatmap.format_version == 5, "old: format version %d\n", beatmap.format_version);
+		check(osup_parse_difficulty(&beatmap, &difficulty) == 0 && difficulty.hp_drain_rate == 6.0f
+		      && difficulty.overall_difficulty == 7.0f && difficulty.approach_rate == 7.0f
+		      && difficulty.circle_size == 5.0f, "old: [Difficulty] wrong\n");
+		osup_beatmap_destroy(&beatmap);
+	}
+
+	static const char not_osu[] = "[General]\r\nMode: 0\r\n";
+	check(parse(not_osu, sizeof(not_osu) - 1, true, &beatmap) == -EOSU_UNKNOWN_FILE,
+	      "headerless: not rejected\n");
+
+	printf("osu parser: %d failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -68,6 +68,19 @@
  *
  * assert(!qa_remove(&arr, &len, 6, NULL));
  *
+ * // Test reserve
+ * qa_reserve(&arr, &len, &cap, 100);
+ * assert(cap == len + 100);
+ *
+ * // Test remove range
+ * assert(qa_remove_range(&arr, &len, 1, 3));
+ * assert(len == 3);
+ * assert(arr[0] == 10);
+ * assert(arr[1] == 404);
+ * assert(arr[2] == 505);
+ *
+ * assert(!qa_remove_range(&arr, &len, 2, 2));
+ *
  * free(arr);
  */
 
@@ -77,6 +90,8 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "allocator.h"
+
 #ifndef QARRAY_MALLOC
 
 #include <stdlib.h>
@@ -104,6 +119,42 @@
 		++*(len);                                                      \
 	} while (0)
 
+/* Grows the capacity to exactly `len + n` if it is any smaller */
+#define qa_reserve(ptr, len, cap, n)                                           \
+	do {                                                                   \
+		if (*(len) + (n) > *(cap)) {                                   \
+			*(cap) = *(len) + (n);                                 \
+			*(ptr) = qa_realloc(*(ptr), sizeof(**(ptr)) * *(cap)); \
+		}                                                              \
+	} while (0)
+
+/*
+ * Variants of `qa_push` and `qa_reserve` taking their memory from an
+ * `Allocator` (see allocator.h) instead of `QARRAY_REALLOC`
+ */
+#define qa_push_alloc(allocator, ptr, len, cap, v)                             \
+	do {                                                                   \
+		if (*(len) >= *(cap)) {                                        \
+			size_t _qa_cap = *(cap) > 0 ? *(cap) * 2 : 16;         \
+			*(ptr) = allocator_realloc(allocator, *(ptr),          \
+				sizeof(**(ptr)) * *(cap),                      \
+				sizeof(**(ptr)) * _qa_cap);                    \
+			*(cap) = _qa_cap;                                      \
+		}                                                              \
+		(*(ptr))[*(len)] = v;                                          \
+		++*(len);                                                      \
+	} while (0)
+
+#define qa_reserve_alloc(allocator, ptr, len, cap, n)                          \
+	do {                                                                   \
+		if (*(len) + (n) > *(cap)) {                                   \
+			*(ptr) = allocator_realloc(allocator, *(ptr),          \
+				sizeof(**(ptr)) * *(cap),                      \
+				sizeof(**(ptr)) * (*(len) + (n)));             \
+			*(cap) = *(len) + (n);                                 \
+		}                                                              \
+	} while (0)
+
 #define qa_pop(ptr, len, out) ((*(len) > 0) ? \
 	(--*(len), _qa_set(out, *(ptr), sizeof(**(ptr)), *(len)), true) : \
 	false)
@@ -116,17 +167,26 @@
 	(_qa_set(out, *(ptr), sizeof(**(ptr)), idx), _qa_remove(*(ptr), len, sizeof(**(ptr)), idx), true) : \
 	false)
 
+#define qa_remove_range(ptr, len, idx, n) ((idx) <= *(len) && (n) <= *(len) - (idx) ? \
+	(_qa_remove_range(*(ptr), len, sizeof(**(ptr)), idx, n), true) : \
+	false)
+
 static inline void _qa_set(void *out, const void *ptr, size_t size, size_t idx)
 {
 	if (out) memcpy(out, &((char *) ptr)[idx * size], size);
 }
 
+static inline void _qa_remove_range(void *ptr, size_t *len, size_t size, size_t idx, size_t n)
+{
+	if (n == 0) return;
+	char *p = ptr;
+	memmove(&p[idx * size], &p[(idx + n) * size], (*len - idx - n) * size);
+	*len -= n;
+}
+
 static inline void _qa_remove(void *ptr, size_t *len, size_t size, size_t idx)
 {
-	for (size_t i = idx; i < *len - 1; ++i) {
-		_qa_set(&(((char *) ptr)[i * size]), ptr, size, i + 1);
-	}
-	--*len;
+	_qa_remove_range(ptr, len, size, idx, 1);
 }
 
 #endif
@@ -0,0 +1,252 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "stream.h"
+
+/* Hands out whatever is left in the buffer, up to `n` bytes */
+static size_t buffered_drain(BufferedReader *br, size_t n, char *dst)
+{
+	StreamReader *r = &br->reader;
+	size_t take = r->buf_len < n ? r->buf_len : n;
+	if (take == 0) return 0;
+	if (dst) memcpy(dst, r->buf, take);
+	r->buf += take;
+	r->buf_len -= take;
+	return take;
+}
+
+static int buffered_read_n(void *ctx, size_t n, void *buf)
+{
+	BufferedReader *br = ctx;
+	StreamReader *r = &br->reader;
+	StreamReader *inner = br->inner;
+	char *dst = buf;
+
+	size_t drained = buffered_drain(br, n, dst);
+	dst += drained;
+	n -= drained;
+
+	/* Large reads skip the extra copy */
+	if (!inner->read_some || n >= br->cap) {
+		return n ? stream_read(inner, n, dst) : 0;
+	}
+
+	while (n > 0) {
+		size_t num_read;
+		int ret = inner->read_some(inner->ctx, br->cap, br->buf, &num_read);
+		if (ret < 0) return ret;
+		if (num_read == 0) return 1;
+		inner->pos += num_read;
+
+		r->buf = br->buf;
+		r->buf_len = num_read;
+		drained = buffered_drain(br, n, dst);
+		dst += drained;
+		n -= drained;
+	}
+	return 0;
+}
+
+static int buffered_read_some(void *ctx, size_t n, void *buf, size_t *num_read)
+{
+	BufferedReader *br = ctx;
+	StreamReader *inner = br->inner;
+
+	*num_read = buffered_drain(br, n, buf);
+	if (*num_read > 0) return 0;
+
+	int ret = inner->read_some(inner->ctx, n, buf, num_read);
+	if (ret == 0) inner->pos += *num_read;
+	return ret;
+}
+
+static int buffered_skip_n(void *ctx, size_t n)
+{
+	BufferedReader *br = ctx;
+	n -= buffered_drain(br, n, NULL);
+	return n ? stream_skip(br->inner, n) : 0;
+}
+
+void buffered_reader_init(BufferedReader *br, StreamReader *inner, char *buf, size_t cap)
+{
+	br->reader = (StreamReader) {
+		.ctx = br,
+		.read_n = buffered_read_n,
+		.skip_n = buffered_skip_n,
+		.read_some = inner->read_some ? buffered_read_some : NULL,
+	};
+	br->inner = inner;
+	br->buf = buf;
+	br->cap = cap;
+}
+
+int buffered_writer_flush(BufferedWriter *bw)
+{
+	StreamWriter *w = &bw->writer;
+	size_t pending = (size_t) (w->buf - bw->buf);
+	w->buf = bw->buf;
+	w->buf_len = bw->cap;
+	return pending ? stream_write(bw->inner, pending, bw->buf) : 0;
+}
+
+/* Only called for writes that don't fit in what's left of the buffer */
+static int buffered_write_n(void *ctx, size_t n, const void *buf)
+{
+	BufferedWriter *bw = ctx;
+	StreamWriter *w = &bw->writer;
+
+	int ret = buffered_writer_flush(bw);
+	if (ret < 0) return ret;
+
+	/* Large writes skip the extra copy */
+	if (n >= bw->cap) return stream_write(bw->inner, n, buf);
+
+	memcpy(w->buf, buf, n);
+	w->buf += n;
+	w->buf_len -= n;
+	return 0;
+}
+
+void buffered_writer_init(BufferedWriter *bw, StreamWriter *inner, char *buf, size_t cap)
+{
+	bw->writer = (StreamWriter) {
+		.ctx = bw,
+		.write_n = buffered_write_n,
+		.buf = buf,
+		.buf_len = cap,
+	};
+	bw->inner = inner;
+	bw->buf = buf;
+	bw->cap = cap;
+}
+
+/* Only called once the slice is exhausted */
+static int memory_read_n(void *ctx, size_t n, void *buf)
+{
+	(void) ctx;
+	(void) n;
+	(void) buf;
+	return 1;
+}
+
+static int memory_skip_n(void *ctx, size_t n)
+{
+	(void) ctx;
+	(void) n;
+	return 1;
+}
+
+static int memory_read_some(void *ctx, size_t n, void *buf, size_t *num_read)
+{
+	(void) ctx;
+	(void) n;
+	(void) buf;
+	*num_read = 0;
+	return 0;
+}
+
+void memory_reader_init(StreamReader *reader, const ByteSlice *slice)
+{
+	*reader = (StreamReader) {
+		.read_n = memory_read_n,
+		.skip_n = memory_skip_n,
+		.read_some = memory_read_some,
+		.buf = slice->items,
+		.buf_len = slice->len,
+		.stable = true,
+	};
+}
+
+#ifdef _WIN32
+/* XXX: No mmap here; the whole file is read into memory instead */
+int mapped_file_open(MappedFile *mapped, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) return -1;
+
+	long len;
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return -1;
+	}
+
+	mapped->data.len = (size_t) len;
+	mapped->data.items = NULL;
+	if (mapped->data.len > 0) {
+		mapped->data.items = malloc(mapped->data.len);
+		if (!mapped->data.items || fread(mapped->data.items, 1, mapped->data.len, f) != mapped->data.len) {
+			free(mapped->data.items);
+			mapped->data.items = NULL;
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+
+	memory_reader_init(&mapped->reader, &mapped->data);
+	return 0;
+}
+
+void mapped_file_advise_random(MappedFile *mapped)
+{
+	(void) mapped;
+}
+
+void mapped_file_close(MappedFile *mapped)
+{
+	free(mapped->data.items);
+	mapped->data.items = NULL;
+	mapped->data.len = 0;
+}
+#else
+int mapped_file_open(MappedFile *mapped, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+
+	mapped->data.len = (size_t) st.st_size;
+	mapped->data.items = NULL;
+	if (mapped->data.len > 0) {
+		void *p = mmap(NULL, mapped->data.len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(p, mapped->data.len, MADV_SEQUENTIAL);
+		mapped->data.items = p;
+	}
+	/* The mapping stays valid after the descriptor is closed */
+	close(fd);
+
+	memory_reader_init(&mapped->reader, &mapped->data);
+	return 0;
+}
+
+void mapped_file_advise_random(MappedFile *mapped)
+{
+	if (mapped->data.items) madvise(mapped->data.items, mapped->data.len, MADV_RANDOM);
+}
+
+void mapped_file_close(MappedFile *mapped)
+{
+	if (mapped->data.items) munmap(mapped->data.items, mapped->data.len);
+	mapped->data.items = NULL;
+	mapped->data.len = 0;
+}
+#endif
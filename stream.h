@@ -1,6 +1,12 @@
 #ifndef STREAM_H
 #define STREAM_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "string_builder.h"
+
 typedef struct StreamReader {
 	void *ctx;
 
@@ -11,6 +17,40 @@ typedef struct StreamReader {
 	 * int read_n(void *ctx, size_t num_bytes, void *buf);
 	 */
 	int (*read_n)(void *, size_t, void *);
+
+	/* Optional, `skip_n` will advance the stream by n bytes without
+	 * reading them (ie: seek). When NULL, skipped bytes are read and
+	 * discarded instead.
+	 *
+	 * Return < 0 for error, 1 for EOS
+	 *
+	 * int skip_n(void *ctx, size_t num_bytes);
+	 */
+	int (*skip_n)(void *, size_t);
+
+	/* Optional, `read_some` will fill at most n bytes into `buf` and
+	 * report how many through `num_read`. Required by `BufferedReader`
+	 * to refill its buffer without over-reading.
+	 *
+	 * Return < 0 for error, 0 with `num_read` of 0 for EOS
+	 *
+	 * int read_some(void *ctx, size_t num_bytes, void *buf, size_t *num_read);
+	 */
+	int (*read_some)(void *, size_t, void *, size_t *);
+
+	/* Number of bytes consumed through `stream_read` and `stream_skip` */
+	size_t pos;
+
+	/* Bytes already buffered ahead; these are consumed inline by
+	 * `stream_read` and `stream_skip` before falling back to `read_n`
+	 */
+	const char *buf;
+	size_t buf_len;
+
+	/* `buf` outlives the reader and holds the rest of the stream, so
+	 * slices into it can be handed out; see `stream_borrow`
+	 */
+	bool stable;
 } StreamReader;
 
 typedef struct StreamWriter {
@@ -24,6 +64,143 @@ typedef struct StreamWriter {
 	 * int write_n(void *ctx, size_t num_bytes, const void *buf);
 	 */
 	int (*write_n)(void *, size_t, const void *);
+
+	/* Free space in a buffer ahead of `write_n`; writes that fit are
+	 * copied here inline by `stream_write`
+	 */
+	char *buf;
+	size_t buf_len;
 } StreamWriter;
 
+/*
+ * Wraps any `StreamReader` so that small reads are served from `buf`
+ * (`cap` bytes, owned by the caller) without an indirect call.
+ *
+ * Parse through `&buffered.reader`. When the wrapped reader has no
+ * `read_some`, reads are passed through unbuffered.
+ */
+typedef struct BufferedReader {
+	StreamReader reader;
+	StreamReader *inner;
+	char *buf;
+	size_t cap;
+} BufferedReader;
+
+void buffered_reader_init(BufferedReader *buffered, StreamReader *inner, char *buf, size_t cap);
+
+/*
+ * Wraps any `StreamWriter` so that small writes are gathered in `buf`
+ * (`cap` bytes, owned by the caller) and passed on in `cap` sized blocks.
+ *
+ * Write through `&buffered.writer`, and call `buffered_writer_flush`
+ * before touching `inner` again or letting go of the writer.
+ */
+typedef struct BufferedWriter {
+	StreamWriter writer;
+	StreamWriter *inner;
+	char *buf;
+	size_t cap;
+} BufferedWriter;
+
+void buffered_writer_init(BufferedWriter *buffered, StreamWriter *inner, char *buf, size_t cap);
+
+/* Returns < 0 when `inner` fails; the buffered bytes are dropped */
+int buffered_writer_flush(BufferedWriter *buffered);
+
+/*
+ * Reads directly out of `slice`, which must outlive the reader.
+ */
+void memory_reader_init(StreamReader *reader, const ByteSlice *slice);
+
+/*
+ * Memory maps the file at `path` read-only and exposes it through
+ * `mapped.reader` (a memory reader over `mapped.data`). Without mmap
+ * (ie: on Windows) the file is read into memory instead.
+ *
+ * Returns < 0 on error. Release with `mapped_file_close`.
+ */
+typedef struct MappedFile {
+	StreamReader reader;
+	ByteSlice data;
+} MappedFile;
+
+int mapped_file_open(MappedFile *mapped, const char *path);
+
+/*
+ * Mappings are opened for reading front to back, with read-ahead; this
+ * drops it for files that are then read in no particular order.
+ */
+void mapped_file_advise_random(MappedFile *mapped);
+
+void mapped_file_close(MappedFile *mapped);
+
+static inline int stream_read(StreamReader *reader, size_t n, void *buf)
+{
+	if (reader->buf_len >= n && reader->buf_len > 0) {
+		memcpy(buf, reader->buf, n);
+		reader->buf += n;
+		reader->buf_len -= n;
+		reader->pos += n;
+		return 0;
+	}
+
+	int ret = reader->read_n(reader->ctx, n, buf);
+	if (ret == 0) reader->pos += n;
+	return ret;
+}
+
+static inline int stream_skip(StreamReader *reader, size_t n)
+{
+	int ret = 0;
+	if (reader->buf_len >= n) {
+		reader->buf += n;
+		reader->buf_len -= n;
+		reader->pos += n;
+		return 0;
+	}
+
+	if (reader->skip_n) {
+		ret = reader->skip_n(reader->ctx, n);
+		if (ret == 0) reader->pos += n;
+		return ret;
+	}
+
+	char scratch[1024 * 4];
+	while (n > 0) {
+		size_t chunk = n < sizeof(scratch) ? n : sizeof(scratch);
+		ret = stream_read(reader, chunk, scratch);
+		if (ret != 0) return ret;
+		n -= chunk;
+	}
+	return 0;
+}
+
+static inline int stream_write(StreamWriter *writer, size_t n, const void *buf)
+{
+	if (writer->buf_len >= n && writer->buf_len > 0) {
+		memcpy(writer->buf, buf, n);
+		writer->buf += n;
+		writer->buf_len -= n;
+		return 0;
+	}
+
+	return writer->write_n(writer->ctx, n, buf);
+}
+
+/*
+ * Consumes the next n bytes and returns a pointer to them without copying.
+ *
+ * Returns NULL (consuming nothing) when the reader is not `stable` or
+ * fewer than n bytes remain.
+ */
+static inline const char *stream_borrow(StreamReader *reader, size_t n)
+{
+	if (!reader->stable || reader->buf_len < n) return NULL;
+	const char *p = reader->buf;
+	reader->buf += n;
+	reader->buf_len -= n;
+	reader->pos += n;
+	return p;
+}
+
 #endif
@@ -13,23 +13,32 @@
 #define INT_MAX_WDITH 10
 #endif
 
+static bool grow(StringBuilder *sb, size_t n)
+{
+	size_t cap = sb->cap ? sb->cap : DEFAULT_STRING_BUILDER_CAP;
+	while (sb->len + n > cap) cap *= 2;
+	sb->items = allocator_realloc(sb->allocator, sb->items, sb->cap, cap);
+	sb->cap = cap;
+	return true;
+}
+
 static inline bool resize_needed(StringBuilder *sb, size_t n)
 {
-	bool resized = false;
-	assert(n >= 1);
-	while (sb->len + n > sb->cap) {
-		sb->cap *= 2;
-		resized = true;
-	}
-	if (resized) sb->items = xrealloc(sb->items, sb->cap);
-	return resized;
+	if (sb->len + n <= sb->cap) return false;
+	return grow(sb, n);
 }
 
-void string_builder_init_cap(StringBuilder *sb, size_t cap)
+void string_builder_init_alloc(StringBuilder *sb, size_t cap, const Allocator *allocator)
 {
 	sb->len = 0;
 	sb->cap = cap;
-	sb->items = xmalloc(sizeof(*sb->items) * cap);
+	sb->allocator = allocator;
+	sb->items = allocator_alloc(allocator, sizeof(*sb->items) * cap);
+}
+
+void string_builder_init_cap(StringBuilder *sb, size_t cap)
+{
+	string_builder_init_alloc(sb, cap, NULL);
 }
 
 void string_builder_init(StringBuilder *sb)
@@ -37,6 +46,14 @@ void string_builder_init(StringBuilder *sb)
 	string_builder_init_cap(sb, DEFAULT_STRING_BUILDER_CAP);
 }
 
+bool string_builder_reserve(StringBuilder *sb, size_t n)
+{
+	if (sb->len + n <= sb->cap) return false;
+	sb->items = allocator_realloc(sb->allocator, sb->items, sb->cap, sb->len + n);
+	sb->cap = sb->len + n;
+	return true;
+}
+
 bool string_builder_push(StringBuilder *sb, char c)
 {
 	bool resized = resize_needed(sb, 1);
@@ -46,16 +63,12 @@ bool string_builder_push(StringBuilder *sb, char c)
 
 bool string_builder_push_cstr(StringBuilder *sb, char *s)
 {
-	bool resized = false;
-	while (*s) {
-		resized = string_builder_push(sb, *s);
-		++s;
-	}
-	return resized;
+	return string_builder_push_str(sb, (Str) { .items = s, .len = strlen(s) });
 }
 
 bool string_builder_push_str(StringBuilder *sb, Str s)
 {
+	if (s.len == 0) return false;
 	bool resized = resize_needed(sb, s.len);
 	char *offset = sb->items + sb->len;
 	memcpy(offset, s.items, s.len);
@@ -132,7 +145,7 @@ bool string_builder_printf(StringBuilder *sb, char *fmt, ...)
 
 void string_builder_free(StringBuilder *sb)
 {
-	free(sb->items);
+	allocator_free(sb->allocator, sb->items);
 }
 
 Str string_builder_build(StringBuilder *sb)
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 
+#include "allocator.h"
+
 #define DEFAULT_STRING_BUILDER_CAP 16
 
 #define to_str(s) (Str){ .len = sizeof(s) - 1, .items = (s) }
@@ -12,11 +14,15 @@
  * on the respective `Str`.
  *
  * Underlying `char *` is not guarenteed to be NULL terminated.
+ *
+ * Memory comes from `allocator`, the heap when NULL. Set it before the
+ * first push, or use `string_builder_init_alloc`.
  */
 typedef struct ByteArray {
 	size_t len;
 	size_t cap;
 	char *items;
+	const Allocator *allocator;
 } ByteArray;
 
 typedef ByteArray StringBuilder;
@@ -37,6 +43,15 @@ void string_builder_init_cap(StringBuilder *string_builder, size_t cap);
 
 void string_builder_init(StringBuilder *string_builder);
 
+void string_builder_init_alloc(StringBuilder *string_builder, size_t cap, const Allocator *allocator);
+
+/*
+ * Ensure room for `n` more bytes with at most one reallocation.
+ *
+ * Capacity is set to exactly `len + n`, use when the final size is known.
+ */
+bool string_builder_reserve(StringBuilder *string_builder, size_t n);
+
 bool string_builder_push(StringBuilder *string_builder, char c);
 
 /*
@@ -5,6 +5,10 @@
  * ```
  *   char *prefix_error_msg(void) { return xerror_str; }
  * ```
+ *
+ * The error str is thread local, so each thread only ever sees the
+ * messages of its own failures. Define XERROR_THREAD_LOCAL (possibly
+ * empty) to override the storage class.
  */
 
 #ifndef XERROR_H
@@ -54,14 +58,26 @@
 #define XERROR_MAX (1024 * 4)
 #endif
 
+#ifndef XERROR_THREAD_LOCAL
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define XERROR_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define XERROR_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define XERROR_THREAD_LOCAL __declspec(thread)
+#else
+#error "xerror.h: No thread local storage, define XERROR_THREAD_LOCAL"
+#endif
+#endif
+
 #define xerror_vsnprintf   XERROR_VSNPRINTF
 #define xerror_strcat      XERROR_STRCAT
 #define xerror_memcpy      XERROR_MEMCPY
 #define xerror_assert      XERROR_ASSERT
 #define xerror_overflow_cb XERROR_OVERFLOW_CB
 
-static char xerror_str[XERROR_MAX];
-static size_t xerror_str_len;
+static XERROR_THREAD_LOCAL char xerror_str[XERROR_MAX];
+static XERROR_THREAD_LOCAL size_t xerror_str_len;
 
 /* XXX: Compile-time length check */
 /* Use with static str */